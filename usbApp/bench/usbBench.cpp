@@ -0,0 +1,306 @@
+/*
+ * Measures the cost of decoding and encoding reports through the DataIO
+ * types without any USB hardware. Reports are run through a port that is
+ * never connected to a device, so timings include the asyn param library
+ * the same as they would in a running IOC.
+ *
+ * usage: usbBench <spec file> [recorded reports] [iterations]
+ *
+ * Recorded reports are one per line as hex bytes, the output of usbShowIO
+ * can be used directly. Without them, synthetic reports are generated that
+ * change a few bits at a time, like a joystick being moved.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+
+#include <epicsTime.h>
+#include <asynPortDriver.h>
+
+#include "DataIO.h"
+#include "DataLayout.h"
+
+
+static const char* TYPE_NAMES[] =
+{
+	"Int8", "Int16", "Int32", "UInt8", "UInt16", "UInt32", "UInt32Digital",
+	"Bool", "String", "Float32", "Float64", "Int8Array", "Int16Array",
+	"Int32Array", "Float32Array", "Float64Array", "Event"
+};
+
+static const unsigned NUM_TYPES = sizeof(TYPE_NAMES) / sizeof(TYPE_NAMES[0]);
+
+static const unsigned NUM_SYNTHETIC = 1024;
+static const unsigned DEFAULT_ITERATIONS = 200;
+
+/* Reports are padded so wide loads near the end stay in bounds */
+static const unsigned REPORT_PADDING = 16;
+
+
+class BenchDriver : public asynPortDriver
+{
+	public:
+		BenchDriver(DataLayout& spec)
+		:asynPortDriver( "BENCH",
+		                 1,
+		                 spec.size(),
+		                 spec.interface_mask(),
+		                 spec.interrupt_mask(),
+		                 ASYN_MULTIDEVICE,
+		                 0,
+		                 0,
+		                 0)
+		{
+			for (unsigned index = 0; index < spec.size(); index += 1)
+			{
+				Allocation* layout = spec.get(index);
+				
+				this->createParam(layout->name.c_str(), layout->type.param, &layout->index);
+			}
+			
+			spec.compile();
+		}
+};
+
+
+static double now()
+{
+	epicsTimeStamp stamp;
+	
+	epicsTimeGetCurrent(&stamp);
+	
+	return stamp.secPastEpoch + stamp.nsec * 1e-9;
+}
+
+
+static const char* type_name(const DataType& type)
+{
+	for (unsigned index = 0; index < NUM_TYPES; index += 1)
+	{
+		DataType known;
+		
+		type_from_string(TYPE_NAMES[index], &known);
+		
+		if (known.read == type.read)    { return TYPE_NAMES[index]; }
+	}
+	
+	return "Unknown";
+}
+
+
+static unsigned report_length(DataLayout& spec)
+{
+	unsigned output = 0;
+	
+	for (unsigned index = 0; index < spec.size(); index += 1)
+	{
+		Allocation* layout = spec.get(index);
+		
+		unsigned end = layout->start + std::max(layout->length, layout->type.width);
+		
+		if (end > output)    { output = end; }
+	}
+	
+	return output;
+}
+
+
+/* Accepts "01 02 03" as well as usbShowIO's "PORT: 01 02 03" */
+static void load_reports(const char* filename, unsigned length, std::vector<std::vector<uint8_t> >* reports)
+{
+	std::ifstream input(filename);
+	std::string line;
+	
+	if (not input.is_open())
+	{
+		printf("Error: couldn't open file (%s).\n", filename);
+		return;
+	}
+	
+	while (getline(input, line))
+	{
+		size_t colon = line.find(':');
+		
+		if (colon != std::string::npos)    { line = line.substr(colon + 1); }
+		
+		std::stringstream bytes(line);
+		std::vector<uint8_t> report(length + REPORT_PADDING, 0);
+		
+		unsigned value;
+		unsigned count = 0;
+		
+		while (bytes >> std::hex >> value)
+		{
+			if (count < length)    { report[count] = (uint8_t) value; }
+			count += 1;
+		}
+		
+		if (count > 0)    { reports->push_back(report); }
+	}
+}
+
+
+static void synthetic_reports(unsigned length, std::vector<std::vector<uint8_t> >* reports)
+{
+	std::vector<uint8_t> report(length + REPORT_PADDING, 0);
+	
+	srand(1);
+	
+	for (unsigned index = 0; index < NUM_SYNTHETIC; index += 1)
+	{
+		unsigned flips = 1 + rand() % 3;
+		
+		for (unsigned flip = 0; flip < flips and length > 0; flip += 1)
+		{
+			report[rand() % length] ^= (uint8_t) (1 << (rand() % 8));
+		}
+		
+		reports->push_back(report);
+	}
+}
+
+
+int main(int argc, char** argv)
+{
+	if (argc < 2)
+	{
+		printf("usage: %s <spec file> [recorded reports] [iterations]\n", argv[0]);
+		return 1;
+	}
+	
+	DataLayout spec(argv[1]);
+	
+	if (spec.size() == 0)
+	{
+		printf("Error: no params found in %s\n", argv[1]);
+		return 1;
+	}
+	
+	BenchDriver driver(spec);
+	
+	unsigned length = report_length(spec);
+	unsigned iterations = (argc > 3) ? atoi(argv[3]) : DEFAULT_ITERATIONS;
+	
+	std::vector<std::vector<uint8_t> > reports;
+	
+	if (argc > 2)    { load_reports(argv[2], length, &reports); }
+	else             { synthetic_reports(length, &reports); }
+	
+	if (reports.empty())
+	{
+		printf("Error: no reports to decode\n");
+		return 1;
+	}
+	
+	unsigned num_reports = reports.size();
+	double total_reports = (double) num_reports * iterations;
+	
+	printf("%s: %u params, %u byte reports, %u reports x %u iterations\n\n",
+	       argv[1], spec.size(), length, num_reports, iterations);
+	
+	
+	/* Every field through its type's read function, the original path */
+	double start = now();
+	
+	for (unsigned iter = 0; iter < iterations; iter += 1)
+	{
+		for (unsigned report = 0; report < num_reports; report += 1)
+		{
+			uint8_t* data = &reports[report][0];
+			
+			for (unsigned index = 0; index < spec.size(); index += 1)
+			{
+				Allocation* layout = spec.get(index);
+				
+				layout->type.read(&driver, &data[layout->start], layout);
+			}
+		}
+	}
+	
+	double per_call = (now() - start) / total_reports * 1e9;
+	
+	printf("%-24s %10.1f ns/report %8.1f ns/field\n", "decode (per field)", per_call, per_call / spec.size());
+	
+	
+	/* The compiled plan, only decoding fields that changed */
+	start = now();
+	
+	for (unsigned iter = 0; iter < iterations; iter += 1)
+	{
+		for (unsigned report = 0; report < num_reports; report += 1)
+		{
+			uint8_t* data = &reports[report][0];
+			const uint8_t* previous = &reports[(report + num_reports - 1) % num_reports][0];
+			
+			spec.decode(&driver, data, previous);
+		}
+	}
+	
+	per_call = (now() - start) / total_reports * 1e9;
+	
+	printf("%-24s %10.1f ns/report %8.1f ns/field\n\n", "decode (plan)", per_call, per_call / spec.size());
+	
+	
+	/* Each type on its own, reading and writing only the fields of that type */
+	std::vector<uint8_t> encoded(length + REPORT_PADDING, 0);
+	
+	for (unsigned type = 0; type < NUM_TYPES; type += 1)
+	{
+		std::vector<Allocation*> fields;
+		
+		for (unsigned index = 0; index < spec.size(); index += 1)
+		{
+			if (strcmp(type_name(spec.get(index)->type), TYPE_NAMES[type]) == 0)
+			{
+				fields.push_back(spec.get(index));
+			}
+		}
+		
+		if (fields.empty())    { continue; }
+		
+		double num_fields = total_reports * fields.size();
+		
+		start = now();
+		
+		for (unsigned iter = 0; iter < iterations; iter += 1)
+		{
+			for (unsigned report = 0; report < num_reports; report += 1)
+			{
+				uint8_t* data = &reports[report][0];
+				
+				for (unsigned index = 0; index < fields.size(); index += 1)
+				{
+					fields[index]->type.read(&driver, &data[fields[index]->start], fields[index]);
+				}
+			}
+		}
+		
+		double read_ns = (now() - start) / num_fields * 1e9;
+		
+		start = now();
+		
+		for (unsigned iter = 0; iter < iterations; iter += 1)
+		{
+			for (unsigned report = 0; report < num_reports; report += 1)
+			{
+				for (unsigned index = 0; index < fields.size(); index += 1)
+				{
+					fields[index]->type.write(&driver, &encoded[fields[index]->start], fields[index]);
+				}
+			}
+		}
+		
+		double write_ns = (now() - start) / num_fields * 1e9;
+		
+		printf("%-14s x%-3u      read %8.1f ns/field   write %8.1f ns/field\n",
+		       TYPE_NAMES[type], (unsigned) fields.size(), read_ns, write_ns);
+	}
+	
+	return 0;
+}
@@ -0,0 +1,63 @@
+/*
+ * Prints the reports from a capture made with usbStartCapture, starting
+ * from any point in it.
+ *
+ * usage: usbCaptureDump <capture file> [start seconds] [count]
+ *
+ * Each report is printed on its own line with the time and port in front,
+ * in the same format as usbShowIO, so the output can be given straight to
+ * usbBench or replayed through a mock device.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+
+#include "ReportCapture.h"
+
+static const char* STATUS_NAMES[] =
+{
+	"success", "timeout", "overflow", "error", "disconnected", "disabled"
+};
+
+
+int main(int argc, char** argv)
+{
+	if (argc < 2)
+	{
+		printf("usage: %s <capture file> [start seconds] [count]\n", argv[0]);
+		return 1;
+	}
+	
+	CaptureReader reader;
+	
+	if (not reader.open(argv[1]))    { return 1; }
+	
+	if (argc > 2)    { reader.seek(atof(argv[2])); }
+	
+	long count = (argc > 3) ? atol(argv[3]) : -1;
+	
+	CaptureRecord record;
+	
+	while (count != 0 and reader.next(&record))
+	{
+		const char* direction = (record.kind == CAPTURE_OUTPUT) ? "out" : "in";
+		
+		printf("%12.6f %s %s: ", record.time * 1e-6, reader.portName(record.port).c_str(), direction);
+		
+		if (record.length == 0 and record.status < sizeof(STATUS_NAMES) / sizeof(STATUS_NAMES[0]))
+		{
+			printf("(%s)", STATUS_NAMES[record.status]);
+		}
+		
+		for (unsigned index = 0; index < record.length; index += 1)
+		{
+			printf("%02X ", record.data[index]);
+		}
+		
+		printf("\n");
+		
+		if (count > 0)    { count -= 1; }
+	}
+	
+	return 0;
+}
@@ -1,9 +1,11 @@
 #include <cstring>
 #include <cmath>
+#include <stdint.h>
 
 #include <epicsTypes.h>
 
 #include "Allocation.h"
+#include "ArrayConvert.h"
 #include "DataType.h"
 #include "DataIO.h"
 
@@ -52,6 +54,21 @@ static void write_FLOAT32ARRAY(asynPortDriver* callback, uint8_t* data, void* al
 static void read_FLOAT64ARRAY(asynPortDriver* callback, uint8_t* data, void* alloc);
 static void write_FLOAT64ARRAY(asynPortDriver* callback, uint8_t* data, void* alloc);
 
+static void read_INT16SCALED(asynPortDriver* callback, uint8_t* data, void* alloc);
+static void write_INT16SCALED(asynPortDriver* callback, uint8_t* data, void* alloc);
+
+static void read_INT32SCALED(asynPortDriver* callback, uint8_t* data, void* alloc);
+static void write_INT32SCALED(asynPortDriver* callback, uint8_t* data, void* alloc);
+
+static void read_FLOAT32SCALED(asynPortDriver* callback, uint8_t* data, void* alloc);
+static void write_FLOAT32SCALED(asynPortDriver* callback, uint8_t* data, void* alloc);
+
+static void read_PACKED(asynPortDriver* callback, uint8_t* data, void* alloc);
+static void write_PACKED(asynPortDriver* callback, uint8_t* data, void* alloc);
+
+static void read_PACKEDSCALED(asynPortDriver* callback, uint8_t* data, void* alloc);
+static void write_PACKEDSCALED(asynPortDriver* callback, uint8_t* data, void* alloc);
+
 static void read_STRING(asynPortDriver* callback, uint8_t* data, void* alloc);
 static void write_STRING(asynPortDriver* callback, uint8_t* data, void* alloc);
 
@@ -62,24 +79,29 @@ static void read_UNKNOWN(asynPortDriver* callback, uint8_t* data, void* alloc);
 static void write_UNKNOWN(asynPortDriver* callback, uint8_t* data, void* alloc);
 
 
-static DataType TYPE_UNKNOWN(read_UNKNOWN, write_UNKNOWN, asynParamInt32, asynInt32Mask);
-static DataType TYPE_INT8(read_INT8, write_INT8, asynParamInt32, asynInt32Mask);
-static DataType TYPE_INT16(read_INT16, write_INT16, asynParamInt32, asynInt32Mask);
-static DataType TYPE_INT32(read_INT32, write_INT32, asynParamInt32, asynInt32Mask);
-static DataType TYPE_UINT8(read_UINT8, write_UINT8, asynParamInt32, asynInt32Mask);
-static DataType TYPE_UINT16(read_UINT16, write_UINT16, asynParamInt32, asynInt32Mask);
-static DataType TYPE_UINT32(read_UINT32, write_UINT32, asynParamInt32, asynInt32Mask);
-static DataType TYPE_UINT32DIGITAL(read_UINT32DIGITAL, write_UINT32DIGITAL, asynParamUInt32Digital, asynUInt32DigitalMask);
-static DataType TYPE_BOOLEAN(read_BOOLEAN, write_BOOLEAN, asynParamInt32, asynInt32Mask);
-static DataType TYPE_FLOAT32(read_FLOAT32, write_FLOAT32, asynParamFloat64, asynFloat64Mask);
-static DataType TYPE_FLOAT64(read_FLOAT64, write_FLOAT64, asynParamFloat64, asynFloat64Mask);
-static DataType TYPE_STRING(read_STRING, write_STRING, asynParamOctet, asynOctetMask);
-static DataType TYPE_INT8ARRAY(read_INT8ARRAY, write_INT8ARRAY, asynParamInt8Array, asynInt8ArrayMask);
-static DataType TYPE_INT16ARRAY(read_INT16ARRAY, write_INT16ARRAY, asynParamInt16Array, asynInt16ArrayMask);
-static DataType TYPE_INT32ARRAY(read_INT32ARRAY, write_INT32ARRAY, asynParamInt32Array, asynInt32ArrayMask);
-static DataType TYPE_FLOAT32ARRAY(read_FLOAT32ARRAY, write_FLOAT32ARRAY, asynParamFloat32Array, asynFloat32ArrayMask);
-static DataType TYPE_FLOAT64ARRAY(read_FLOAT64ARRAY, write_FLOAT64ARRAY, asynParamFloat64Array, asynFloat64ArrayMask);
-static DataType TYPE_EVENT(read_EVENT, write_EVENT, asynParamInt32, asynInt32Mask);
+static DataType TYPE_UNKNOWN(read_UNKNOWN, write_UNKNOWN, asynParamInt32, asynInt32Mask, DECODE_NONE, 0);
+static DataType TYPE_INT8(read_INT8, write_INT8, asynParamInt32, asynInt32Mask, DECODE_SIGNED, 1);
+static DataType TYPE_INT16(read_INT16, write_INT16, asynParamInt32, asynInt32Mask, DECODE_SIGNED, 2);
+static DataType TYPE_INT32(read_INT32, write_INT32, asynParamInt32, asynInt32Mask, DECODE_SIGNED, 4);
+static DataType TYPE_UINT8(read_UINT8, write_UINT8, asynParamInt32, asynInt32Mask, DECODE_UNSIGNED, 1);
+static DataType TYPE_UINT16(read_UINT16, write_UINT16, asynParamInt32, asynInt32Mask, DECODE_UNSIGNED, 2);
+static DataType TYPE_UINT32(read_UINT32, write_UINT32, asynParamInt32, asynInt32Mask, DECODE_UNSIGNED, 4);
+static DataType TYPE_UINT32DIGITAL(read_UINT32DIGITAL, write_UINT32DIGITAL, asynParamUInt32Digital, asynUInt32DigitalMask, DECODE_DIGITAL, 4);
+static DataType TYPE_BOOLEAN(read_BOOLEAN, write_BOOLEAN, asynParamInt32, asynInt32Mask, DECODE_BOOLEAN, 4);
+static DataType TYPE_FLOAT32(read_FLOAT32, write_FLOAT32, asynParamFloat64, asynFloat64Mask, DECODE_FLOAT32, 4);
+static DataType TYPE_FLOAT64(read_FLOAT64, write_FLOAT64, asynParamFloat64, asynFloat64Mask, DECODE_FLOAT64, 8);
+static DataType TYPE_STRING(read_STRING, write_STRING, asynParamOctet, asynOctetMask, DECODE_GENERIC, 0);
+static DataType TYPE_INT8ARRAY(read_INT8ARRAY, write_INT8ARRAY, asynParamInt8Array, asynInt8ArrayMask, DECODE_GENERIC, 0);
+static DataType TYPE_INT16ARRAY(read_INT16ARRAY, write_INT16ARRAY, asynParamInt16Array, asynInt16ArrayMask, DECODE_GENERIC, 0);
+static DataType TYPE_INT32ARRAY(read_INT32ARRAY, write_INT32ARRAY, asynParamInt32Array, asynInt32ArrayMask, DECODE_GENERIC, 0);
+static DataType TYPE_FLOAT32ARRAY(read_FLOAT32ARRAY, write_FLOAT32ARRAY, asynParamFloat32Array, asynFloat32ArrayMask, DECODE_GENERIC, 0);
+static DataType TYPE_FLOAT64ARRAY(read_FLOAT64ARRAY, write_FLOAT64ARRAY, asynParamFloat64Array, asynFloat64ArrayMask, DECODE_GENERIC, 0);
+static DataType TYPE_INT16SCALED(read_INT16SCALED, write_INT16SCALED, asynParamFloat64Array, asynFloat64ArrayMask, DECODE_GENERIC, 0);
+static DataType TYPE_INT32SCALED(read_INT32SCALED, write_INT32SCALED, asynParamFloat64Array, asynFloat64ArrayMask, DECODE_GENERIC, 0);
+static DataType TYPE_FLOAT32SCALED(read_FLOAT32SCALED, write_FLOAT32SCALED, asynParamFloat64Array, asynFloat64ArrayMask, DECODE_GENERIC, 0);
+static DataType TYPE_PACKED(read_PACKED, write_PACKED, asynParamInt32Array, asynInt32ArrayMask, DECODE_GENERIC, 0);
+static DataType TYPE_PACKEDSCALED(read_PACKEDSCALED, write_PACKEDSCALED, asynParamFloat64Array, asynFloat64ArrayMask, DECODE_GENERIC, 0);
+static DataType TYPE_EVENT(read_EVENT, write_EVENT, asynParamInt32, asynInt32Mask, DECODE_EVENT, 0);
 
 /**
  * Parses the name field from specification files into a type to be used
@@ -176,6 +198,11 @@ bool type_from_string(std::string type_input, DataType* output)
 		*output = TYPE_FLOAT64ARRAY;
 	}
 
+	else if (type_input == "PackedArray" || type_input == "packedarray")
+	{ 
+		*output = TYPE_PACKED;
+	}
+	
 	else if (type_input == "Event" || type_input == "event")
 	{ 
 		*output = TYPE_EVENT;
@@ -191,18 +218,65 @@ bool type_from_string(std::string type_input, DataType* output)
 }
 
 
+/**
+ * Swaps an array type for one that converts its elements to and from a
+ * Float64 waveform, used for array fields given an endian, scale or offset.
+ *
+ * @param[in,out] type    The type parsed from the spec file
+ *
+ * @return The size of each element, or 0 if the type can't be converted
+ */
+unsigned converted_type(DataType* type)
+{
+	if (type->read == read_INT16ARRAY)
+	{
+		*type = TYPE_INT16SCALED;
+		return 2;
+	}
+	
+	else if (type->read == read_INT32ARRAY)
+	{
+		*type = TYPE_INT32SCALED;
+		return 4;
+	}
+	
+	else if (type->read == read_FLOAT32ARRAY)
+	{
+		*type = TYPE_FLOAT32SCALED;
+		return 4;
+	}
+	
+	/* Packed samples are unpacked to 32 bits before they're scaled */
+	else if (type->read == read_PACKED)
+	{
+		*type = TYPE_PACKEDSCALED;
+		return 4;
+	}
+	
+	return 0;
+}
+
+
+bool packed_type(const DataType& type)
+{
+	return (type.read == read_PACKED);
+}
+
+
 
 
 static int num_bits(unsigned mask)
 {
-	if (mask == 0)    { return 0; }
+	/* Ordinal position of the most significant bit set in the mask */
+	int output = 0;
 	
-	/*
-	 * To determine the most "leftward" bit, we can take the base 2 log of the
-	 * mask. The ceil of the log gives us the ordinal position of the most
-	 * significant bit.
-	 */
-	return (int) ceil(log(mask) / log(2));
+	while (mask)
+	{
+		output += 1;
+		mask >>= 1;
+	}
+	
+	return output;
 }
 
 
@@ -222,9 +296,15 @@ static void read_signed(asynPortDriver* callback, uint8_t* data, Allocation* lay
 	 */
 	int bitsize = std::min(mask_bitsize, (int) (layout->length * 8 - layout->shift));
 	
+	if (bitsize <= 0 or bitsize >= 32)
+	{
+		callback->setIntegerParam(layout->index, itemp);
+		return;
+	}
+	
 	int shift = 32 - bitsize;
 	
-	callback->setIntegerParam(layout->index, ((itemp << shift) >> shift));
+	callback->setIntegerParam(layout->index, ((epicsInt32) ((epicsUInt32) itemp << shift) >> shift));
 }
 
 
@@ -239,11 +319,15 @@ static void read_unsigned(asynPortDriver* callback, uint8_t* data, Allocation* l
 	callback->setIntegerParam(layout->index, utemp);
 }
 
+/**
+ * Writes are made into a persistent report, so the param's own bits have to 
+ * be cleared before the new value is set, leaving its neighbors untouched.
+ */
 static void write_int(asynPortDriver* callback, uint8_t* data, void* alloc, int max_bytes)
 {
 	epicsInt32 temp;
 	epicsUInt32 value;
-	epicsInt32 current;
+	epicsUInt32 current = 0;
 	
 	Allocation* layout = (Allocation*) alloc;
 	
@@ -255,7 +339,7 @@ static void write_int(asynPortDriver* callback, uint8_t* data, void* alloc, int
 	
 	value &= layout->mask;
 	value <<= layout->shift;
-	current |= value;
+	current = (current & ~layout->clear) | value;
 	
 	memcpy(data, &current, std::min(max_bytes, (int) layout->length));
 }
@@ -356,8 +440,8 @@ static void write_UINT32(asynPortDriver* callback, uint8_t* data, void* alloc)
 
 /**
  * Digital ints are also simple copys, treat up to four bytes as a 32bit 
- * unsigned int, and apply mask. Due to how asynPortDriver treats digital 
- * params, there isn't a good way to handle shifts, so we don't.
+ * unsigned int, shift over, then apply mask. The mask is passed along to
+ * asynPortDriver, so only the bits it covers are changed.
  *
  * @param[out] callback    Which driver is calling.
  * @param[in]  data        A pointer to the start of the bytes to be interpreted.
@@ -371,7 +455,7 @@ static void read_UINT32DIGITAL(asynPortDriver* callback, uint8_t* data, void* al
 
 	memcpy(&utemp, data, std::min(4, (int) layout->length));
 
-	callback->setUIntDigitalParam(layout->index, utemp, layout->mask);
+	callback->setUIntDigitalParam(layout->index, (utemp >> layout->shift) & layout->mask, layout->mask);
 }
 
 static void write_UINT32DIGITAL(asynPortDriver* callback, uint8_t* data, void* alloc)
@@ -414,14 +498,9 @@ static void write_BOOLEAN(asynPortDriver* callback, uint8_t* data, void* alloc)
 	callback->getIntegerParam(layout->index, &temp);
 	memcpy(&current, data, std::min(4, (int) layout->length));
 	
-	value = (epicsUInt32) temp;
-	
-	uint8_t test[1];
-	memcpy(test, &value, 1);
-	
-	value *= layout->mask;
+	value = (temp == 0) ? 0 : layout->mask;
 	value <<= layout->shift;
-	current |= value;
+	current = (current & ~layout->clear) | value;
 	
 	memcpy(data, &current, std::min(4, (int) layout->length));
 }
@@ -503,11 +582,12 @@ static void read_STRING(asynPortDriver* callback, uint8_t* data, void* alloc)
 	
 	unsigned length = std::min(40, (int) (layout->length));
 	
-	epicsInt8 buffer[length];
+	char buffer[41];
 	
-	memcpy(&buffer, data, length);
+	memcpy(buffer, data, length);
+	buffer[length] = '\0';
 	
-	callback->setStringParam(layout->index, (const char*) buffer);
+	callback->setStringParam(layout->index, buffer);
 }
 
 static void write_STRING(asynPortDriver* callback, uint8_t* data, void* alloc)
@@ -517,7 +597,40 @@ static void write_STRING(asynPortDriver* callback, uint8_t* data, void* alloc)
 }
 
 /**
- * This is literally a copy of the array, while bitshifting and masking make 
+ * Arrays are handed to asyn straight out of the report, which isn't reused
+ * until every callback has returned. Fields that aren't aligned for their
+ * element type are copied into the allocation's own scratch space first,
+ * which is sized along with the allocation so nothing is allocated here.
+ *
+ * @param[in]  data        A pointer to the start of the array in the report.
+ * @param[in]  layout      The array's allocation.
+ * @param[in]  alignment   The size of each element.
+ */
+static void* aligned_array(uint8_t* data, Allocation* layout, unsigned alignment)
+{
+	if (((uintptr_t) data % alignment) == 0)    { return data; }
+	
+	memcpy(&layout->scratch[0], data, layout->length);
+	
+	return &layout->scratch[0];
+}
+
+
+/**
+ * Array writes leave the values in the allocation's scratch space, since asyn
+ * doesn't keep arrays as params, and they're copied into the report as is.
+ *
+ * @param[out] data        A pointer to the start of the array in the report.
+ * @param[in]  layout      The array's allocation.
+ */
+static void write_array(uint8_t* data, Allocation* layout)
+{
+	memcpy(data, &layout->scratch[0], layout->length);
+}
+
+
+/**
+ * This is literally the array, while bitshifting and masking make 
  * sense here, it is too complicated to implement initally.
  *
  * @param[out] callback    Which driver is calling.
@@ -527,15 +640,14 @@ static void write_STRING(asynPortDriver* callback, uint8_t* data, void* alloc)
 static void read_INT8ARRAY(asynPortDriver* callback, uint8_t* data, void* alloc)
 {	
 	Allocation* layout = (Allocation*) alloc;
-
-	epicsInt8 atemp[layout->length];
-	
-	memcpy(atemp, data, layout->length);
 	
-	callback->doCallbacksInt8Array(atemp, layout->length, layout->index, 0);
+	callback->doCallbacksInt8Array((epicsInt8*) data, layout->length, layout->index, 0);
 }
 
-static void write_INT8ARRAY(asynPortDriver* callback, uint8_t* data, void* alloc) { /* To Do */ }
+static void write_INT8ARRAY(asynPortDriver* callback, uint8_t* data, void* alloc)
+{
+	write_array(data, (Allocation*) alloc);
+}
 
 
 /**
@@ -552,14 +664,15 @@ static void read_INT16ARRAY(asynPortDriver* callback, uint8_t* data, void* alloc
 	
 	unsigned len = layout->length >> 1;
 	
-	epicsInt16 atemp[len];
-	
-	memcpy(atemp, data, layout->length);
+	epicsInt16* array = (epicsInt16*) aligned_array(data, layout, sizeof(epicsInt16));
 	
-	callback->doCallbacksInt16Array(atemp, len, layout->index, 0);
+	callback->doCallbacksInt16Array(array, len, layout->index, 0);
 }
 
-static void write_INT16ARRAY(asynPortDriver* callback, uint8_t* data, void* alloc) { /* To Do */ }
+static void write_INT16ARRAY(asynPortDriver* callback, uint8_t* data, void* alloc)
+{
+	write_array(data, (Allocation*) alloc);
+}
 
 
 /**
@@ -575,15 +688,16 @@ static void read_INT32ARRAY(asynPortDriver* callback, uint8_t* data, void* alloc
 	Allocation* layout = (Allocation*) alloc;
 	
 	unsigned len = layout->length >> 2;
-						
-	epicsInt32 atemp[len];
 	
-	memcpy(atemp, data, layout->length);
+	epicsInt32* array = (epicsInt32*) aligned_array(data, layout, sizeof(epicsInt32));
 	
-	callback->doCallbacksInt32Array(atemp, len, layout->index, 0);
+	callback->doCallbacksInt32Array(array, len, layout->index, 0);
 }
 
-static void write_INT32ARRAY(asynPortDriver* callback, uint8_t* data, void* alloc) { /* To Do */ }
+static void write_INT32ARRAY(asynPortDriver* callback, uint8_t* data, void* alloc)
+{
+	write_array(data, (Allocation*) alloc);
+}
 
 
 /**
@@ -599,14 +713,15 @@ static void read_FLOAT32ARRAY(asynPortDriver* callback, uint8_t* data, void* all
 
 	unsigned len = layout->length >> 2;
 	
-	epicsFloat32 atemp[len];
-	
-	memcpy(atemp, data, layout->length);
+	epicsFloat32* array = (epicsFloat32*) aligned_array(data, layout, sizeof(epicsFloat32));
 	
-	callback->doCallbacksFloat32Array(atemp, len, layout->index, 0);
+	callback->doCallbacksFloat32Array(array, len, layout->index, 0);
 }
 
-static void write_FLOAT32ARRAY(asynPortDriver* callback, uint8_t* data, void* alloc) { /* To Do */ }
+static void write_FLOAT32ARRAY(asynPortDriver* callback, uint8_t* data, void* alloc)
+{
+	write_array(data, (Allocation*) alloc);
+}
 
 
 /**
@@ -621,15 +736,129 @@ static void read_FLOAT64ARRAY(asynPortDriver* callback, uint8_t* data, void* all
 	Allocation* layout = (Allocation*) alloc;
 	
 	unsigned len = layout->length >> 3;
-						
-	epicsFloat64 atemp[len];
 	
-	memcpy(atemp, data, layout->length);
+	epicsFloat64* array = (epicsFloat64*) aligned_array(data, layout, sizeof(epicsFloat64));
 	
-	callback->doCallbacksFloat64Array(atemp, len, layout->index, 0);
+	callback->doCallbacksFloat64Array(array, len, layout->index, 0);
 }
 
-static void write_FLOAT64ARRAY(asynPortDriver* callback, uint8_t* data, void* alloc) { /* To Do */ }
+static void write_FLOAT64ARRAY(asynPortDriver* callback, uint8_t* data, void* alloc)
+{
+	write_array(data, (Allocation*) alloc);
+}
+
+
+/**
+ * Converted arrays are published as Float64 waveforms in engineering units,
+ * swapping bytes and applying the field's scale and offset on the way. The
+ * waveform is built in the allocation's scratch space, which is sized for
+ * one double per element. Writes go the other way, from the waveform that
+ * was last written back into the report's own element type.
+ *
+ * @param[out] callback    Which driver is calling.
+ * @param[in]  data        A pointer to the start of the bytes to be interpreted.
+ * @param[in]  layout      Other information about how to interpret the parameter.
+ */
+static void read_INT16SCALED(asynPortDriver* callback, uint8_t* data, void* alloc)
+{
+	Allocation* layout = (Allocation*) alloc;
+	
+	unsigned len = layout->length >> 1;
+	
+	int16_to_float64(data, &layout->scratch[0], len, layout->scaling);
+	
+	callback->doCallbacksFloat64Array(&layout->scratch[0], len, layout->index, 0);
+}
+
+static void write_INT16SCALED(asynPortDriver* callback, uint8_t* data, void* alloc)
+{
+	Allocation* layout = (Allocation*) alloc;
+	
+	float64_to_int16(&layout->scratch[0], data, layout->length >> 1, layout->scaling);
+}
+
+
+static void read_INT32SCALED(asynPortDriver* callback, uint8_t* data, void* alloc)
+{
+	Allocation* layout = (Allocation*) alloc;
+	
+	unsigned len = layout->length >> 2;
+	
+	int32_to_float64(data, &layout->scratch[0], len, layout->scaling);
+	
+	callback->doCallbacksFloat64Array(&layout->scratch[0], len, layout->index, 0);
+}
+
+static void write_INT32SCALED(asynPortDriver* callback, uint8_t* data, void* alloc)
+{
+	Allocation* layout = (Allocation*) alloc;
+	
+	float64_to_int32(&layout->scratch[0], data, layout->length >> 2, layout->scaling);
+}
+
+
+static void read_FLOAT32SCALED(asynPortDriver* callback, uint8_t* data, void* alloc)
+{
+	Allocation* layout = (Allocation*) alloc;
+	
+	unsigned len = layout->length >> 2;
+	
+	float32_to_float64(data, &layout->scratch[0], len, layout->scaling);
+	
+	callback->doCallbacksFloat64Array(&layout->scratch[0], len, layout->index, 0);
+}
+
+static void write_FLOAT32SCALED(asynPortDriver* callback, uint8_t* data, void* alloc)
+{
+	Allocation* layout = (Allocation*) alloc;
+	
+	float64_to_float32(&layout->scratch[0], data, layout->length >> 2, layout->scaling);
+}
+
+
+/**
+ * Packed arrays unpack every sample of the field in one pass, into an
+ * Int32Array or, with a scale or offset, a Float64Array. The samples are
+ * built in the allocation's scratch space, which has a double for each.
+ *
+ * @param[out] callback    Which driver is calling.
+ * @param[in]  data        A pointer to the start of the bytes to be interpreted.
+ * @param[in]  layout      Other information about how to interpret the parameter.
+ */
+static void read_PACKED(asynPortDriver* callback, uint8_t* data, void* alloc)
+{
+	Allocation* layout = (Allocation*) alloc;
+	
+	epicsInt32* array = (epicsInt32*) &layout->scratch[0];
+	
+	unpack_int32(data, layout->length, layout->shift, layout->packing, array);
+	
+	callback->doCallbacksInt32Array(array, layout->packing.count, layout->index, 0);
+}
+
+static void write_PACKED(asynPortDriver* callback, uint8_t* data, void* alloc)
+{
+	Allocation* layout = (Allocation*) alloc;
+	
+	pack_int32((epicsInt32*) &layout->scratch[0], data, layout->length, layout->shift, layout->packing);
+}
+
+
+static void read_PACKEDSCALED(asynPortDriver* callback, uint8_t* data, void* alloc)
+{
+	Allocation* layout = (Allocation*) alloc;
+	
+	unpack_float64(data, layout->length, layout->shift, layout->packing, &layout->scratch[0], layout->scaling);
+	
+	callback->doCallbacksFloat64Array(&layout->scratch[0], layout->packing.count, layout->index, 0);
+}
+
+static void write_PACKEDSCALED(asynPortDriver* callback, uint8_t* data, void* alloc)
+{
+	Allocation* layout = (Allocation*) alloc;
+	
+	pack_float64(&layout->scratch[0], data, layout->length, layout->shift, layout->packing, layout->scaling);
+}
 
 
 /**
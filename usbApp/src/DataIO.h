@@ -12,4 +12,13 @@
   */
 bool type_from_string(std::string type_input, DataType* output);
 
+/**
+  * Used for array fields with an endian, scale or offset setting, replaces
+  * the type with one publishing a converted Float64 waveform.
+  */
+unsigned converted_type(DataType* type);
+
+/** Packed arrays need their sample width and count set up from the spec */
+bool packed_type(const DataType& type);
+
 #endif
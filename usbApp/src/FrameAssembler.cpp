@@ -0,0 +1,122 @@
+#include <cstring>
+#include <algorithm>
+
+#include "FrameAssembler.h"
+
+FrameAssembler::FrameAssembler()
+:	pending_segments(0),
+	pending_header(0),
+	pending_index_byte(0),
+	pending_index_mask(0xFF),
+	segments(0),
+	header(0),
+	index_byte(0),
+	index_mask(0xFF),
+	index_shift(0),
+	payload(0),
+	next(0)
+{
+}
+
+
+void FrameAssembler::configure(unsigned segments, unsigned header, unsigned index_byte, unsigned index_mask)
+{
+	this->pending_segments   = segments;
+	this->pending_header     = header;
+	this->pending_index_byte = index_byte;
+	this->pending_index_mask = index_mask & 0xFF;
+}
+
+
+void FrameAssembler::resize(unsigned packet_size)
+{
+	this->segments   = this->pending_segments;
+	this->header     = this->pending_header;
+	this->index_byte = this->pending_index_byte;
+	this->index_mask = this->pending_index_mask;
+	
+	/* The index is the masked bits shifted down to start at zero */
+	this->index_shift = 0;
+	
+	while (this->index_mask != 0 and ((this->index_mask >> this->index_shift) & 1) == 0)    { this->index_shift += 1; }
+	
+	this->payload = (packet_size > this->header) ? packet_size - this->header : 0;
+	
+	this->buffer.assign(this->frameSize(packet_size), 0);
+	
+	this->next = 0;
+}
+
+
+bool FrameAssembler::enabled()    { return this->segments > 0; }
+
+
+unsigned FrameAssembler::frameSize(unsigned packet_size)
+{
+	if (packet_size <= this->header)    { return 0; }
+	
+	return this->segments * (packet_size - this->header);
+}
+
+
+/*
+ * A segment that isn't the one expected ends the frame being built. If it
+ * happens to be the first segment of a frame, a new one is started from it
+ * rather than waiting for the next.
+ */
+FrameAssembler::Result FrameAssembler::add(const uint8_t* data, unsigned length)
+{
+	if (this->payload == 0 or length <= this->header or length <= this->index_byte)
+	{
+		return this->abandon() ? GAP : PARTIAL;
+	}
+	
+	unsigned index = (data[this->index_byte] & this->index_mask) >> this->index_shift;
+	
+	/* An index past the last segment can't be part of any frame */
+	if (index >= this->segments)    { return this->abandon() ? GAP : PARTIAL; }
+	
+	Result output = PARTIAL;
+	
+	/*
+	 * Only dropping a partial frame counts as a gap. Between frames, the
+	 * rest of a frame that was already on its way when we started are
+	 * just skipped until the next one begins.
+	 */
+	if (index != this->next)
+	{
+		if (this->abandon())    { output = GAP; }
+		
+		if (index != 0)    { return output; }
+	}
+	
+	unsigned size = std::min(length - this->header, this->payload);
+	unsigned offset = index * this->payload;
+	
+	memcpy(&this->buffer[offset], data + this->header, size);
+	
+	/* Anything after a short segment is left zeroed rather than stale */
+	if (size < this->payload)    { memset(&this->buffer[offset + size], 0, this->payload - size); }
+	
+	this->next = index + 1;
+	
+	if (this->next < this->segments)    { return output; }
+	
+	this->next = 0;
+	
+	return COMPLETE;
+}
+
+
+bool FrameAssembler::abandon()
+{
+	bool partial = (this->next != 0);
+	
+	this->next = 0;
+	
+	return partial;
+}
+
+
+uint8_t* FrameAssembler::frame()     { return this->buffer.empty() ? NULL : &this->buffer[0]; }
+unsigned FrameAssembler::length()    { return this->buffer.size(); }
@@ -0,0 +1,74 @@
+#ifndef INC_FRAMEASSEMBLER_H
+#define INC_FRAMEASSEMBLER_H
+
+#include <stdint.h>
+#include <vector>
+
+/**
+ * Gathers packets carrying segments of a larger logical frame, for devices
+ * whose reports don't fit in a single packet.
+ *
+ * Every packet starts with a header of a fixed number of bytes, one of which
+ * holds the segment's index in the frame. Payloads are placed at a fixed 
+ * offset of index * (packet size - header), so fields address the whole
+ * frame no matter how long any one segment was. A frame is only complete 
+ * once every segment has arrived in order, a missing or out of order segment
+ * throws away the frame being built.
+ *
+ * New settings are held until the next resize, so a frame is never built
+ * with settings its buffer wasn't sized for.
+ *
+ * Only used from the publisher thread, so nothing here is locked.
+ */
+class FrameAssembler
+{
+	public:
+		enum Result
+		{
+			PARTIAL,
+			COMPLETE,
+			GAP
+		};
+		
+		FrameAssembler();
+		
+		/** Zero segments turns reassembly off, takes effect on the next resize */
+		void configure(unsigned segments, unsigned header, unsigned index_byte, unsigned index_mask);
+		
+		/** Applies any new settings and sizes the frame for the endpoint's packets, throwing away any partial frame */
+		void resize(unsigned packet_size);
+		
+		bool     enabled();
+		unsigned frameSize(unsigned packet_size);
+		
+		Result add(const uint8_t* data, unsigned length);
+		
+		/** Drops a partial frame, returns whether there was one */
+		bool abandon();
+		
+		/** The last complete frame, valid until the next call to add */
+		uint8_t* frame();
+		unsigned length();
+	
+	private:
+		std::vector<uint8_t> buffer;
+		
+		/* Settings given to configure, waiting for the next resize */
+		unsigned pending_segments;
+		unsigned pending_header;
+		unsigned pending_index_byte;
+		unsigned pending_index_mask;
+		
+		unsigned segments;
+		unsigned header;
+		unsigned index_byte;
+		unsigned index_mask;
+		unsigned index_shift;
+		
+		unsigned payload;
+		
+		/* Index of the segment expected next, 0 when between frames */
+		unsigned next;
+};
+
+#endif
@@ -0,0 +1,177 @@
+#include <string>
+
+#include "PortStatistics.h"
+
+const double PortStatistics::PERIOD = 1.0;
+
+static const char* COUNTER_NAMES[PortStatistics::NUM_COUNTERS] =
+{
+	"USB_REPORTS",
+	"USB_TIMEOUTS",
+	"USB_OVERFLOWS",
+	"USB_CANCELS",
+	"USB_RECONNECTS",
+	"USB_OUTPUTS",
+	"USB_FRAMES",
+	"USB_FRAME_GAPS"
+};
+
+static const char* TIMING_NAMES[PortStatistics::NUM_TIMINGS] =
+{
+	"USB_DECODE",
+	"USB_LATENCY",
+	"USB_OUTPUT_LATENCY"
+};
+
+
+static void reset_window(TimingWindow* window)
+{
+	window->count = 0;
+	window->sum   = 0.0;
+	window->min   = 0.0;
+	window->max   = 0.0;
+}
+
+
+PortStatistics::PortStatistics()
+:	last_reports(0),
+	rate_param(-1)
+{
+	for (int index = 0; index < NUM_COUNTERS; index += 1)
+	{
+		this->counts[index] = 0;
+		this->count_params[index] = -1;
+	}
+	
+	for (int index = 0; index < NUM_TIMINGS; index += 1)
+	{
+		reset_window(&this->timings[index]);
+		
+		this->min_params[index]  = -1;
+		this->mean_params[index] = -1;
+		this->max_params[index]  = -1;
+	}
+	
+	this->timing_lock = epicsMutexCreate();
+	
+	epicsTimeGetCurrent(&this->last_publish);
+}
+
+
+void PortStatistics::createParams(asynPortDriver* driver)
+{
+	for (int index = 0; index < NUM_COUNTERS; index += 1)
+	{
+		driver->createParam(COUNTER_NAMES[index], asynParamInt32, &this->count_params[index]);
+		driver->setIntegerParam(this->count_params[index], 0);
+	}
+	
+	driver->createParam("USB_REPORT_RATE", asynParamFloat64, &this->rate_param);
+	driver->setDoubleParam(this->rate_param, 0.0);
+	
+	for (int index = 0; index < NUM_TIMINGS; index += 1)
+	{
+		std::string name(TIMING_NAMES[index]);
+		
+		driver->createParam((name + "_MIN").c_str(), asynParamFloat64, &this->min_params[index]);
+		driver->createParam((name + "_MEAN").c_str(), asynParamFloat64, &this->mean_params[index]);
+		driver->createParam((name + "_MAX").c_str(), asynParamFloat64, &this->max_params[index]);
+		
+		driver->setDoubleParam(this->min_params[index], 0.0);
+		driver->setDoubleParam(this->mean_params[index], 0.0);
+		driver->setDoubleParam(this->max_params[index], 0.0);
+	}
+}
+
+
+void PortStatistics::count(Counter which)
+{
+	__atomic_add_fetch(&this->counts[which], 1, __ATOMIC_RELAXED);
+}
+
+
+void PortStatistics::time(Timing which, double seconds)
+{
+	double millis = seconds * 1000.0;
+	
+	epicsMutexLock(this->timing_lock);
+		TimingWindow* window = &this->timings[which];
+		
+		if (window->count == 0 or millis < window->min)    { window->min = millis; }
+		if (window->count == 0 or millis > window->max)    { window->max = millis; }
+		
+		window->count += 1;
+		window->sum   += millis;
+	epicsMutexUnlock(this->timing_lock);
+}
+
+
+void PortStatistics::time(Timing which, const epicsTimeStamp& since)
+{
+	epicsTimeStamp now;
+	
+	epicsTimeGetCurrent(&now);
+	
+	this->time(which, epicsTimeDiffInSeconds(&now, &since));
+}
+
+
+bool PortStatistics::due()
+{
+	epicsTimeStamp now;
+	
+	epicsTimeGetCurrent(&now);
+	
+	return epicsTimeDiffInSeconds(&now, &this->last_publish) >= PERIOD;
+}
+
+
+void PortStatistics::publish(asynPortDriver* driver)
+{
+	epicsTimeStamp now;
+	
+	epicsTimeGetCurrent(&now);
+	
+	double elapsed = epicsTimeDiffInSeconds(&now, &this->last_publish);
+	
+	this->last_publish = now;
+	
+	for (int index = 0; index < NUM_COUNTERS; index += 1)
+	{
+		unsigned long value = __atomic_load_n(&this->counts[index], __ATOMIC_RELAXED);
+		
+		/* asyn only has signed 32bit integers, so the counts wrap there */
+		driver->setIntegerParam(this->count_params[index], (epicsInt32) (value & 0x7FFFFFFF));
+	}
+	
+	unsigned long reports = __atomic_load_n(&this->counts[REPORTS], __ATOMIC_RELAXED);
+	
+	if (elapsed > 0.0)
+	{
+		driver->setDoubleParam(this->rate_param, (reports - this->last_reports) / elapsed);
+	}
+	
+	this->last_reports = reports;
+	
+	/* Copy the windows out so the lock isn't held through asyn calls */
+	TimingWindow windows[NUM_TIMINGS];
+	
+	epicsMutexLock(this->timing_lock);
+		for (int index = 0; index < NUM_TIMINGS; index += 1)
+		{
+			windows[index] = this->timings[index];
+			reset_window(&this->timings[index]);
+		}
+	epicsMutexUnlock(this->timing_lock);
+	
+	for (int index = 0; index < NUM_TIMINGS; index += 1)
+	{
+		TimingWindow* window = &windows[index];
+		
+		double mean = (window->count == 0) ? 0.0 : window->sum / window->count;
+		
+		driver->setDoubleParam(this->min_params[index], window->min);
+		driver->setDoubleParam(this->mean_params[index], mean);
+		driver->setDoubleParam(this->max_params[index], window->max);
+	}
+}
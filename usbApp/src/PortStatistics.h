@@ -0,0 +1,86 @@
+#ifndef INC_PORTSTATISTICS_H
+#define INC_PORTSTATISTICS_H
+
+#include <epicsTime.h>
+#include <epicsMutex.h>
+#include <asynPortDriver.h>
+
+/** Running min/mean/max of a duration over one publishing window */
+typedef struct TimingWindow
+{
+	unsigned long count;
+	double        sum;
+	double        min;
+	double        max;
+} TimingWindow;
+
+
+/**
+ * Performance counters kept by every hidDriver and published through a
+ * fixed set of built-in asyn parameters, see usbStatistics.template.
+ *
+ * Counters can be bumped from any thread, including the USB callbacks,
+ * without taking a lock. Timings are collected over a window and reset
+ * each time they are published.
+ */
+class PortStatistics
+{
+	public:
+		enum Counter
+		{
+			REPORTS,
+			TIMEOUTS,
+			OVERFLOWS,
+			CANCELS,
+			RECONNECTS,
+			OUTPUTS,
+			FRAMES,
+			FRAME_GAPS,
+			NUM_COUNTERS
+		};
+		
+		enum Timing
+		{
+			DECODE,
+			LATENCY,
+			OUTPUT,
+			NUM_TIMINGS
+		};
+		
+		/** Number of asyn parameters createParams will add */
+		static const int NUM_PARAMS = NUM_COUNTERS + 1 + 3 * NUM_TIMINGS;
+		
+		/** Seconds between updates of the parameters */
+		static const double PERIOD;
+		
+		PortStatistics();
+		
+		void createParams(asynPortDriver* driver);
+		
+		void count(Counter which);
+		void time(Timing which, double seconds);
+		void time(Timing which, const epicsTimeStamp& since);
+		
+		/** Whether a full period has passed since the last publish */
+		bool due();
+		
+		/** Needs to be called with the driver locked */
+		void publish(asynPortDriver* driver);
+	
+	private:
+		unsigned long counts[NUM_COUNTERS];
+		unsigned long last_reports;
+		
+		TimingWindow  timings[NUM_TIMINGS];
+		epicsMutexId  timing_lock;
+		
+		epicsTimeStamp last_publish;
+		
+		int count_params[NUM_COUNTERS];
+		int rate_param;
+		int min_params[NUM_TIMINGS];
+		int mean_params[NUM_TIMINGS];
+		int max_params[NUM_TIMINGS];
+};
+
+#endif
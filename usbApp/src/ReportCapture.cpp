@@ -0,0 +1,805 @@
+#include <cstring>
+#include <algorithm>
+#include <ctime>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <epicsThread.h>
+#include <epicsTime.h>
+#include <epicsExit.h>
+
+#include "ReportCapture.h"
+
+/* How often the writer thread wakes up to write out what's been recorded */
+static const double FLUSH_PERIOD = 0.1; //seconds
+
+/*
+ * Most raw reports that can be waiting on the writer. At a few thousand
+ * reports a second this is many seconds of slack for a slow disk.
+ */
+static const size_t MAX_PENDING = 4 * 1024 * 1024; //bytes
+
+/* Longest report the raw length field can hold, anything past it is cut off */
+static const unsigned MAX_REPORT_LENGTH = 0xFFFF; //bytes
+
+/* Time between the chunks that reading can be started from */
+static const uint64_t CHUNK_PERIOD = 1000000; //microseconds
+
+static const char CAPTURE_MAGIC[] = "USBCAP01";
+
+static epicsMutexId    capture_lock = epicsMutexCreate();
+static ReportCapture*  capture = NULL;
+
+/* Port numbering outlives any one capture, protected by capture_lock */
+static std::vector<std::string> port_names;
+
+
+/** Layout of each report waiting in the pending buffer, data follows */
+typedef struct RawReport
+{
+	uint64_t time;
+	uint32_t port;
+	uint16_t length;
+	uint8_t  kind;
+	uint8_t  status;
+} RawReport;
+
+
+static void writer_thread_callback(void* arg)    { ((ReportCapture*) arg)->writer_thread(); }
+static void stop_capture(void* arg)              { ((ReportCapture*) arg)->stop(); }
+
+
+static uint64_t monotonic_micros()
+{
+	struct timespec now;
+	
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void put_u32(std::vector<uint8_t>* output, uint32_t value)
+{
+	for (unsigned shift = 0; shift < 32; shift += 8)    { output->push_back((uint8_t) (value >> shift)); }
+}
+
+static void put_u64(std::vector<uint8_t>* output, uint64_t value)
+{
+	for (unsigned shift = 0; shift < 64; shift += 8)    { output->push_back((uint8_t) (value >> shift)); }
+}
+
+static void put_varint(std::vector<uint8_t>* output, uint64_t value)
+{
+	while (value >= 0x80)
+	{
+		output->push_back((uint8_t) (value | 0x80));
+		value >>= 7;
+	}
+	
+	output->push_back((uint8_t) value);
+}
+
+static uint64_t get_u64(const uint8_t* input)
+{
+	uint64_t output = 0;
+	
+	for (unsigned shift = 0; shift < 64; shift += 8)    { output |= (uint64_t) *input++ << shift; }
+	
+	return output;
+}
+
+
+ReportCapture* ReportCapture::instance()
+{
+	epicsMutexLock(capture_lock);
+		if (capture == NULL)
+		{
+			capture = new ReportCapture();
+			
+			/* Whatever is still buffered gets written out when the IOC exits */
+			epicsAtExit(stop_capture, capture);
+		}
+	epicsMutexUnlock(capture_lock);
+	
+	return capture;
+}
+
+
+unsigned ReportCapture::portId(const char* port_name)
+{
+	epicsMutexLock(capture_lock);
+		unsigned output = 0;
+		
+		while (output < port_names.size() and port_names[output] != port_name)    { output += 1; }
+		
+		if (output == port_names.size())    { port_names.push_back(port_name); }
+	epicsMutexUnlock(capture_lock);
+	
+	return output;
+}
+
+
+std::string ReportCapture::portName(unsigned port)
+{
+	std::string output;
+	
+	epicsMutexLock(capture_lock);
+		if (port < port_names.size())    { output = port_names[port]; }
+	epicsMutexUnlock(capture_lock);
+	
+	return output;
+}
+
+
+ReportCapture::ReportCapture()
+:	capturing(false),
+	recorded(0),
+	dropped(0),
+	file(NULL),
+	index(NULL),
+	written(0),
+	chunk_start(0),
+	last_time(0),
+	in_chunk(false),
+	named(0),
+	start_time(0),
+	bytes(0)
+{
+	this->lock     = epicsMutexCreate();
+	this->wakeup   = epicsEventCreate(epicsEventEmpty);
+	this->finished = epicsEventCreate(epicsEventEmpty);
+}
+
+
+uint64_t ReportCapture::now()    { return monotonic_micros() - this->start_time; }
+
+
+bool ReportCapture::start(const char* filename)
+{
+	epicsMutexLock(this->lock);
+		if (this->capturing)
+		{
+			epicsMutexUnlock(this->lock);
+			printf("Error: already capturing to %s.\n", this->filename.c_str());
+			return false;
+		}
+	epicsMutexUnlock(this->lock);
+	
+	std::string index_name = std::string(filename) + ".idx";
+	
+	FILE* capture_file = fopen(filename, "wb");
+	FILE* index_file   = fopen(index_name.c_str(), "wb");
+	
+	if (capture_file == NULL or index_file == NULL)
+	{
+		if (capture_file != NULL)    { fclose(capture_file); }
+		if (index_file != NULL)      { fclose(index_file); }
+		
+		printf("Error: couldn't open file (%s).\n", filename);
+		return false;
+	}
+	
+	epicsTimeStamp wall_clock;
+	epicsTimeGetCurrent(&wall_clock);
+	
+	std::vector<uint8_t> header(CAPTURE_MAGIC, CAPTURE_MAGIC + 8);
+	
+	put_u32(&header, wall_clock.secPastEpoch);
+	put_u32(&header, wall_clock.nsec);
+	
+	fwrite(&header[0], 1, header.size(), capture_file);
+	
+	/* The writer thread isn't running, so its state is ours to reset */
+	this->file      = capture_file;
+	this->index     = index_file;
+	this->written   = header.size();
+	this->in_chunk  = false;
+	this->named     = 0;
+	this->previous.clear();
+	this->index_pending.clear();
+	this->filename  = filename;
+	
+	epicsMutexLock(this->lock);
+		this->pending.clear();
+		this->pending.reserve(MAX_PENDING);
+		this->recorded   = 0;
+		this->dropped    = 0;
+		this->bytes      = this->written;
+		this->start_time = monotonic_micros();
+		
+		__atomic_store_n(&this->capturing, true, __ATOMIC_RELEASE);
+	epicsMutexUnlock(this->lock);
+	
+	epicsEventTryWait(this->finished);
+	
+	epicsThreadCreate("usbCapture",
+	                  epicsThreadPriorityLow,
+	                  epicsThreadGetStackSize(epicsThreadStackMedium),
+	                  (EPICSTHREADFUNC)::writer_thread_callback, this);
+	
+	return true;
+}
+
+
+void ReportCapture::stop()
+{
+	epicsMutexLock(this->lock);
+		bool was_capturing = this->capturing;
+		
+		__atomic_store_n(&this->capturing, false, __ATOMIC_RELEASE);
+	epicsMutexUnlock(this->lock);
+	
+	if (not was_capturing)    { return; }
+	
+	/* Wait for everything recorded so far to reach the file */
+	epicsEventSignal(this->wakeup);
+	epicsEventWait(this->finished);
+	
+	this->report(stdout);
+}
+
+
+/*
+ * Called from the USB callbacks and the output paths. Nothing is encoded
+ * here, the report is just stamped and copied so the caller isn't held up.
+ */
+void ReportCapture::record(unsigned port, CaptureKind kind, const uint8_t* data, unsigned length, asynStatus status)
+{
+	if (not __atomic_load_n(&this->capturing, __ATOMIC_ACQUIRE))    { return; }
+	
+	if (data == NULL)    { length = 0; }
+	
+	length = std::min(length, MAX_REPORT_LENGTH);
+	
+	RawReport raw;
+	
+	raw.port   = port;
+	raw.length = (uint16_t) length;
+	raw.kind   = (uint8_t) kind;
+	raw.status = (uint8_t) status;
+	
+	epicsMutexLock(this->lock);
+		if (this->capturing)
+		{
+			if (this->pending.size() + sizeof(raw) + length > MAX_PENDING)
+			{
+				this->dropped += 1;
+			}
+			else
+			{
+				/* Stamped under the lock so reports stay in time order */
+				raw.time = this->now();
+				
+				const uint8_t* header = (const uint8_t*) &raw;
+				
+				this->pending.insert(this->pending.end(), header, header + sizeof(raw));
+				this->pending.insert(this->pending.end(), data, data + length);
+				
+				this->recorded += 1;
+			}
+		}
+	epicsMutexUnlock(this->lock);
+}
+
+
+void ReportCapture::writer_thread()
+{
+	std::vector<uint8_t> batch;
+	std::vector<uint8_t> output;
+	
+	batch.reserve(MAX_PENDING);
+	
+	bool running = true;
+	bool failed = false;
+	
+	while (running)
+	{
+		epicsEventWaitWithTimeout(this->wakeup, FLUSH_PERIOD);
+		
+		/* Once capturing stops nothing more is added, so this is the last batch */
+		epicsMutexLock(this->lock);
+			running = this->capturing;
+			this->pending.swap(batch);
+		epicsMutexUnlock(this->lock);
+		
+		size_t offset = 0;
+		
+		while (offset < batch.size())
+		{
+			RawReport raw;
+			
+			memcpy(&raw, &batch[offset], sizeof(raw));
+			
+			this->encode(raw, &batch[offset + sizeof(raw)], &output);
+			
+			offset += sizeof(raw) + raw.length;
+		}
+		
+		batch.clear();
+		
+		if (not this->flush(&output))
+		{
+			printf("Error: couldn't write to %s, capture stopped.\n", this->filename.c_str());
+			
+			failed  = true;
+			running = false;
+		}
+	}
+	
+	fclose(this->file);
+	fclose(this->index);
+	
+	this->file  = NULL;
+	this->index = NULL;
+	
+	epicsEventSignal(this->finished);
+	
+	/* 
+	 * A failed capture only shows as stopped once its files are closed, so 
+	 * a new one can't be started on top of it.
+	 */
+	if (failed)
+	{
+		epicsMutexLock(this->lock);
+			__atomic_store_n(&this->capturing, false, __ATOMIC_RELEASE);
+			this->pending.clear();
+		epicsMutexUnlock(this->lock);
+	}
+}
+
+
+/*
+ * Every chunk names the ports and writes each one's first report whole,
+ * so a reader starting at the chunk needs nothing from before it.
+ */
+void ReportCapture::startChunk(uint64_t time, std::vector<uint8_t>* output)
+{
+	this->in_chunk    = true;
+	this->chunk_start = time;
+	this->last_time   = time;
+	this->named       = 0;
+	this->previous.clear();
+	
+	put_u64(&this->index_pending, time);
+	put_u64(&this->index_pending, this->written + output->size());
+	
+	output->push_back(CAPTURE_CHUNK);
+	put_u64(output, time);
+	
+	this->nameNewPorts(output);
+}
+
+
+void ReportCapture::nameNewPorts(std::vector<uint8_t>* output)
+{
+	epicsMutexLock(capture_lock);
+		for (; this->named < port_names.size(); this->named += 1)
+		{
+			const std::string& name = port_names[this->named];
+			
+			output->push_back(CAPTURE_PORT);
+			put_varint(output, this->named);
+			put_varint(output, name.size());
+			output->insert(output->end(), name.begin(), name.end());
+		}
+	epicsMutexUnlock(capture_lock);
+}
+
+
+void ReportCapture::encode(const RawReport& raw, const uint8_t* data, std::vector<uint8_t>* output)
+{
+	if (not this->in_chunk or raw.time - this->chunk_start >= CHUNK_PERIOD)    { this->startChunk(raw.time, output); }
+	
+	/* A port created after the chunk started */
+	if (raw.port >= this->named)    { this->nameNewPorts(output); }
+	
+	std::vector<uint8_t>& last = this->previous[(raw.port << 1) | (raw.kind == CAPTURE_OUTPUT)];
+	
+	unsigned length = raw.length;
+	unsigned bitmap = (length + 7) / 8;
+	unsigned changed = 0;
+	bool delta = false;
+	
+	/* HID reports usually only change a byte or two from one to the next */
+	if (length > 0 and last.size() == length)
+	{
+		for (unsigned byte = 0; byte < length; byte += 1)
+		{
+			if (data[byte] != last[byte])    { changed += 1; }
+		}
+		
+		delta = (bitmap + changed < length);
+	}
+	
+	uint8_t kind = raw.kind | ((raw.status << CAPTURE_STATUS_SHIFT) & CAPTURE_STATUS_MASK);
+	
+	output->push_back(delta ? (kind | CAPTURE_DELTA) : kind);
+	put_varint(output, raw.port);
+	put_varint(output, raw.time - this->last_time);
+	put_varint(output, length);
+	
+	if (delta)
+	{
+		size_t bits = output->size();
+		
+		output->resize(bits + bitmap, 0);
+		
+		for (unsigned byte = 0; byte < length; byte += 1)
+		{
+			if (data[byte] != last[byte])    { (*output)[bits + byte / 8] |= (uint8_t) (1 << (byte % 8)); }
+		}
+		
+		for (unsigned byte = 0; byte < length; byte += 1)
+		{
+			if (data[byte] != last[byte])    { output->push_back(data[byte]); }
+		}
+	}
+	else
+	{
+		output->insert(output->end(), data, data + length);
+	}
+	
+	/* Errors carry no data and don't change what the next delta is against */
+	if (length > 0)    { last.assign(data, data + length); }
+	
+	this->last_time = raw.time;
+}
+
+
+bool ReportCapture::flush(std::vector<uint8_t>* output)
+{
+	bool success = true;
+	
+	if (not output->empty())
+	{
+		success = (fwrite(&(*output)[0], 1, output->size(), this->file) == output->size());
+		
+		this->written += output->size();
+		output->clear();
+	}
+	
+	/* Chunks are only indexed once the data they point at is written */
+	if (success and not this->index_pending.empty())
+	{
+		success = (fwrite(&this->index_pending[0], 1, this->index_pending.size(), this->index) == this->index_pending.size());
+		
+		this->index_pending.clear();
+	}
+	
+	fflush(this->file);
+	fflush(this->index);
+	
+	epicsMutexLock(this->lock);
+		this->bytes = this->written;
+	epicsMutexUnlock(this->lock);
+	
+	return success;
+}
+
+
+void ReportCapture::report(FILE* fp)
+{
+	epicsMutexLock(this->lock);
+		fprintf(fp, "Capture %s: %lu reports, %lu dropped, %llu bytes\n",
+		        this->filename.c_str(),
+		        this->recorded,
+		        this->dropped,
+		        (unsigned long long) this->bytes);
+	epicsMutexUnlock(this->lock);
+}
+
+
+
+CaptureReader::CaptureReader()
+:	data(NULL),
+	size(0),
+	position(0),
+	index_data(NULL),
+	index_size(0),
+	index_mapped(0),
+	last_time(0)
+{}
+
+
+CaptureReader::~CaptureReader()    { this->close(); }
+
+
+bool CaptureReader::open(const char* filename)
+{
+	this->close();
+	
+	int fd = ::open(filename, O_RDONLY);
+	struct stat info;
+	
+	if (fd < 0 or fstat(fd, &info) != 0)
+	{
+		if (fd >= 0)    { ::close(fd); }
+		
+		printf("Error: couldn't open file (%s).\n", filename);
+		return false;
+	}
+	
+	if ((size_t) info.st_size >= CAPTURE_HEADER_SIZE)
+	{
+		void* mapped = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		
+		if (mapped != MAP_FAILED)
+		{
+			this->data = (const uint8_t*) mapped;
+			this->size = info.st_size;
+		}
+	}
+	
+	::close(fd);
+	
+	if (this->data == NULL or memcmp(this->data, CAPTURE_MAGIC, 8) != 0)
+	{
+		printf("Error: %s is not a report capture.\n", filename);
+		this->close();
+		return false;
+	}
+	
+	std::string index_name = std::string(filename) + ".idx";
+	
+	fd = ::open(index_name.c_str(), O_RDONLY);
+	
+	if (fd >= 0 and fstat(fd, &info) == 0 and info.st_size >= (off_t) CAPTURE_INDEX_ENTRY)
+	{
+		void* mapped = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		
+		if (mapped != MAP_FAILED)
+		{
+			this->index_data   = (const uint8_t*) mapped;
+			this->index_mapped = info.st_size;
+			this->index_size   = info.st_size - (info.st_size % CAPTURE_INDEX_ENTRY);
+		}
+	}
+	
+	if (fd >= 0)    { ::close(fd); }
+	
+	if (this->index_data == NULL)    { this->buildIndex(); }
+	
+	this->restart(CAPTURE_HEADER_SIZE);
+	
+	return true;
+}
+
+
+void CaptureReader::close()
+{
+	if (this->data != NULL)            { munmap((void*) this->data, this->size); }
+	if (this->index_mapped != 0)       { munmap((void*) this->index_data, this->index_mapped); }
+	
+	this->data         = NULL;
+	this->size         = 0;
+	this->index_data   = NULL;
+	this->index_size   = 0;
+	this->index_mapped = 0;
+	
+	this->built_index.clear();
+	this->names.clear();
+	this->restart(0);
+}
+
+
+/* Without an index file, one is put together by reading the whole capture */
+void CaptureReader::buildIndex()
+{
+	CaptureRecord record;
+	
+	this->built_index.clear();
+	this->restart(CAPTURE_HEADER_SIZE);
+	
+	while (this->next(&record)) {}
+	
+	if (not this->built_index.empty())
+	{
+		this->index_data = &this->built_index[0];
+		this->index_size = this->built_index.size();
+	}
+}
+
+
+void CaptureReader::restart(size_t offset)
+{
+	this->position  = offset;
+	this->last_time = 0;
+	this->previous.clear();
+}
+
+
+void CaptureReader::seek(double seconds)
+{
+	uint64_t target = (seconds > 0.0) ? (uint64_t) (seconds * 1e6) : 0;
+	
+	/* Last chunk starting at or before the target, the index is in time order */
+	size_t low = 0;
+	size_t high = this->index_size / CAPTURE_INDEX_ENTRY;
+	
+	while (low < high)
+	{
+		size_t middle = (low + high) / 2;
+		
+		if (get_u64(&this->index_data[middle * CAPTURE_INDEX_ENTRY]) <= target)    { low = middle + 1; }
+		else                                                                         { high = middle; }
+	}
+	
+	size_t offset = CAPTURE_HEADER_SIZE;
+	
+	/* The index can get ahead of the capture if it's still being written */
+	while (low > 0)
+	{
+		low -= 1;
+		
+		uint64_t chunk = get_u64(&this->index_data[low * CAPTURE_INDEX_ENTRY + 8]);
+		
+		if (chunk < this->size)
+		{
+			offset = chunk;
+			break;
+		}
+	}
+	
+	this->restart(offset);
+	
+	/*
+	 * Read forward to the target. Backing up over the report that passes
+	 * it is safe since reapplying a delta gives the same result.
+	 */
+	CaptureRecord record;
+	
+	while (true)
+	{
+		size_t before = this->position;
+		uint64_t before_time = this->last_time;
+		
+		if (not this->next(&record))    { break; }
+		
+		if (record.time >= target)
+		{
+			this->position  = before;
+			this->last_time = before_time;
+			break;
+		}
+	}
+}
+
+
+bool CaptureReader::readVarint(uint64_t* output)
+{
+	uint64_t value = 0;
+	
+	for (unsigned shift = 0; shift < 64 and this->position < this->size; shift += 7)
+	{
+		uint8_t byte = this->data[this->position];
+		
+		this->position += 1;
+		value |= (uint64_t) (byte & 0x7F) << shift;
+		
+		if (not (byte & 0x80))
+		{
+			*output = value;
+			return true;
+		}
+	}
+	
+	return false;
+}
+
+
+/*
+ * Stops without consuming anything at a record that runs past the end of
+ * the file, so a capture that's still being written can be followed.
+ */
+bool CaptureReader::next(CaptureRecord* output)
+{
+	size_t start = this->position;
+	
+	while (this->position < this->size)
+	{
+		start = this->position;
+		
+		uint8_t kind = this->data[this->position];
+		uint8_t type = kind & CAPTURE_TYPE_MASK;
+		
+		this->position += 1;
+		
+		if (type == CAPTURE_CHUNK)
+		{
+			if (this->size - this->position < 8)    { break; }
+			
+			/* Only while building an index, a real index is never changed */
+			if (this->index_data == NULL)
+			{
+				put_u64(&this->built_index, get_u64(&this->data[this->position]));
+				put_u64(&this->built_index, start);
+			}
+			
+			this->last_time = get_u64(&this->data[this->position]);
+			this->position += 8;
+			this->previous.clear();
+			continue;
+		}
+		
+		uint64_t port;
+		uint64_t value;
+		uint64_t length;
+		
+		if (not this->readVarint(&port) or not this->readVarint(&value))    { break; }
+		
+		if (type == CAPTURE_PORT)
+		{
+			if (this->size - this->position < value)    { break; }
+			
+			this->names[port] = std::string((const char*) &this->data[this->position], value);
+			this->position += value;
+			continue;
+		}
+		
+		if ((type != CAPTURE_INPUT and type != CAPTURE_OUTPUT) or not this->readVarint(&length))    { break; }
+		
+		std::vector<uint8_t>& last = this->previous[(port << 1) | (type == CAPTURE_OUTPUT)];
+		
+		if (kind & CAPTURE_DELTA)
+		{
+			size_t bitmap = (length + 7) / 8;
+			
+			if (last.size() != length or this->size - this->position < bitmap)    { break; }
+			
+			const uint8_t* bits = &this->data[this->position];
+			size_t changed = 0;
+			
+			for (unsigned byte = 0; byte < length; byte += 1)
+			{
+				if (bits[byte / 8] & (1 << (byte % 8)))    { changed += 1; }
+			}
+			
+			if (this->size - this->position - bitmap < changed)    { break; }
+			
+			const uint8_t* values = bits + bitmap;
+			
+			for (unsigned byte = 0; byte < length; byte += 1)
+			{
+				if (bits[byte / 8] & (1 << (byte % 8)))    { last[byte] = *values++; }
+			}
+			
+			this->position += bitmap + changed;
+		}
+		else
+		{
+			if (this->size - this->position < length)    { break; }
+			
+			if (length > 0)    { last.assign(&this->data[this->position], &this->data[this->position] + length); }
+			
+			this->position += length;
+		}
+		
+		this->last_time += value;
+		
+		output->time   = this->last_time;
+		output->port   = port;
+		output->kind   = (CaptureKind) type;
+		output->status = (asynStatus) ((kind & CAPTURE_STATUS_MASK) >> CAPTURE_STATUS_SHIFT);
+		output->data   = (length > 0) ? &last[0] : NULL;
+		output->length = length;
+		
+		return true;
+	}
+	
+	this->position = std::min(start, this->size);
+	
+	return false;
+}
+
+
+std::string CaptureReader::portName(unsigned port)
+{
+	std::map<unsigned, std::string>::iterator found = this->names.find(port);
+	
+	if (found == this->names.end())    { return "unknown"; }
+	
+	return found->second;
+}
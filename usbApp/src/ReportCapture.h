@@ -0,0 +1,176 @@
+#ifndef INC_REPORTCAPTURE_H
+#define INC_REPORTCAPTURE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <map>
+
+#include <epicsMutex.h>
+#include <epicsEvent.h>
+#include <asynDriver.h>
+
+/*
+ * Capture file layout, all fixed width integers are little endian and
+ * varints are 7 bits per byte, low bits first.
+ *
+ *   header    "USBCAP01", u32 seconds past the EPICS epoch, u32 nanoseconds
+ *   records   u8 kind, followed by
+ *               CHUNK    u64 microseconds since the capture started
+ *               PORT     varint id, varint length, port name
+ *               INPUT    varint port id, varint microseconds since the
+ *               OUTPUT     previous record, varint length, then either the
+ *                          whole report or, when DELTA is set, a bitmap of
+ *                          the bytes that changed followed by those bytes
+ *
+ * The low bits of kind are the record type, bits 3-5 hold the asynStatus
+ * of an input and the high bit is the DELTA flag. A CHUNK is started every
+ * second, after which every port is named again and the first report from
+ * each is written whole, so reading can begin at any chunk. The index file
+ * alongside the capture (filename.idx) holds a u64 time, u64 file offset
+ * pair for every chunk.
+ */
+
+enum CaptureKind
+{
+	CAPTURE_CHUNK  = 0,
+	CAPTURE_PORT   = 1,
+	CAPTURE_INPUT  = 2,
+	CAPTURE_OUTPUT = 3
+};
+
+static const uint8_t CAPTURE_TYPE_MASK    = 0x07;
+static const uint8_t CAPTURE_STATUS_SHIFT = 3;
+static const uint8_t CAPTURE_STATUS_MASK  = 0x38;
+static const uint8_t CAPTURE_DELTA        = 0x80;
+
+static const unsigned CAPTURE_HEADER_SIZE = 16;
+static const unsigned CAPTURE_INDEX_ENTRY = 16;
+
+
+struct RawReport;
+
+
+/** A single report read back out of a capture */
+typedef struct CaptureRecord
+{
+	uint64_t       time;       /* microseconds since the capture started */
+	unsigned       port;
+	CaptureKind    kind;
+	asynStatus     status;
+	const uint8_t* data;
+	unsigned       length;
+} CaptureRecord;
+
+
+/**
+ * Process-wide recorder of every input and output report, from every port,
+ * to a compact binary file.
+ *
+ * Recording a report only timestamps it and copies it into a buffer, which
+ * is safe from the USB callbacks. A background thread swaps the buffer out
+ * every so often, delta encodes the reports against the previous one from
+ * the same port, and writes them out. If the writer falls too far behind,
+ * reports are dropped and counted instead of growing the buffer forever.
+ */
+class ReportCapture
+{
+	public:
+		static ReportCapture* instance();
+		
+		/** Ports are numbered once for the life of the IOC */
+		static unsigned portId(const char* port_name);
+		static std::string portName(unsigned port);
+		
+		bool start(const char* filename);
+		void stop();
+		
+		void record(unsigned port, CaptureKind kind, const uint8_t* data, unsigned length, asynStatus status);
+		
+		void writer_thread();
+		void report(FILE* fp);
+	
+	private:
+		ReportCapture();
+		
+		uint64_t now();
+		
+		void encode(const RawReport& raw, const uint8_t* data, std::vector<uint8_t>* output);
+		void startChunk(uint64_t time, std::vector<uint8_t>* output);
+		void nameNewPorts(std::vector<uint8_t>* output);
+		bool flush(std::vector<uint8_t>* output);
+		
+		/* Read without the lock on the recording path */
+		bool capturing;
+		
+		epicsMutexId lock;
+		epicsEventId wakeup;
+		epicsEventId finished;
+		
+		/* Raw reports waiting for the writer, protected by lock */
+		std::vector<uint8_t> pending;
+		unsigned long        recorded;
+		unsigned long        dropped;
+		
+		/* Only touched by the writer thread */
+		FILE*    file;
+		FILE*    index;
+		uint64_t written;
+		uint64_t chunk_start;
+		uint64_t last_time;
+		bool     in_chunk;
+		unsigned named;
+		std::vector<uint8_t> index_pending;
+		std::map<unsigned, std::vector<uint8_t> > previous;
+		
+		std::string filename;
+		uint64_t    start_time;
+		uint64_t    bytes;
+};
+
+
+/**
+ * Reads a capture back through a memory map, decoding the reports in
+ * order. The index lets reading start from any point in time without
+ * decoding everything before it.
+ */
+class CaptureReader
+{
+	public:
+		CaptureReader();
+		~CaptureReader();
+		
+		bool open(const char* filename);
+		void close();
+		
+		/** Positions the reader at the first report at or after the time */
+		void seek(double seconds);
+		
+		/** The record's data stays valid until the next call */
+		bool next(CaptureRecord* output);
+		
+		std::string portName(unsigned port);
+	
+	private:
+		bool readVarint(uint64_t* output);
+		void buildIndex();
+		void restart(size_t offset);
+		
+		const uint8_t* data;
+		size_t         size;
+		size_t         position;
+		
+		const uint8_t* index_data;
+		size_t         index_size;
+		size_t         index_mapped;
+		
+		/* Used when the index file is missing, from scanning the capture */
+		std::vector<uint8_t> built_index;
+		
+		uint64_t last_time;
+		std::map<unsigned, std::string> names;
+		std::map<unsigned, std::vector<uint8_t> > previous;
+};
+
+#endif
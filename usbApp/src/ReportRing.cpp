@@ -0,0 +1,119 @@
+#include <cstring>
+#include <algorithm>
+
+#include "ReportRing.h"
+
+/* Report data follows the slot header, rounded up so arrays can be used in place */
+static const unsigned HEADER = (sizeof(ReportSlot) + 7) & ~7u;
+
+ReportRing::ReportRing()
+:	slots(0),
+	stride(0),
+	max_data(0),
+	head(0),
+	tail(0),
+	high_water(0),
+	dropped(0)
+{
+}
+
+
+/*
+ * Slots are kept a power of two so the counters can wrap freely and
+ * each report starts on an 8 byte boundary.
+ */
+void ReportRing::resize(unsigned num_slots, unsigned slot_size)
+{
+	unsigned rounded = 1;
+	
+	while (rounded < num_slots)    { rounded <<= 1; }
+	
+	this->slots    = rounded;
+	this->max_data = slot_size;
+	this->stride   = HEADER + ((slot_size + 7) & ~7u);
+	
+	this->storage.assign(this->slots * this->stride, 0);
+	
+	this->head = 0;
+	this->tail = 0;
+	this->high_water = 0;
+	this->dropped = 0;
+}
+
+
+bool ReportRing::push(const uint8_t* data, unsigned length, const epicsTimeStamp& time, asynStatus status, unsigned source)
+{
+	unsigned current_head = this->head;
+	unsigned current_tail = __atomic_load_n(&this->tail, __ATOMIC_ACQUIRE);
+	
+	unsigned used = current_head - current_tail;
+	
+	if (this->slots == 0 or used >= this->slots)
+	{
+		__atomic_add_fetch(&this->dropped, 1, __ATOMIC_RELAXED);
+		return false;
+	}
+	
+	uint8_t* location = &this->storage[(current_head & (this->slots - 1)) * this->stride];
+	ReportSlot* slot = (ReportSlot*) location;
+	
+	slot->time   = time;
+	slot->status = status;
+	slot->source = source;
+	slot->length = std::min(length, this->max_data);
+	
+	if (data != NULL)    { memcpy(location + HEADER, data, slot->length); }
+	else                 { slot->length = 0; }
+	
+	__atomic_store_n(&this->head, current_head + 1, __ATOMIC_RELEASE);
+	
+	if (used + 1 > this->high_water)    { __atomic_store_n(&this->high_water, used + 1, __ATOMIC_RELAXED); }
+	
+	return true;
+}
+
+
+/**
+ * Returns the oldest report without removing it, or NULL if the ring is
+ * empty. The data stays valid until pop is called.
+ */
+ReportSlot* ReportRing::front(uint8_t** data)
+{
+	unsigned current_tail = this->tail;
+	unsigned current_head = __atomic_load_n(&this->head, __ATOMIC_ACQUIRE);
+	
+	if (current_head == current_tail)    { return NULL; }
+	
+	uint8_t* location = &this->storage[(current_tail & (this->slots - 1)) * this->stride];
+	
+	*data = location + HEADER;
+	
+	return (ReportSlot*) location;
+}
+
+
+void ReportRing::pop()
+{
+	__atomic_store_n(&this->tail, this->tail + 1, __ATOMIC_RELEASE);
+}
+
+
+unsigned ReportRing::capacity()
+{
+	return this->slots;
+}
+
+unsigned ReportRing::count()
+{
+	return __atomic_load_n(&this->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&this->tail, __ATOMIC_ACQUIRE);
+}
+
+unsigned ReportRing::highWater()
+{
+	return __atomic_load_n(&this->high_water, __ATOMIC_RELAXED);
+}
+
+unsigned long ReportRing::drops()
+{
+	return __atomic_load_n(&this->dropped, __ATOMIC_RELAXED);
+}
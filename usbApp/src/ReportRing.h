@@ -0,0 +1,63 @@
+#ifndef INC_REPORTRING_H
+#define INC_REPORTRING_H
+
+#include <stdint.h>
+#include <vector>
+
+#include <epicsTime.h>
+#include <asynDriver.h>
+
+/** Header stored in front of each report in the ring */
+typedef struct ReportSlot
+{
+	epicsTimeStamp time;
+	asynStatus     status;
+	unsigned       length;
+	
+	/** Which input endpoint the report came from, 0 for the port's own */
+	unsigned       source;
+} ReportSlot;
+
+
+/**
+ * Single-producer/single-consumer ring of raw reports.
+ *
+ * The USB completion callback pushes reports and the driver's publisher 
+ * thread pops them, neither side ever takes a lock. Reports that arrive 
+ * while the ring is full are dropped and counted rather than blocking the 
+ * USB thread.
+ */
+class ReportRing
+{
+	public:
+		ReportRing();
+		
+		/** Not safe while either side is running */
+		void resize(unsigned num_slots, unsigned slot_size);
+		
+		bool push(const uint8_t* data, unsigned length, const epicsTimeStamp& time, asynStatus status, unsigned source);
+		
+		ReportSlot* front(uint8_t** data);
+		void        pop();
+		
+		unsigned      capacity();
+		unsigned      count();
+		unsigned      highWater();
+		unsigned long drops();
+		
+	private:
+		std::vector<uint8_t> storage;
+		
+		unsigned slots;
+		unsigned stride;
+		unsigned max_data;
+		
+		/* Free-running counters, only the producer writes head and the consumer tail */
+		unsigned head;
+		unsigned tail;
+		
+		unsigned      high_water;
+		unsigned long dropped;
+};
+
+#endif
@@ -1,11 +1,14 @@
 #include <map>
 #include <string>
+#include <sstream>
 
 #include <iocsh.h>
 #include <epicsExit.h>
 
 #include "DataLayout.h"
 #include "hidDriver.h"
+#include "usbService.h"
+#include "ReportCapture.h"
 
 static void remove_driver(void* data)           { delete ((hidDriver*) data); }
 static bool port_used(const char* port_name)    { return (findAsynPortDriver(port_name) != NULL); }
@@ -33,6 +36,20 @@ bool checkConnectionArgs(const iocshArgBuf* args)
 }
 
 
+bool checkPathArgs(const iocshArgBuf* args)
+{
+	if (not checkConnectionArgs(args))    { return false; }
+	
+	if (args[4].sval == NULL or args[4].sval[0] == '\0')
+	{
+		printf("Error: no port path given.\n");
+		return false;
+	}
+	
+	return true;
+}
+
+
 bool checkDriverArgs(const iocshArgBuf* args)
 {
 	if (args[0].sval == NULL)
@@ -183,6 +200,150 @@ bool checkTransArgs(const iocshArgBuf* args)
 	return true;
 }
 
+bool checkStreamArgs(const iocshArgBuf* args)
+{
+	if (args[0].sval == NULL)
+	{
+		printf("Error: no input given.\n");
+		return false;
+	}
+	else if (not port_used(args[0].sval))
+	{ 
+		printf("Error: couldn't find port specified.\n");
+		return false;
+	}
+	else if (args[1].ival < 0)
+	{
+		printf("Error: input cannot be negative.\n");
+		return false;
+	}
+	
+	return true;
+}
+
+bool checkThreadArgs(const iocshArgBuf* args)
+{
+	if (args[0].ival < 1)
+	{
+		printf("Error: need at least one event thread.\n");
+		return false;
+	}
+	
+	return true;
+}
+
+bool checkQueueArgs(const iocshArgBuf* args)
+{
+	if (args[0].sval == NULL)
+	{
+		printf("Error: no input given.\n");
+		return false;
+	}
+	else if (not port_used(args[0].sval))
+	{ 
+		printf("Error: couldn't find port specified.\n");
+		return false;
+	}
+	else if (args[1].ival < 1)
+	{
+		printf("Error: queue needs at least one slot.\n");
+		return false;
+	}
+	
+	return true;
+}
+
+
+bool checkPacketArgs(const iocshArgBuf* args)
+{
+	if (args[0].sval == NULL)
+	{
+		printf("Error: no input given.\n");
+		return false;
+	}
+	else if (not port_used(args[0].sval))
+	{ 
+		printf("Error: couldn't find port specified.\n");
+		return false;
+	}
+	else if (args[1].ival < 1)
+	{
+		printf("Error: transfers need at least one packet.\n");
+		return false;
+	}
+	
+	return true;
+}
+
+bool checkFrameArgs(const iocshArgBuf* args)
+{
+	if (args[0].sval == NULL)
+	{
+		printf("Error: no input given.\n");
+		return false;
+	}
+	else if (not port_used(args[0].sval))
+	{ 
+		printf("Error: couldn't find port specified.\n");
+		return false;
+	}
+	else if (args[1].ival < 0 or args[2].ival < 0 or args[3].ival < 0)
+	{
+		printf("Error: input cannot be negative.\n");
+		return false;
+	}
+	else if (args[1].ival > 0 and (args[4].ival < 1 or args[4].ival > 0xFF))
+	{
+		printf("Error: segment index mask needs to be a single byte.\n");
+		return false;
+	}
+	
+	return true;
+}
+
+bool checkCaptureArgs(const iocshArgBuf* args)
+{
+	if (args[0].sval == NULL)
+	{
+		printf("Error: no capture filename specified.\n");
+		return false;
+	}
+	
+	return true;
+}
+
+bool checkAutoDriverArgs(const iocshArgBuf* args)
+{
+	if (args[0].sval == NULL)
+	{
+		printf("Error: no input given.\n");
+		return false;
+	}
+	else if (port_used(args[0].sval))
+	{
+		printf("Error: port(%s) already registered.\n", args[0].sval);
+		return false;
+	}
+	else if (args[1].ival < 0)
+	{
+		printf("Error: interface cannot be negative.\n");
+		return false;
+	}
+	
+	return true;
+}
+
+bool checkLayoutCacheArgs(const iocshArgBuf* args)
+{
+	if (args[0].sval == NULL)
+	{
+		printf("Error: no directory specified.\n");
+		return false;
+	}
+	
+	return true;
+}
+
 
 void usbCreateDriver(const char* port_name, const char* input_filename, const char* output_filename)
 {
@@ -204,7 +365,70 @@ void usbConnectDevice( const char* port_name,
 	((hidDriver*) findAsynPortDriver(port_name))->connect( (uint16_t) vendor_id, 
 	                                                       (uint16_t) product_id, 
 	                                                                  serial_out, 
-	                                                                  interface_num);
+	                                                                  interface_num,
+	                                                                  "");
+}
+
+
+/*
+ * Matches the device by where it's plugged in rather than by its serial
+ * number, for identical devices that don't have one.
+ */
+void usbConnectDeviceAtPort( const char* port_name, 
+                                   int   interface_num, 
+                                   int   vendor_id, 
+                                   int   product_id, 
+                             const char* port_path)
+{
+	((hidDriver*) findAsynPortDriver(port_name))->connect( (uint16_t) vendor_id, 
+	                                                       (uint16_t) product_id, 
+	                                                                  "", 
+	                                                                  interface_num,
+	                                                                  port_path);
+}
+
+
+/*
+ * Builds the driver's layouts from the device's report descriptor instead
+ * of spec files, then connects it. Parameters have to exist before iocInit,
+ * so the descriptor is read now rather than when the connection is made.
+ */
+void usbCreateAutoDriver( const char* port_name, 
+                                int   interface_num, 
+                                int   vendor_id, 
+                                int   product_id, 
+                          const char* serial_num)
+{
+	std::string input_text;
+	std::string output_text;
+	
+	bool found = usbService::instance()->reportLayouts( (uint16_t) vendor_id, 
+	                                                    (uint16_t) product_id, 
+	                                                               interface_num, 
+	                                                              &input_text, 
+	                                                              &output_text);
+	
+	if (not found)
+	{
+		printf("Error: couldn't read the report descriptor of 0x%04X:0x%04X and no cached layout was found.\n", vendor_id, product_id);
+		return;
+	}
+	
+	std::istringstream input_stream(input_text);
+	std::istringstream output_stream(output_text);
+	
+	DataLayout input_spec  (input_stream);
+	DataLayout output_spec (output_stream);
+	
+	epicsAtExit(remove_driver, new hidDriver(port_name, input_spec, output_spec));
+	
+	usbConnectDevice(port_name, interface_num, vendor_id, product_id, serial_num);
+}
+
+
+void usbSetLayoutCache(const char* directory)
+{
+	usbService::instance()->setLayoutCache(directory);
 }
 
 
@@ -241,6 +465,46 @@ void usbShowIO(const char* port_name, int tf)
 	((hidDriver*) findAsynPortDriver(port_name))->setIOPrinting(tf);
 }
 
+void usbSetQueueDepth(const char* port_name, int depth)
+{
+	((hidDriver*) findAsynPortDriver(port_name))->setQueueDepth(depth);
+}
+
+void usbSetFrameReassembly(const char* port_name, int segments, int header, int index_byte, int index_mask)
+{
+	((hidDriver*) findAsynPortDriver(port_name))->setFrameReassembly(segments, header, index_byte, index_mask);
+}
+
+void usbSetAsyncOutput(const char* port_name, int tf)
+{
+	((hidDriver*) findAsynPortDriver(port_name))->setAsyncOutput(tf);
+}
+
+void usbSetEventThreads(int amt)
+{
+	usbService::instance()->setThreads(amt);
+}
+
+void usbSetStreaming(const char* port_name, int num_transfers)
+{
+	((hidDriver*) findAsynPortDriver(port_name))->setStreaming(num_transfers);
+}
+
+void usbSetPacketsPerTransfer(const char* port_name, int packets)
+{
+	((hidDriver*) findAsynPortDriver(port_name))->setPacketsPerTransfer(packets);
+}
+
+void usbStartCapture(const char* filename)
+{
+	ReportCapture::instance()->start(filename);
+}
+
+void usbStopCapture()
+{
+	ReportCapture::instance()->stop();
+}
+
 
 extern "C"
 {
@@ -250,6 +514,12 @@ extern "C"
 	static const iocshArg cx_arg3     = {"productID",      iocshArgInt};
 	static const iocshArg cx_arg4     = {"serialNum",      iocshArgString};
 	
+	static const iocshArg path_arg0   = {"portName",       iocshArgString};
+	static const iocshArg path_arg1   = {"interfaceNum",   iocshArgInt};
+	static const iocshArg path_arg2   = {"vendorID",       iocshArgInt};
+	static const iocshArg path_arg3   = {"productID",      iocshArgInt};
+	static const iocshArg path_arg4   = {"portPath",       iocshArgString};
+	
 	static const iocshArg driver_arg0 = {"portName",       iocshArgString};
 	static const iocshArg driver_arg1 = {"inputSpecFile",  iocshArgString};
 	static const iocshArg driver_arg2 = {"outputSpecFile", iocshArgString};
@@ -272,6 +542,36 @@ extern "C"
 	static const iocshArg trans_arg0  = {"portName",       iocshArgString};
 	static const iocshArg trans_arg1  = {"print_io_data",  iocshArgInt};
 	
+	static const iocshArg strm_arg0   = {"portName",       iocshArgString};
+	static const iocshArg strm_arg1   = {"numTransfers",   iocshArgInt};
+	
+	static const iocshArg thrd_arg0   = {"numThreads",     iocshArgInt};
+	
+	static const iocshArg queue_arg0  = {"portName",       iocshArgString};
+	static const iocshArg queue_arg1  = {"depth",          iocshArgInt};
+	
+	static const iocshArg async_arg0  = {"portName",       iocshArgString};
+	static const iocshArg async_arg1  = {"async_output",   iocshArgInt};
+	
+	static const iocshArg capt_arg0   = {"filename",       iocshArgString};
+	
+	static const iocshArg pkt_arg0    = {"portName",       iocshArgString};
+	static const iocshArg pkt_arg1    = {"numPackets",     iocshArgInt};
+	
+	static const iocshArg auto_arg0   = {"portName",       iocshArgString};
+	static const iocshArg auto_arg1   = {"interfaceNum",   iocshArgInt};
+	static const iocshArg auto_arg2   = {"vendorID",       iocshArgInt};
+	static const iocshArg auto_arg3   = {"productID",      iocshArgInt};
+	static const iocshArg auto_arg4   = {"serialNum",      iocshArgString};
+	
+	static const iocshArg cache_arg0  = {"directory",      iocshArgString};
+	
+	static const iocshArg frame_arg0  = {"portName",       iocshArgString};
+	static const iocshArg frame_arg1  = {"segments",       iocshArgInt};
+	static const iocshArg frame_arg2  = {"headerBytes",    iocshArgInt};
+	static const iocshArg frame_arg3  = {"indexByte",      iocshArgInt};
+	static const iocshArg frame_arg4  = {"indexMask",      iocshArgInt};
+	
 	
 	
 	static const iocshArg* cx_args[]     = {&cx_arg0, &cx_arg1, &cx_arg2, &cx_arg3, &cx_arg4};
@@ -282,6 +582,16 @@ extern "C"
 	static const iocshArg* debug_args[]  = {&debug_arg0, &debug_arg1};
 	static const iocshArg* inter_args[]  = {&inter_arg0, &inter_arg1};
 	static const iocshArg* trans_args[]  = {&trans_arg0, &trans_arg1};
+	static const iocshArg* strm_args[]   = {&strm_arg0, &strm_arg1};
+	static const iocshArg* thrd_args[]   = {&thrd_arg0};
+	static const iocshArg* queue_args[]  = {&queue_arg0, &queue_arg1};
+	static const iocshArg* async_args[]  = {&async_arg0, &async_arg1};
+	static const iocshArg* capt_args[]   = {&capt_arg0};
+	static const iocshArg* pkt_args[]    = {&pkt_arg0, &pkt_arg1};
+	static const iocshArg* auto_args[]   = {&auto_arg0, &auto_arg1, &auto_arg2, &auto_arg3, &auto_arg4};
+	static const iocshArg* cache_args[]  = {&cache_arg0};
+	static const iocshArg* frame_args[]  = {&frame_arg0, &frame_arg1, &frame_arg2, &frame_arg3, &frame_arg4};
+	static const iocshArg* path_args[]   = {&path_arg0, &path_arg1, &path_arg2, &path_arg3, &path_arg4};
 	
 
 
@@ -293,6 +603,17 @@ extern "C"
 	static const iocshFuncDef debug_func  = {"usbSetDebugLevel", 2, debug_args};
 	static const iocshFuncDef inter_func  = {"usbSetInterface", 2, inter_args};
 	static const iocshFuncDef trans_func  = {"usbShowIO", 2, trans_args};
+	static const iocshFuncDef strm_func   = {"usbSetStreaming", 2, strm_args};
+	static const iocshFuncDef thrd_func   = {"usbSetEventThreads", 1, thrd_args};
+	static const iocshFuncDef queue_func  = {"usbSetQueueDepth", 2, queue_args};
+	static const iocshFuncDef async_func  = {"usbSetAsyncOutput", 2, async_args};
+	static const iocshFuncDef capt_func   = {"usbStartCapture", 1, capt_args};
+	static const iocshFuncDef stop_func   = {"usbStopCapture", 0, NULL};
+	static const iocshFuncDef pkt_func    = {"usbSetPacketsPerTransfer", 2, pkt_args};
+	static const iocshFuncDef auto_func   = {"usbCreateAutoDriver", 5, auto_args};
+	static const iocshFuncDef cache_func  = {"usbSetLayoutCache", 1, cache_args};
+	static const iocshFuncDef frame_func  = {"usbSetFrameReassembly", 5, frame_args};
+	static const iocshFuncDef path_func   = {"usbConnectDeviceAtPort", 5, path_args};
 	
 	
 
@@ -361,6 +682,94 @@ extern "C"
 		}
 	}
 	
+	static void call_strm_func(const iocshArgBuf* args)
+	{
+		if (checkStreamArgs(args))
+		{
+			usbSetStreaming(args[0].sval, args[1].ival);
+		}
+	}
+	
+	static void call_thrd_func(const iocshArgBuf* args)
+	{
+		if (checkThreadArgs(args))
+		{
+			usbSetEventThreads(args[0].ival);
+		}
+	}
+	
+	static void call_queue_func(const iocshArgBuf* args)
+	{
+		if (checkQueueArgs(args))
+		{
+			usbSetQueueDepth(args[0].sval, args[1].ival);
+		}
+	}
+	
+	static void call_async_func(const iocshArgBuf* args)
+	{
+		if (checkTransArgs(args))
+		{
+			usbSetAsyncOutput(args[0].sval, args[1].ival);
+		}
+	}
+	
+	static void call_capt_func(const iocshArgBuf* args)
+	{
+		if (checkCaptureArgs(args))
+		{
+			usbStartCapture(args[0].sval);
+		}
+	}
+	
+	static void call_stop_func(const iocshArgBuf* args)
+	{
+		usbStopCapture();
+	}
+	
+	static void call_pkt_func(const iocshArgBuf* args)
+	{
+		if (checkPacketArgs(args))
+		{
+			usbSetPacketsPerTransfer(args[0].sval, args[1].ival);
+		}
+	}
+	
+	static void call_auto_func(const iocshArgBuf* args)
+	{
+		if (checkAutoDriverArgs(args))
+		{
+			usbCreateAutoDriver( args[0].sval, args[1].ival, args[2].ival, 
+			                     args[3].ival, args[4].sval);
+		}
+	}
+	
+	static void call_cache_func(const iocshArgBuf* args)
+	{
+		if (checkLayoutCacheArgs(args))
+		{
+			usbSetLayoutCache(args[0].sval);
+		}
+	}
+	
+	static void call_frame_func(const iocshArgBuf* args)
+	{
+		if (checkFrameArgs(args))
+		{
+			usbSetFrameReassembly( args[0].sval, args[1].ival, args[2].ival, 
+			                       args[3].ival, args[4].ival);
+		}
+	}
+	
+	static void call_path_func(const iocshArgBuf* args)
+	{
+		if (checkPathArgs(args))
+		{
+			usbConnectDeviceAtPort( args[0].sval, args[1].ival, args[2].ival, 
+			                        args[3].ival, args[4].sval);
+		}
+	}
+	
 
 	static void usbConnectRegistrar(void)       { iocshRegister(&cx_func, call_cx_func); }
 	static void usbDriverRegistrar(void)        { iocshRegister(&driver_func, call_driver_func); }
@@ -370,6 +779,17 @@ extern "C"
 	static void usbDebugRegistrar(void)         { iocshRegister(&debug_func, call_debug_func); }
 	static void usbInterRegistrar(void)         { iocshRegister(&inter_func, call_inter_func); }
 	static void usbTransRegistrar(void)         { iocshRegister(&trans_func, call_trans_func); }
+	static void usbStreamRegistrar(void)        { iocshRegister(&strm_func, call_strm_func); }
+	static void usbThreadRegistrar(void)        { iocshRegister(&thrd_func, call_thrd_func); }
+	static void usbQueueRegistrar(void)         { iocshRegister(&queue_func, call_queue_func); }
+	static void usbAsyncRegistrar(void)         { iocshRegister(&async_func, call_async_func); }
+	static void usbCaptureRegistrar(void)       { iocshRegister(&capt_func, call_capt_func); }
+	static void usbStopCaptureRegistrar(void)   { iocshRegister(&stop_func, call_stop_func); }
+	static void usbPacketRegistrar(void)        { iocshRegister(&pkt_func, call_pkt_func); }
+	static void usbAutoDriverRegistrar(void)    { iocshRegister(&auto_func, call_auto_func); }
+	static void usbLayoutCacheRegistrar(void)   { iocshRegister(&cache_func, call_cache_func); }
+	static void usbFrameRegistrar(void)         { iocshRegister(&frame_func, call_frame_func); }
+	static void usbPathRegistrar(void)          { iocshRegister(&path_func, call_path_func); }
 	
 	
 
@@ -381,4 +801,15 @@ extern "C"
 	epicsExportRegistrar(usbDebugRegistrar);
 	epicsExportRegistrar(usbInterRegistrar);
 	epicsExportRegistrar(usbTransRegistrar);
+	epicsExportRegistrar(usbStreamRegistrar);
+	epicsExportRegistrar(usbThreadRegistrar);
+	epicsExportRegistrar(usbQueueRegistrar);
+	epicsExportRegistrar(usbAsyncRegistrar);
+	epicsExportRegistrar(usbCaptureRegistrar);
+	epicsExportRegistrar(usbStopCaptureRegistrar);
+	epicsExportRegistrar(usbPacketRegistrar);
+	epicsExportRegistrar(usbAutoDriverRegistrar);
+	epicsExportRegistrar(usbLayoutCacheRegistrar);
+	epicsExportRegistrar(usbFrameRegistrar);
+	epicsExportRegistrar(usbPathRegistrar);
 }
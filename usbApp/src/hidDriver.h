@@ -9,16 +9,52 @@
 #include <libusb-1.0/libusb.h>
 
 #include <epicsMutex.h>
+#include <epicsEvent.h>
 #include <epicsExport.h>
 #include <epicsThread.h>
 #include <epicsTime.h>
 
 #include "DataLayout.h"
+#include "usbService.h"
+#include "ReportRing.h"
+#include "FrameAssembler.h"
+#include "PortStatistics.h"
+#include "ReportCapture.h"
 
 
 void setDebugLevel(int level);
 bool contains(libusb_device* check);
 
+/** 
+ * An input endpoint besides the port's own, given with @endpoint in the 
+ * input spec. It's streamed alongside the main endpoint and its fields 
+ * are decoded from its own reports, on whichever interface it's found.
+ */
+typedef struct InputEndpoint
+{
+	InputEndpoint(const DataLayout& spec):
+		layout(spec),
+		address(0),
+		interface(-1),
+		packet_size(0),
+		type(0),
+		need_init(true),
+		status(asynSuccess) {}
+	
+	DataLayout           layout;
+	
+	unsigned             address;
+	int                  interface;
+	unsigned             packet_size;
+	uint8_t              type;
+	
+	/* Owned by the publisher thread */
+	std::vector<uint8_t> state;
+	std::vector<uint8_t> last_state;
+	bool                 need_init;
+	asynStatus           status;
+} InputEndpoint;
+
 class hidDriver : public asynPortDriver
 {
 	public:
@@ -29,14 +65,28 @@ class hidDriver : public asynPortDriver
 		void setFrequency(double new_frequency);
 		void setConnectDelay(double new_delay);
 		void setInterface(int new_interface);
+		void setStreaming(int num_transfers);
+		void setQueueDepth(int depth);
+		void setAsyncOutput(int tf);
+		void setPacketsPerTransfer(int packets);
+		void setFrameReassembly(int segments, int header, int index_byte, int index_mask);
+		
+		void connect(uint16_t vendor_id, uint16_t product_id, std::string serial, int interface_num, std::string path);
 		
-		void connect(uint16_t vendor_id, uint16_t product_id, std::string serial, int interface_num);
+		/* Used by the usbService connection manager */
+		void beginSearch();
+		void notFound(bool first);
+		bool tryDevice(libusb_device* dev);
+		bool usesDevice(libusb_device* dev);
+		double connectDelay();
 		
-		void connect_thread();
 		void update_thread();
+		void publish_thread();
+		void send_thread();
 		void shutdown_thread();
 		
-		void receiveData(struct libusb_transfer* xfr);
+		void receiveData(struct libusb_transfer* xfr, const epicsTimeStamp& arrived);
+		void sentData(struct libusb_transfer* xfr);
 		
 		void printDebug(unsigned int level, std::string format, ...);
 		void setDebugLevel(int amt);
@@ -45,28 +95,62 @@ class hidDriver : public asynPortDriver
 		asynStatus writeInt32(asynUser* pasynuser, epicsInt32 value);
 		asynStatus writeFloat64(asynUser* pasynuser, epicsFloat64 value);
 		asynStatus writeOctet(asynUser* pasynuser, const char* value, size_t maxChars, size_t* nActual);
+		asynStatus writeInt8Array(asynUser* pasynuser, epicsInt8* value, size_t nElements);
+		asynStatus writeInt16Array(asynUser* pasynuser, epicsInt16* value, size_t nElements);
+		asynStatus writeInt32Array(asynUser* pasynuser, epicsInt32* value, size_t nElements);
+		asynStatus writeFloat32Array(asynUser* pasynuser, epicsFloat32* value, size_t nElements);
+		asynStatus writeFloat64Array(asynUser* pasynuser, epicsFloat64* value, size_t nElements);
+		
+		void report(FILE* fp, int details);
 		
 		
 	private:
-		void findDevice();
 		bool isMatch(libusb_device* info);
 		void loadDeviceInfo();
+		double endpointInterval(const struct libusb_endpoint_descriptor& endpoint);
+		void recordPacing(const epicsTimeStamp& deadline);
 		void startUpdating();
 		
+		void fillInputTransfer(struct libusb_transfer* transfer, uint8_t* buffer, unsigned packets);
+		void fillEndpointTransfer(struct libusb_transfer* transfer, unsigned address, uint8_t type, unsigned packet_size, uint8_t* buffer, unsigned packets);
+		bool submitStreamTransfer(unsigned address, uint8_t type, unsigned packet_size, unsigned packets);
+		void fillOutputTransfer(struct libusb_transfer* transfer, uint8_t* buffer);
+		
+		void startStream();
+		void finishStream();
+		void streamData(struct libusb_transfer* xfr, const epicsTimeStamp& arrived);
+		void cancelStream();
+		void cancelInput(struct libusb_transfer* transfer);
+		bool forgetCancel(struct libusb_transfer* transfer);
+		
 		void releaseInterface();
 		int  claimInterface();
+		int  claimExtraInterface(int interface_num);
+		void loadExtraInputs(struct libusb_config_descriptor* config);
+		unsigned inputSource(unsigned address);
 		
 		void createParams(DataLayout& spec);
+		void createSampleParams(Allocation* layout);
 		
-		void updateParams();
+		void queuePackets(struct libusb_transfer* xfr, const epicsTimeStamp& arrived);
+		void queueReport(const uint8_t* data, unsigned length, const epicsTimeStamp& arrived, asynStatus status, unsigned source);
+		void updateParams(uint8_t* data, unsigned length);
+		void updateEndpoint(unsigned source, uint8_t* data, unsigned length, asynStatus status);
+		unsigned decodeReport(DataLayout& spec, std::vector<uint8_t>& state, std::vector<uint8_t>& last_state, bool first, uint8_t* data, unsigned length);
+		void publishStatistics();
+		void flushSamples();
 
 		void setStatuses(asynStatus status);
 		void setStatuses(DataLayout& spec, asynStatus status);
 
 		void loadInputData(const struct libusb_endpoint_descriptor endpoint);
 		void loadOutputData(const struct libusb_endpoint_descriptor endpoint);
+		void checkLayout(DataLayout& spec, unsigned report_length, const char* direction);
 		
-		asynStatus sendOutputReport();
+		asynStatus sendOutputReport(int param);
+		asynStatus writeArray(asynUser* pasynuser, asynParamType type, const void* value, size_t bytes);
+		asynStatus outputResult(int err_no);
+		void encodeOutputField(int param);
 		
 		void connect();
 		void disconnect();
@@ -74,31 +158,112 @@ class hidDriver : public asynPortDriver
 		DataLayout input_specification;
 		DataLayout output_specification;
 		
+		/* Other input endpoints, and interfaces claimed for them */
+		std::vector<InputEndpoint> extra_inputs;
+		std::vector<int>           extra_interfaces;
+		std::vector<bool>          extra_detached;
+		
 		bool connected;
 		bool active;
 		
 		struct libusb_transfer *xfr;
 		
+		/* Ring of always-pending transfers used in streaming mode */
+		std::vector<struct libusb_transfer*> stream_xfrs;
+		unsigned     in_flight;
+		bool         streaming;
+		bool         stream_lost;
+		epicsEventId stream_done;
+		
+		/* Input transfers the driver itself cancelled, which USB_CANCELS doesn't count */
+		std::vector<struct libusb_transfer*> cancelling;
+		
+		epicsEventId poll_done;
+		
+		/* Set from the USB callbacks when the polling thread has to reload the endpoints */
+		bool         reload_pending;
+		
+		/* How late polls start against their deadlines */
+		unsigned long pace_count;
+		double        pace_late_sum;
+		double        pace_late_max;
+		
+		/* Coalesced output reports sent from their own thread */
+		struct libusb_transfer* output_xfr;
+		bool         async_output;
+		bool         output_dirty;
+		bool         output_pending;
+		int          output_error;
+		epicsEventId output_ready;
+		epicsEventId output_done;
+		epicsEventId output_finished;
+		epicsEventId send_exited;
+		std::vector<uint8_t> output_buffer;
+		
 		uint16_t     VENDOR_ID;
 		uint16_t     PRODUCT_ID;
 		std::string  SERIAL_NUM;
+		std::string  PORT_PATH;
 		unsigned     INTERFACE;
 		
+		/* Transfer lengths are for a single packet, which is one report */
 		unsigned int TRANSFER_LENGTH_IN;
 		unsigned int ENDPOINT_ADDRESS_IN;
+		uint8_t      TYPE_IN;
 		
 		unsigned int TRANSFER_LENGTH_OUT;
 		unsigned int ENDPOINT_ADDRESS_OUT;
+		uint8_t      TYPE_OUT;
 		
 		unsigned int TIMEOUT;
 		
+		unsigned int NUM_TRANSFERS;
+		unsigned int PACKETS_PER_TRANSFER;
+		
+		unsigned int QUEUE_DEPTH;
+		
 		double FREQUENCY;
+		double INPUT_INTERVAL;
+		double OUTPUT_INTERVAL;
 		double TIME_BETWEEN_CHECKS;
 		
 		unsigned int DEBUG_LEVEL;
 		
-		uint8_t state[64];
-		uint8_t last_state[64];
+		/* 
+		 * Report buffers are sized to the endpoint's packets when connecting,
+		 * or to what the layout covers if that's larger, so no field reads
+		 * past the end of one.
+		 */
+		std::vector<uint8_t> input_buffer;
+		
+		/* Encoded output report, kept up to date one field at a time */
+		std::vector<uint8_t> output_report;
+		std::vector<Allocation*> output_fields;
+		
+		/* Owned by the publisher thread */
+		std::vector<uint8_t> state;
+		std::vector<uint8_t> last_state;
+		
+		/* Reports waiting to be published, filled from the USB callbacks */
+		ReportRing   reports;
+		epicsEventId report_ready;
+		epicsMutexId publish_state;
+		
+		/* Set when the driver is being deleted, its threads exit on seeing it. Held with publish_state and output_state */
+		bool         shutting_down;
+		epicsEventId publish_exited;
+		
+		/* Packets are gathered into frames here before being decoded */
+		FrameAssembler frames;
+		
+		PortStatistics stats;
+		bool           has_connected;
+		
+		/* When the report waiting to go out was first written */
+		epicsTimeStamp output_written;
+		
+		ReportCapture* capture;
+		unsigned       capture_port;
 		
 		libusb_context*         context;
 		libusb_device_handle*   DEVICE;
@@ -107,6 +272,7 @@ class hidDriver : public asynPortDriver
 		epicsMutexId device_state;
 		
 		bool need_init;
+		asynStatus input_status;
 		bool print_transfer;
 };
 
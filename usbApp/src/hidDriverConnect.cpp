@@ -1,7 +1,9 @@
 #include <cstring>
 #include <sstream>
+#include <algorithm>
 
 #include "hidDriver.h"
+#include "usbService.h"
 
 
 
@@ -11,48 +13,39 @@
  */
 const int DIRECTION_INPUT = 0x80;
 
+/* How long to wait for a cancelled output report to come back */
+static const double CANCEL_TIMEOUT = 1.0; //seconds
+
 /*
- * Each of the hidDrivers will be running their own connect/disconnect
- * threads, we need to be able to maintain integrity of the list of
- * available USB devices.
+ * Connections are made from the usbService connection thread, but 
+ * disconnects can come from any driver's thread. We need to be able to
+ * maintain integrity of the list of available USB devices.
  */
 static epicsMutexId mylock = epicsMutexCreate();
 
 
-void connect_thread_callback(void* arg)
-{
-	hidDriver* driver = (hidDriver*) arg;
-	
-	driver->connect_thread();
-}
-
-
 
-void hidDriver::connect(uint16_t vendor_id, uint16_t product_id, std::string serial, int interface_num)
+void hidDriver::connect(uint16_t vendor_id, uint16_t product_id, std::string serial, int interface_num, std::string path)
 {
 	this->disconnect();
 	
 	this->VENDOR_ID = vendor_id;
 	this->PRODUCT_ID = product_id;
 	this->SERIAL_NUM = serial;
+	this->PORT_PATH = path;
 	this->INTERFACE = interface_num;
 	
-	this->connect(); // Spawn connection thread
+	this->connect(); // Queue up with the connection manager
 }
 
 
+/*
+ * Hands the driver to the connection manager, which will disconnect it
+ * and then offer it every matching device as they show up on the bus.
+ */
 void hidDriver::connect()
 {
-	std::stringstream temp_stream;
-	std::string threadname;
-	
-	temp_stream << "Driver_Connect (" << VENDOR_ID << ":" << PRODUCT_ID << ")";
-	temp_stream >> threadname;
-	
-	epicsThreadCreate(threadname.c_str(), 
-	                  epicsThreadPriorityLow, 
-	                  epicsThreadGetStackSize(epicsThreadStackMedium), 
-	                  (EPICSTHREADFUNC)::connect_thread_callback, this);
+	usbService::instance()->waitFor(this);
 }
 
 
@@ -70,8 +63,33 @@ void hidDriver::disconnect()
 		* through it 
 		*/
 		epicsMutexLock(this->input_state);
-			if (this->active)    { libusb_cancel_transfer(this->xfr); }
+			bool was_streaming = this->streaming;
+			
+			if (this->active and not was_streaming)    { this->cancelInput(this->xfr); }
 		epicsMutexUnlock(this->input_state);
+		
+		/* Every transfer in the ring has to come back before closing */
+		if (was_streaming)
+		{
+			this->cancelStream();
+			epicsEventWait(this->stream_done);
+		}
+		
+		/* Same for an output report that's still on its way out */
+		epicsMutexLock(this->output_state);
+			bool sending = this->output_pending;
+			
+			if (sending)
+			{
+				epicsEventTryWait(this->output_finished);
+				libusb_cancel_transfer(this->output_xfr);
+			}
+		epicsMutexUnlock(this->output_state);
+		
+		if (sending and epicsEventWaitWithTimeout(this->output_finished, CANCEL_TIMEOUT) != epicsEventWaitOK)
+		{
+			this->printDebug(0, "Cancelled output report never came back, closing anyway\n");
+		}
 
 		epicsMutexLock(mylock);
 			this->releaseInterface();
@@ -104,6 +122,9 @@ void hidDriver::loadDeviceInfo()
 		return;
 	}
 	
+	/* Sized first, so the report queue can hold packets from any of them */
+	this->loadExtraInputs(config_description);
+	
 	libusb_interface_descriptor interface = config_description->interface[INTERFACE].altsetting[0];
 	
 	bool found_input = false;
@@ -111,29 +132,156 @@ void hidDriver::loadDeviceInfo()
 	
 	for (int index = 0; index < interface.bNumEndpoints; index += 1)
 	{
-		uint8_t endpoint_info = interface.endpoint[index].bEndpointAddress;
+		const struct libusb_endpoint_descriptor& endpoint = interface.endpoint[index];
+		
+		/* The direction is part of the address, the transfer type is an attribute */
+		bool is_input = (endpoint.bEndpointAddress & DIRECTION_INPUT);
+		uint8_t type = endpoint.bmAttributes & LIBUSB_TRANSFER_TYPE_MASK;
+		
+		if (type == LIBUSB_TRANSFER_TYPE_CONTROL)    { continue; }
 		
 		/* Input Endpoint */
-		if (not found_input and (endpoint_info & (LIBUSB_ENDPOINT_IN | LIBUSB_TRANSFER_TYPE_INTERRUPT)))
+		if (is_input and not found_input)
 		{			
-			this->loadInputData(interface.endpoint[index]);
+			this->loadInputData(endpoint);
 			
 			need_init = true;
 			found_input = true;
 		}
 		
-		/* Output Endpoint */
-		else if (not found_output and (endpoint_info & LIBUSB_TRANSFER_TYPE_INTERRUPT))
+		/* Output Endpoint, isochronous output isn't supported */
+		else if (not is_input and not found_output and type != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
 		{
-			this->loadOutputData(interface.endpoint[index]);
+			this->loadOutputData(endpoint);
 			found_output = true;
 		}
 	}
 	
+	if (not found_input and not this->extra_inputs.empty())
+	{
+		this->printDebug(20, "No input endpoint on interface %d, other endpoints need one to be streamed\n", INTERFACE);
+	}
+	
 	libusb_free_config_descriptor(config_description);
 }
 
 
+/*
+ * Endpoint addresses are unique across the whole configuration, so each
+ * extra endpoint is looked for on every interface, and whichever interface
+ * has it is claimed along with the port's own.
+ */
+void hidDriver::loadExtraInputs(struct libusb_config_descriptor* config)
+{
+	for (unsigned index = 0; index < this->extra_inputs.size(); index += 1)
+	{
+		InputEndpoint& extra = this->extra_inputs[index];
+		
+		extra.interface = -1;
+		extra.packet_size = 0;
+		
+		unsigned packet_size = 0;
+		
+		for (int inter = 0; inter < config->bNumInterfaces and extra.interface < 0; inter += 1)
+		{
+			const struct libusb_interface_descriptor& setting = config->interface[inter].altsetting[0];
+			
+			for (int point = 0; point < setting.bNumEndpoints; point += 1)
+			{
+				const struct libusb_endpoint_descriptor& endpoint = setting.endpoint[point];
+				
+				if (endpoint.bEndpointAddress != extra.address)    { continue; }
+				
+				extra.interface = setting.bInterfaceNumber;
+				extra.type      = endpoint.bmAttributes & LIBUSB_TRANSFER_TYPE_MASK;
+				packet_size     = endpoint.wMaxPacketSize;
+				
+				if (extra.type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
+				{
+					int size = libusb_get_max_iso_packet_size(libusb_get_device(this->DEVICE), extra.address);
+					
+					if (size > 0)    { packet_size = size; }
+				}
+				
+				break;
+			}
+		}
+		
+		if (extra.interface < 0)
+		{
+			this->printDebug(0, "Input endpoint 0x%02X not found\n", extra.address);
+			continue;
+		}
+		
+		int status = this->claimExtraInterface(extra.interface);
+		
+		if (status)
+		{
+			this->printDebug(0, "Couldn't claim interface %d for endpoint 0x%02X: %d\n", extra.interface, extra.address, status);
+			continue;
+		}
+		
+		this->printDebug(10, "Input endpoint 0x%02X found on interface %d, %u byte packets\n", extra.address, extra.interface, packet_size);
+		
+		unsigned size = std::max(packet_size, extra.layout.length());
+		
+		epicsMutexLock(this->publish_state);
+			this->checkLayout(extra.layout, packet_size, "Input");
+			extra.layout.limit(packet_size);
+			
+			extra.packet_size = packet_size;
+			
+			extra.state.assign(size, 0);
+			extra.last_state.assign(size, 0);
+			extra.need_init = true;
+			extra.status = asynSuccess;
+			
+			extra.layout.reset();
+		epicsMutexUnlock(this->publish_state);
+	}
+}
+
+
+/* Returns the source of reports from the given endpoint, 0 for the port's own */
+unsigned hidDriver::inputSource(unsigned address)
+{
+	for (unsigned index = 0; index < this->extra_inputs.size(); index += 1)
+	{
+		if (this->extra_inputs[index].address == address)    { return index + 1; }
+	}
+	
+	return 0;
+}
+
+
+/*
+ * Interrupt endpoints give their polling interval in frames, 1ms each at
+ * low and full speed. High speed and up use 125us microframes, with the
+ * interval being 2^(bInterval - 1) of them. Isochronous endpoints use the
+ * exponent at every speed, and bulk endpoints don't have an interval.
+ */
+double hidDriver::endpointInterval(const struct libusb_endpoint_descriptor& endpoint)
+{
+	uint8_t type = endpoint.bmAttributes & LIBUSB_TRANSFER_TYPE_MASK;
+	uint8_t interval = endpoint.bInterval;
+	
+	if (this->DEVICE == NULL or interval == 0 or type == LIBUSB_TRANSFER_TYPE_BULK)    { return 0.0; }
+	
+	int speed = libusb_get_device_speed(libusb_get_device(this->DEVICE));
+	
+	bool high_speed = (speed >= LIBUSB_SPEED_HIGH);
+	
+	if (high_speed or type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
+	{
+		unsigned exponent = (interval > 16) ? 15 : interval - 1;
+		
+		return (1 << exponent) * (high_speed ? 0.000125 : 0.001);
+	}
+	
+	return interval * 0.001;
+}
+
+
 int hidDriver::claimInterface()
 {
 	this->printDebug(20, "Claiming interface from kernel: %d\n", this->INTERFACE);
@@ -149,6 +297,39 @@ int hidDriver::claimInterface()
 }
 
 
+/* Several endpoints can share an interface, it's only claimed the once */
+int hidDriver::claimExtraInterface(int interface_num)
+{
+	if (interface_num == (int) this->INTERFACE)    { return 0; }
+	
+	for (unsigned index = 0; index < this->extra_interfaces.size(); index += 1)
+	{
+		if (this->extra_interfaces[index] == interface_num)    { return 0; }
+	}
+	
+	this->printDebug(20, "Claiming interface from kernel: %d\n", interface_num);
+	
+	/* Other interfaces may well have no driver, or one we shouldn't reattach later */
+	bool attached = (libusb_kernel_driver_active(DEVICE, interface_num) == 1);
+	
+	if (attached)    { libusb_detach_kernel_driver(DEVICE, interface_num); }
+	
+	int status = libusb_claim_interface(DEVICE, interface_num);
+	
+	if (status == 0)
+	{
+		this->extra_interfaces.push_back(interface_num);
+		this->extra_detached.push_back(attached);
+	}
+	else if (attached)
+	{
+		libusb_attach_kernel_driver(DEVICE, interface_num);
+	}
+	
+	return status;
+}
+
+
 void hidDriver::releaseInterface()
 {
 	this->printDebug(20, "Releasing interface to kernel: %d\n", this->INTERFACE);
@@ -156,6 +337,24 @@ void hidDriver::releaseInterface()
 	libusb_release_interface(DEVICE, INTERFACE);
 	libusb_attach_kernel_driver(DEVICE, INTERFACE);
 	
+	for (unsigned index = 0; index < this->extra_interfaces.size(); index += 1)
+	{
+		libusb_release_interface(DEVICE, this->extra_interfaces[index]);
+		
+		if (this->extra_detached[index])    { libusb_attach_kernel_driver(DEVICE, this->extra_interfaces[index]); }
+	}
+	
+	this->extra_interfaces.clear();
+	this->extra_detached.clear();
+	
+	/* The event threads split bulk transfers by these sizes */
+	epicsMutexLock(this->publish_state);
+		for (unsigned index = 0; index < this->extra_inputs.size(); index += 1)
+		{
+			this->extra_inputs[index].packet_size = 0;
+		}
+	epicsMutexUnlock(this->publish_state);
+	
 	this->ENDPOINT_ADDRESS_IN = 0;
 	this->ENDPOINT_ADDRESS_OUT = 0;
 	
@@ -164,7 +363,7 @@ void hidDriver::releaseInterface()
 }
 
 
-void hidDriver::connect_thread()
+void hidDriver::beginSearch()
 {
 	this->printDebug(20, "Attempting to connect to device:\n");
 	this->printDebug(20, "\tVendor_id:  0x%04x\n", this->VENDOR_ID);
@@ -176,129 +375,119 @@ void hidDriver::connect_thread()
 		this->printDebug(20, "\tSerial Num: %s\n", this->SERIAL_NUM.c_str()); 
 	}
 	
-	int following = 0;;
+	if (not this->PORT_PATH.empty())
+	{
+		this->printDebug(20, "\tPort Path:  %s\n", this->PORT_PATH.c_str());
+	}
 	
 	this->disconnect();
+}
+
+
+void hidDriver::notFound(bool first)
+{
+	this->printDebug( first ? 0 : 1, 
+	                  "error connecting to device with vendor: 0x%04X and product: 0x%04X, waiting for reconnect\n", 
+	                  this->VENDOR_ID, 
+	                  this->PRODUCT_ID);
+}
+
+
+double hidDriver::connectDelay()
+{
+	return this->TIME_BETWEEN_CHECKS;
+}
+
+
+bool hidDriver::usesDevice(libusb_device* dev)
+{
+	epicsMutexLock(this->device_state);
+		bool output = (this->connected and libusb_get_device(this->DEVICE) == dev);
+	epicsMutexUnlock(this->device_state);
 	
-	
-	while (not this->connected)
-	{
-		epicsMutexLock(this->device_state);
-		this->findDevice();
-		epicsMutexUnlock(this->device_state);
-		
-		if(this->DEVICE == NULL)
-		{
-			this->printDebug( following, 
-			                  "error connecting to device with vendor: 0x%04X and product: 0x%04X, waiting for reconnect\n", 
-			                  this->VENDOR_ID, 
-			                  this->PRODUCT_ID);
-			following = 1;
-			
-			/* 
-			 * We don't want to constantly poll for open connections, so we can 
-			 * sleep a bit before checking again.
-			 */
-			epicsThreadSleep(TIME_BETWEEN_CHECKS);
-		}
-	}
+	return output;
 }
 
 
-void  hidDriver::findDevice()
-{	
-	libusb_device** connected_devices;
-	size_t amt_connected = libusb_get_device_list(context, &connected_devices);
-		
+/*
+ * Offered a single device by the connection manager, claims it if it
+ * matches our specifications and hasn't already been claimed by another 
+ * driver. Returns whether the driver is now connected.
+ */
+bool hidDriver::tryDevice(libusb_device* dev)
+{
+	epicsMutexLock(this->device_state);
+	
 	/*
 	 * We don't want multiple drivers to have a race condition to grab 
 	 * an open device, so we'll lock the entire connection. This also 
 	 * keeps disconnects from pulling a device out of claimed while we 
-	 * are iterating.
+	 * are connecting.
 	 */
 	epicsMutexLock(mylock);
 	
-	/* 
-	 * Check every available device for one that matches our specifications
-	 * and hasn't already been claimed by another driver
-	 */
-	for(unsigned index = 0; index < amt_connected; index += 1)
+	if (not this->connected and this->isMatch(dev))
 	{
-		libusb_device* dev = connected_devices[index];
+		int status = libusb_open(dev, &DEVICE);
 		
-		if (this->isMatch(dev))
+		if (status)
+		{ 
+			this->printDebug(20, "Found matching device, but error when opening connection: %d\n", status);
+			this->DEVICE = NULL;
+		}
+		else if ((status = this->claimInterface()))
+		{
+			this->printDebug(20, "Found matching device, but error when claiming: %d\n", status);
+			libusb_close(this->DEVICE);
+			this->DEVICE = NULL;
+		}
+		else
 		{
-			int status = libusb_open(dev, &DEVICE);
-			
-			if (status)
-			{ 
-				this->printDebug(20, "Found matching device, but error when opening connection: %d\n", status);
-				this->printDebug(20, "Continuing looking through list\n");
-				this->DEVICE = NULL;
-				continue;
-			}
-			
-			status = this->claimInterface();
-			
-			if (status)
-			{
-				this->printDebug(20, "Found matching device, but error when claiming: %d\n", status);
-				this->printDebug(20, "Continuing looking through list\n");
-				this->DEVICE = NULL;
-				continue;
-			}
-			
 			this->loadDeviceInfo();
 			this->setStatuses(asynSuccess);
-			this->startUpdating();
 			
+			if (this->has_connected)    { this->stats.count(PortStatistics::RECONNECTS); }
+			
+			this->has_connected = true;
 			this->connected = true;
+			this->startUpdating();
 			
 			this->printDebug(0, "connection (0x%04X:0x%04X) succeeded\n", this->VENDOR_ID, this->PRODUCT_ID);
-			
-			break;
 		}
 	}
+	
 	epicsMutexUnlock(mylock);
 	
-	libusb_free_device_list(connected_devices, 0);
+	bool output = this->connected;
+	epicsMutexUnlock(this->device_state);
+	
+	return output;
 }
 
 
+/*
+ * The port path is checked before the serial number, since it doesn't
+ * need anything read from the device. Serial numbers come from the
+ * usbService, which only reads each device's once.
+ */
 bool hidDriver::isMatch(libusb_device* dev)
 {
 	struct libusb_device_descriptor info;
-	libusb_device_handle* handle;
-	
 	
 	libusb_get_device_descriptor(dev, &info);
 
-	if (info.idVendor == this->VENDOR_ID and 
-	    info.idProduct == this->PRODUCT_ID)
+	if (info.idVendor != this->VENDOR_ID or info.idProduct != this->PRODUCT_ID)    { return false; }
+	
+	if (not this->PORT_PATH.empty() and usbService::portPath(dev) != this->PORT_PATH)    { return false; }
+	
+	if (not this->SERIAL_NUM.empty())
 	{
-		if (not this->SERIAL_NUM.empty())
-		{
-		    libusb_open(dev, &handle);
+		std::string serial;
 		
-			/* 
-			 * 126 is the maximum amount of characters we'll have to deal with according 
-			 * to the USB spec which mandates maximum sizes for the device_descriptor struct
-			 * and character encodings. There are no guarantees if you use a device that
-			 * doesn't follow the USB standard.
-			 */
-			unsigned char buffer[126];
-			
-			libusb_get_string_descriptor_ascii(handle, info.iSerialNumber, buffer, 126);
-			
-			libusb_close(handle);
-			
-			return (strcmp((char*) buffer, this->SERIAL_NUM.c_str()) == 0);
-		}
-		else
-		{
-			return true;
-		}
+		if (not usbService::instance()->serialNumber(dev, &serial))    { return false; }
+		
+		return (serial == this->SERIAL_NUM);
 	}
 	
-	return false;
+	return true;
 }
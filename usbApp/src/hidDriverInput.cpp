@@ -1,46 +1,56 @@
+#include <cstdlib>
 #include <cstring>
 #include <sstream>
+#include <algorithm>
 
 #include "hidDriver.h"
 
+/*
+ * Isochronous data is never retried, so there always needs to be a few
+ * transfers waiting for it even if streaming wasn't asked for.
+ */
+static const unsigned MIN_ISO_TRANSFERS = 4;
+
 void update_thread_callback(void* arg){ ((hidDriver*) arg)->update_thread(); }
 
 void receive_data_callback(struct libusb_transfer* response)
 {
+	/* Taken before anything else, this is the time the report arrived */
+	epicsTimeStamp arrived;
+	epicsTimeGetCurrent(&arrived);
+	
 	hidDriver* driver = (hidDriver*) response->user_data;
 	
-	driver->receiveData(response);
+	driver->receiveData(response, arrived);
 }
 
 
 void hidDriver::update_thread()
 {
 	/*
-	 * We want to keep the driver running somewhat smoothly, so we will take the 
-	 * time at the beginning and the end of this function and use a thread wait 
-	 * to slow things if they get too fast for the USB connection.
+	 * Polls are paced against absolute deadlines, one period apart, so time 
+	 * spent waiting on the device doesn't add up into drift. The period is
+	 * the update frequency, but never shorter than the endpoint's own 
+	 * polling interval since the device can't answer any faster than that.
 	 */
-	epicsTimeStamp start;
-	epicsTimeStamp end;
+	epicsTimeStamp deadline;
+	epicsTimeStamp now;
 	
 	this->printDebug(20, "Starting update\n");
 	
+	epicsTimeGetCurrent(&deadline);
+	
 	epicsMutexLock(this->device_state);
 	while (this->connected)
 	{
-		epicsTimeGetCurrent(&start);
+		double period = std::max(this->FREQUENCY, this->INPUT_INTERVAL);
+		
+		epicsTimeAddSeconds(&deadline, period);
 		
 		epicsMutexLock(this->input_state);
 		this->xfr = libusb_alloc_transfer(0);
 		
-		libusb_fill_interrupt_transfer( this->xfr, 
-		                                this->DEVICE, 
-		                                this->ENDPOINT_ADDRESS_IN, 
-		                                this->state, 
-		                                this->TRANSFER_LENGTH_IN,
-		                                receive_data_callback,
-		                                this,
-		                                this->TIMEOUT);
+		this->fillInputTransfer(this->xfr, &this->input_buffer[0], 1);
 		
 		int status = libusb_submit_transfer(this->xfr);
 		
@@ -67,26 +77,54 @@ void hidDriver::update_thread()
 		epicsMutexUnlock(this->input_state);
 		epicsMutexUnlock(this->device_state);
 		
-		double diff;
-		
-		do
+		/*
+		 * The shared event threads service the transfer, so all we have to
+		 * do is wait for it to come back, cancelling it if it's still out
+		 * when the next poll is due. Without a frequency an idle device just
+		 * leaves us blocked here.
+		 */
+		if (this->FREQUENCY == 0.0)
+		{
+			epicsEventWait(this->poll_done);
+		}
+		else
 		{
-			libusb_handle_events_completed(this->context, NULL);
-			epicsTimeGetCurrent(&end);
+			epicsTimeGetCurrent(&now);
 			
-			diff = epicsTimeDiffInSeconds(&end, &start);
+			double remaining = epicsTimeDiffInSeconds(&deadline, &now);
 			
-			epicsMutexLock(this->input_state);
-			if (this->active and (this->FREQUENCY != 0.0) and (diff >= this->FREQUENCY))
+			if (remaining <= 0.0 or epicsEventWaitWithTimeout(this->poll_done, remaining) != epicsEventWaitOK)
 			{
-				libusb_cancel_transfer(this->xfr);
+				epicsMutexLock(this->input_state);
+					if (this->active)    { this->cancelInput(this->xfr); }
+				epicsMutexUnlock(this->input_state);
+				
+				epicsEventWait(this->poll_done);
 			}
-			epicsMutexUnlock(this->input_state);
-		} while (this->active);
+		}
 		
-		if (diff < this->FREQUENCY)   { epicsThreadSleep(diff - this->FREQUENCY); }
+		epicsTimeGetCurrent(&now);
+		
+		double early = epicsTimeDiffInSeconds(&deadline, &now);
+		
+		if (early > 0.0)    { epicsThreadSleep(early); }
+		
+		/*
+		 * Running more than a period behind means we can't keep up, start
+		 * counting from now instead of firing off a burst to catch up.
+		 */
+		else if (-early > period)    { epicsTimeGetCurrent(&deadline); }
+		
+		if (period > 0.0)    { this->recordPacing(deadline); }
 		
 		epicsMutexLock(this->device_state);
+		
+		epicsMutexLock(this->input_state);
+			bool reload = this->reload_pending;
+			this->reload_pending = false;
+		epicsMutexUnlock(this->input_state);
+		
+		if (reload and this->connected)    { this->loadDeviceInfo(); }
 	}
 	
 	epicsMutexUnlock(this->device_state);
@@ -95,27 +133,361 @@ void hidDriver::update_thread()
 }
 
 
-void hidDriver::receiveData(struct libusb_transfer* response)
+/*
+ * Keeps track of how late each poll was started relative to its deadline,
+ * which is how much jitter the pacing is adding.
+ */
+void hidDriver::recordPacing(const epicsTimeStamp& deadline)
+{
+	epicsTimeStamp now;
+	
+	epicsTimeGetCurrent(&now);
+	
+	double late = std::max(0.0, epicsTimeDiffInSeconds(&now, &deadline));
+	
+	this->pace_count += 1;
+	this->pace_late_sum += late;
+	this->pace_late_max = std::max(this->pace_late_max, late);
+}
+
+
+void hidDriver::fillInputTransfer(struct libusb_transfer* transfer, uint8_t* buffer, unsigned packets)
+{
+	this->fillEndpointTransfer(transfer, this->ENDPOINT_ADDRESS_IN, this->TYPE_IN, this->TRANSFER_LENGTH_IN, buffer, packets);
+}
+
+
+/*
+ * Fills in a transfer for however many packets of an input endpoint, 
+ * using whichever kind of transfer the endpoint needs. Isochronous 
+ * transfers have to have been allocated with room for the packets.
+ */
+void hidDriver::fillEndpointTransfer(struct libusb_transfer* transfer, unsigned address, uint8_t type, unsigned packet_size, uint8_t* buffer, unsigned packets)
+{
+	unsigned length = packet_size * packets;
+	
+	switch (type)
+	{
+		case LIBUSB_TRANSFER_TYPE_BULK:
+			libusb_fill_bulk_transfer( transfer, 
+			                           this->DEVICE, 
+			                           address, 
+			                           buffer, 
+			                           length,
+			                           receive_data_callback,
+			                           this,
+			                           this->TIMEOUT);
+			break;
+		
+		case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+			libusb_fill_iso_transfer( transfer, 
+			                          this->DEVICE, 
+			                          address, 
+			                          buffer, 
+			                          length,
+			                          packets,
+			                          receive_data_callback,
+			                          this,
+			                          this->TIMEOUT);
+			
+			libusb_set_iso_packet_lengths(transfer, packet_size);
+			break;
+		
+		default:
+			libusb_fill_interrupt_transfer( transfer, 
+			                                this->DEVICE, 
+			                                address, 
+			                                buffer, 
+			                                length,
+			                                receive_data_callback,
+			                                this,
+			                                this->TIMEOUT);
+			break;
+	}
+}
+
+
+/*
+ * Streaming mode keeps a ring of transfers permanently submitted to the
+ * device, each one resubmitted from its own completion callback. There is
+ * always a transfer waiting for the next report, so reports aren't lost
+ * between polls and nothing gets allocated once the stream is running.
+ * Each transfer can hold several packets, which lets bulk and isochronous
+ * endpoints move a lot of data per completion.
+ */
+void hidDriver::startStream()
+{
+	bool iso = (this->TYPE_IN == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS);
+	
+	/* Ports with other endpoints always stream, even without asking */
+	unsigned num_transfers = std::max(this->NUM_TRANSFERS, 1u);
+	unsigned packets = this->PACKETS_PER_TRANSFER;
+	
+	if (iso)    { num_transfers = std::max(num_transfers, MIN_ISO_TRANSFERS); }
+	
+	this->printDebug(20, "Starting stream with %d transfers of %d packets\n", num_transfers, packets);
+	
+	/* Clear out any signal left from the end of a previous stream */
+	epicsEventTryWait(this->stream_done);
+	
+	epicsMutexLock(this->device_state);
+	epicsMutexLock(this->input_state);
+		this->streaming = true;
+		this->stream_lost = false;
+		this->active = true;
+		this->in_flight = 0;
+		
+		/* A port can be left with only the other endpoints to listen to */
+		unsigned main_transfers = (this->ENDPOINT_ADDRESS_IN != 0) ? num_transfers : 0;
+		
+		for (unsigned index = 0; index < main_transfers and not this->stream_lost; index += 1)
+		{
+			if (not this->submitStreamTransfer(this->ENDPOINT_ADDRESS_IN, this->TYPE_IN, this->TRANSFER_LENGTH_IN, packets))
+			{
+				this->stream_lost = true;
+			}
+		}
+		
+		/* Every other endpoint gets a ring of its own in the same stream */
+		for (unsigned extra = 0; extra < this->extra_inputs.size() and not this->stream_lost; extra += 1)
+		{
+			InputEndpoint& input = this->extra_inputs[extra];
+			
+			if (input.packet_size == 0)    { continue; }
+			
+			unsigned extra_transfers = num_transfers;
+			
+			if (input.type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)    { extra_transfers = std::max(num_transfers, MIN_ISO_TRANSFERS); }
+			
+			for (unsigned index = 0; index < extra_transfers and not this->stream_lost; index += 1)
+			{
+				if (not this->submitStreamTransfer(input.address, input.type, input.packet_size, packets))
+				{
+					this->stream_lost = true;
+				}
+			}
+		}
+		
+		bool empty = (this->in_flight == 0);
+	epicsMutexUnlock(this->input_state);
+	epicsMutexUnlock(this->device_state);
+	
+	/* Don't leave half of a ring running */
+	if (this->stream_lost)    { this->cancelStream(); }
+	if (empty)                { this->finishStream(); }
+}
+
+
+/*
+ * Adds one transfer to the stream and submits it, needs to be called with
+ * input_state held. Returns false if the transfer couldn't be submitted.
+ */
+bool hidDriver::submitStreamTransfer(unsigned address, uint8_t type, unsigned packet_size, unsigned packets)
+{
+	bool iso = (type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS);
+	
+	struct libusb_transfer* transfer = libusb_alloc_transfer(iso ? packets : 0);
+	uint8_t* buffer = (uint8_t*) calloc(packet_size * packets, 1);
+	
+	this->fillEndpointTransfer(transfer, address, type, packet_size, buffer, packets);
+	
+	/* libusb will free the buffer along with the transfer */
+	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+	
+	this->stream_xfrs.push_back(transfer);
+	
+	int status = libusb_submit_transfer(transfer);
+	
+	if (status)
+	{
+		this->printDebug(1, "Unable to submit streaming transfer to 0x%02X: %d\n", address, status);
+		return false;
+	}
+	
+	this->in_flight += 1;
+	
+	return true;
+}
+
+
+/*
+ * Called once the last transfer of the ring has come back. The transfers
+ * are released here and, if the ring stopped because of the device, a new 
+ * connection attempt is started.
+ */
+void hidDriver::finishStream()
+{
+	epicsMutexLock(this->input_state);
+		for (unsigned index = 0; index < this->stream_xfrs.size(); index += 1)
+		{
+			libusb_free_transfer(this->stream_xfrs[index]);
+		}
+		
+		this->stream_xfrs.clear();
+		this->streaming = false;
+	epicsMutexUnlock(this->input_state);
+	
+	epicsEventSignal(this->stream_done);
+	
+	this->printDebug(20, "Stream stopped\n");
+	
+	/* The connection thread disconnects before looking for the device again */
+	if (this->stream_lost)
+	{
+		this->printDebug(1, "Problem communicating with device, attempting reconnection.\n");
+		this->connect();
+	}
+}
+
+
+/*
+ * Stops the ring from resubmitting and cancels every pending transfer, 
+ * callers have to wait on stream_done before the device can be closed.
+ */
+void hidDriver::cancelStream()
+{
+	epicsMutexLock(this->input_state);
+		this->active = false;
+		
+		for (unsigned index = 0; index < this->stream_xfrs.size(); index += 1)
+		{
+			this->cancelInput(this->stream_xfrs[index]);
+		}
+	epicsMutexUnlock(this->input_state);
+}
+
+
+/* Needs input_state held */
+void hidDriver::cancelInput(struct libusb_transfer* transfer)
+{
+	if (libusb_cancel_transfer(transfer) == 0)    { this->cancelling.push_back(transfer); }
+}
+
+
+/* 
+ * Needs input_state held. A transfer can still complete normally after 
+ * being cancelled, so it's forgotten whatever its status.
+ */
+bool hidDriver::forgetCancel(struct libusb_transfer* transfer)
+{
+	std::vector<struct libusb_transfer*>::iterator found = std::find(this->cancelling.begin(), this->cancelling.end(), transfer);
+	
+	if (found == this->cancelling.end())    { return false; }
+	
+	this->cancelling.erase(found);
+	return true;
+}
+
+
+void hidDriver::streamData(struct libusb_transfer* response, const epicsTimeStamp& arrived)
+{
+	bool resubmit = false;
+	
+	unsigned source = this->inputSource(response->endpoint);
+	
+	if (response->status == LIBUSB_TRANSFER_COMPLETED)
+	{
+		this->queuePackets(response, arrived);
+		resubmit = true;
+	}
+	
+	/*
+	 * The transfer length is fixed for the life of the ring, so the best we
+	 * can do is flag the problem and keep listening.
+	 */
+	else if (response->status == LIBUSB_TRANSFER_OVERFLOW)
+	{
+		this->printDebug(1, "Too much information sent by device.\n");
+		
+		this->queueReport(NULL, 0, arrived, asynOverflow, source);
+		resubmit = true;
+	}
+	
+	else if (response->status == LIBUSB_TRANSFER_TIMED_OUT)
+	{
+		this->printDebug(1, "Connection timedout listening for input device report.\n");
+		
+		this->queueReport(NULL, 0, arrived, asynTimeout, source);
+		resubmit = true;
+	}
+	
+	else if (response->status == LIBUSB_TRANSFER_CANCELLED)
+	{
+		this->printDebug(20, "Pending input transfer cancelled.\n");
+	}
+	
+	/* Anything else means the device is gone or has stalled */
+	else
+	{
+		this->stream_lost = true;
+	}
+	
+	epicsMutexLock(this->input_state);
+		if (resubmit and this->active)
+		{
+			if (libusb_submit_transfer(response) == 0)
+			{
+				epicsMutexUnlock(this->input_state);
+				return;
+			}
+			
+			this->stream_lost = true;
+		}
+		
+		this->in_flight -= 1;
+		
+		bool empty = (this->in_flight == 0);
+	epicsMutexUnlock(this->input_state);
+	
+	if (empty)                                      { this->finishStream(); }
+	else if (this->stream_lost and this->active)    { this->cancelStream(); }
+}
+
+
+void hidDriver::receiveData(struct libusb_transfer* response, const epicsTimeStamp& arrived)
 {	
-	if (response->status == LIBUSB_TRANSFER_COMPLETED)    { this->updateParams(); }
+	epicsMutexLock(this->input_state);
+		bool requested = this->forgetCancel(response);
+	epicsMutexUnlock(this->input_state);
+	
+	switch (response->status)
+	{
+		case LIBUSB_TRANSFER_TIMED_OUT:    this->stats.count(PortStatistics::TIMEOUTS);     break;
+		case LIBUSB_TRANSFER_OVERFLOW:     this->stats.count(PortStatistics::OVERFLOWS);    break;
+		
+		/* Only cancels from outside the driver, the driver's own are routine */
+		case LIBUSB_TRANSFER_CANCELLED:    if (not requested)    { this->stats.count(PortStatistics::CANCELS); }    break;
+		default:                                                                            break;
+	}
+	
+	if (this->streaming)
+	{
+		this->streamData(response, arrived);
+		return;
+	}
+	
+	if (response->status == LIBUSB_TRANSFER_COMPLETED)
+	{
+		this->queuePackets(response, arrived);
+	}
 	
 	/*
 	* If the device sends us too much information, then something in our
-	* configuration is wrong. So we'll try to reload it.
+	* configuration is wrong. Reloading it has to wait on the publisher, so
+	* the polling thread does that once the transfer is back.
 	*/
 	else if (response->status == LIBUSB_TRANSFER_OVERFLOW)
 	{
 		this->printDebug(1, "Too much information sent by device, reloading connection parameters.\n");
 	
-		this->setStatuses(this->input_specification, asynOverflow);	
-		this->loadDeviceInfo();
+		this->queueReport(NULL, 0, arrived, asynOverflow, 0);
 	}
 	
 	else if (response->status == LIBUSB_TRANSFER_TIMED_OUT)
 	{
 		this->printDebug(1, "Connection timedout listening for input device report.\n");
 		
-		this->setStatuses(this->input_specification, asynTimeout);
+		this->queueReport(NULL, 0, arrived, asynTimeout, 0);
 	}
 	
 	else if (response->status == LIBUSB_TRANSFER_CANCELLED)
@@ -123,50 +495,263 @@ void hidDriver::receiveData(struct libusb_transfer* response)
 		this->printDebug(20, "Pending input transfer cancelled.\n");
 	}
 	
-	this->active = false;
-	libusb_free_transfer(response);
-	this->xfr = NULL;
+	epicsMutexLock(this->input_state);
+		if (response->status == LIBUSB_TRANSFER_OVERFLOW)    { this->reload_pending = true; }
+		
+		this->active = false;
+		libusb_free_transfer(response);
+		this->xfr = NULL;
+	epicsMutexUnlock(this->input_state);
+	
+	epicsEventSignal(this->poll_done);
 }
 
 
-void hidDriver::updateParams()
-{	
-	if (this->print_transfer)
-	{
-		printf("%s: ", this->portName);
+/*
+ * Every packet in a transfer is its own report. Bulk and interrupt packets
+ * are back to back, with only the last allowed to be short, while each 
+ * isochronous packet has its own slot and status.
+ */
+void hidDriver::queuePackets(struct libusb_transfer* response, const epicsTimeStamp& arrived)
+{
+	unsigned source = this->inputSource(response->endpoint);
 	
-		for (unsigned index = 0; index < this->TRANSFER_LENGTH_IN; index += 1)
+	if (response->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
+	{
+		for (int index = 0; index < response->num_iso_packets; index += 1)
 		{
-			printf("%02X ", this->state[index]);
+			struct libusb_iso_packet_descriptor* packet = &response->iso_packet_desc[index];
+			
+			/* A missed packet is simply gone, there's nothing to retry */
+			if (packet->status != LIBUSB_TRANSFER_COMPLETED or packet->actual_length == 0)    { continue; }
+			
+			this->stats.count(PortStatistics::REPORTS);
+			this->queueReport(libusb_get_iso_packet_buffer_simple(response, index), packet->actual_length, arrived, asynSuccess, source);
 		}
 		
-		printf("\n");
+		return;
 	}
+	
+	unsigned packet_size = (source == 0) ? this->TRANSFER_LENGTH_IN : this->extra_inputs[source - 1].packet_size;
+	unsigned length = response->actual_length;
+	
+	packet_size = std::max(packet_size, 1u);
+	
+	for (unsigned offset = 0; offset < length; offset += packet_size)
+	{
+		this->stats.count(PortStatistics::REPORTS);
+		this->queueReport(&response->buffer[offset], std::min(packet_size, length - offset), arrived, asynSuccess, source);
+	}
+}
 
-	if (! this->need_init)
+
+/*
+ * Runs in the USB callbacks, so this must never wait on anything EPICS 
+ * related. If the publisher has fallen behind the report is dropped.
+ */
+void hidDriver::queueReport(const uint8_t* data, unsigned length, const epicsTimeStamp& arrived, asynStatus status, unsigned source)
+{
+	/* Captures are replayed as the port's own reports, so they only hold those */
+	if (source == 0)    { this->capture->record(this->capture_port, CAPTURE_INPUT, data, length, status); }
+	
+	this->reports.push(data, length, arrived, status, source);
+	
+	epicsEventSignal(this->report_ready);
+}
+
+
+void hidDriver::publish_thread()
+{
+	/* Buffered fields with a period need checking at least that often too */
+	double sample_period = this->input_specification.samplePeriod();
+	double wait = PortStatistics::PERIOD;
+	
+	if (sample_period > 0.0)    { wait = std::min(wait, sample_period); }
+	
+	while (true)
 	{
-		/*
-		* Iterate through the asyn params and assign them to their 
-		* registers.
-		*/
-		for (unsigned index = 0; index < this->input_specification.size(); index += 1)
+		/* Wake up at least once a period to keep the statistics current */
+		epicsEventWaitWithTimeout(this->report_ready, wait);
+		
+		epicsMutexLock(this->publish_state);
+		
+		if (this->shutting_down)
 		{
-			Allocation* layout = this->input_specification.get(index);
+			epicsMutexUnlock(this->publish_state);
+			break;
+		}
+		
+		uint8_t* data;
+		ReportSlot* slot;
+		
+		while ((slot = this->reports.front(&data)) != NULL)
+		{
+			this->lock();
+			
+			/* 
+			 * Every param decoded from the report is stamped with the time
+			 * it arrived rather than when it happens to be posted, records
+			 * pick this up with TSE set to -2.
+			 */
+			this->setTimeStamp(&slot->time);
+			
+			if (slot->source != 0)
+			{
+				this->updateEndpoint(slot->source, data, slot->length, slot->status);
+			}
+			
+			else if (slot->status != asynSuccess)
+			{
+				/* Whatever went wrong, the rest of the frame isn't coming */
+				if (this->frames.abandon())    { this->stats.count(PortStatistics::FRAME_GAPS); }
+				
+				this->setStatuses(this->input_specification, slot->status);
+			}
+			
+			else if (not this->frames.enabled())    { this->updateParams(data, slot->length); }
 			
-			unsigned offset = layout->start;
+			else
+			{
+				FrameAssembler::Result result = this->frames.add(data, slot->length);
+				
+				if (result == FrameAssembler::GAP)    { this->stats.count(PortStatistics::FRAME_GAPS); }
+				
+				/* Frames are stamped with the arrival of their last segment */
+				if (result == FrameAssembler::COMPLETE)
+				{
+					this->stats.count(PortStatistics::FRAMES);
+					this->updateParams(this->frames.frame(), this->frames.length());
+				}
+			}
 			
-			/* We don't need to update if nothing has changed */
-			bool changed = (memcmp(&state[offset], &last_state[offset], layout->length) != 0);
+			this->unlock();
 			
-			if (changed)    { layout->type.read(this, &state[offset], layout); }
+			/* From the transfer completing to the params being posted */
+			if (slot->status == asynSuccess)    { this->stats.time(PortStatistics::LATENCY, slot->time); }
 			
-			this->setParamStatus(layout->index, asynSuccess);
+			this->reports.pop();
 		}
+		
+		if (sample_period > 0.0)    { this->flushSamples(); }
+		
+		epicsMutexUnlock(this->publish_state);
+		
+		if (this->stats.due())    { this->publishStatistics(); }
 	}
 	
+	epicsEventSignal(this->publish_exited);
+}
+
+
+void hidDriver::publishStatistics()
+{
+	epicsTimeStamp now;
+	epicsTimeGetCurrent(&now);
+	
+	this->lock();
+		this->setTimeStamp(&now);
+		this->stats.publish(this);
+		this->callParamCallbacks();
+	this->unlock();
+}
+
+
+/*
+ * Blocks with a period are posted from here as well as when a sample
+ * arrives, so a device that goes quiet doesn't hold back its last samples.
+ * Needs to be called with publish_state held.
+ */
+void hidDriver::flushSamples()
+{
+	epicsTimeStamp now;
+	epicsTimeGetCurrent(&now);
+	
+	this->lock();
+		this->setTimeStamp(&now);
+		
+		unsigned amt_published = this->input_specification.flush(this);
+		
+		for (unsigned index = 0; index < this->extra_inputs.size(); index += 1)
+		{
+			amt_published += this->extra_inputs[index].layout.flush(this);
+		}
+		
+		if (amt_published > 0)    { this->callParamCallbacks(); }
+	this->unlock();
+}
+
+
+/*
+ * Decodes a report against the last one from the same endpoint, returning
+ * the number of fields that changed. The first report after connecting is
+ * only kept to compare the next one against.
+ */
+unsigned hidDriver::decodeReport(DataLayout& spec, std::vector<uint8_t>& state, std::vector<uint8_t>& last_state, bool first, uint8_t* data, unsigned length)
+{
+	unsigned size = state.size();
+	
+	/* Nothing in the layout, and nothing to point at */
+	if (state.empty())    { return 0; }
+	
+	/* 
+	 * Full reports are decoded right where they sit in the queue. Anything 
+	 * past the end of a short report keeps its previous value, so those are 
+	 * filled out from the last report first.
+	 */
+	uint8_t* current = data;
+	
+	if (length < size)
+	{
+		current = &state[0];
+		
+		memcpy(current, data, length);
+		memcpy(current + length, &last_state[length], size - length);
+	}
+	
+	unsigned amt_changed = 0;
+	
+	if (not first)
+	{
+		epicsTimeStamp decode_start;
+		epicsTimeGetCurrent(&decode_start);
+		
+		amt_changed = spec.decode(this, current, &last_state[0]);
+		
+		this->stats.time(PortStatistics::DECODE, decode_start);
+	}
+	
+	memcpy(&last_state[0], current, size);
+	
+	return amt_changed;
+}
+
+
+void hidDriver::updateParams(uint8_t* data, unsigned length)
+{
+	if (this->print_transfer)
+	{
+		printf("%s: ", this->portName);
+	
+		for (unsigned index = 0; index < length; index += 1)
+		{
+			printf("%02X ", data[index]);
+		}
+		
+		printf("\n");
+	}
+
+	/* Params were left in an error state by a timeout or overflow */
+	if (! this->need_init and this->input_status != asynSuccess)
+	{
+		this->setStatuses(this->input_specification, asynSuccess);
+	}
+	
+	unsigned amt_changed = this->decodeReport(this->input_specification, this->state, this->last_state, this->need_init, data, length);
+	
 	this->need_init = false;
 	
-	memcpy(this->last_state, this->state, this->TRANSFER_LENGTH_IN);
+	/* Nothing to post when no field's own bits changed */
+	if (amt_changed == 0)    { return; }
 	
 	/*
 	 * Make sure that non-array DB values that use 'I/O Intr' 
@@ -178,6 +763,33 @@ void hidDriver::updateParams()
 }
 
 
+void hidDriver::updateEndpoint(unsigned source, uint8_t* data, unsigned length, asynStatus status)
+{
+	if (source > this->extra_inputs.size())    { return; }
+	
+	InputEndpoint& input = this->extra_inputs[source - 1];
+	
+	if (status != asynSuccess)
+	{
+		this->setStatuses(input.layout, status);
+		input.status = status;
+		return;
+	}
+	
+	if (not input.need_init and input.status != asynSuccess)
+	{
+		this->setStatuses(input.layout, asynSuccess);
+		input.status = asynSuccess;
+	}
+	
+	unsigned amt_changed = this->decodeReport(input.layout, input.state, input.last_state, input.need_init, data, length);
+	
+	input.need_init = false;
+	
+	if (amt_changed > 0)    { this->callParamCallbacks(); }
+}
+
+
 void hidDriver::loadInputData(const struct libusb_endpoint_descriptor endpoint)
 {
 	this->printDebug(10, "Input endpoint found at: 0x%02X\n", endpoint.bEndpointAddress);
@@ -185,15 +797,96 @@ void hidDriver::loadInputData(const struct libusb_endpoint_descriptor endpoint)
 	
 	this->ENDPOINT_ADDRESS_IN = endpoint.bEndpointAddress;
 	this->TRANSFER_LENGTH_IN  = endpoint.wMaxPacketSize;
+	this->TYPE_IN             = endpoint.bmAttributes & LIBUSB_TRANSFER_TYPE_MASK;
+	this->INPUT_INTERVAL      = this->endpointInterval(endpoint);
+	
+	/* High bandwidth endpoints fit several packets into each microframe */
+	if (this->TYPE_IN == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
+	{
+		int size = libusb_get_max_iso_packet_size(libusb_get_device(this->DEVICE), endpoint.bEndpointAddress);
+		
+		if (size > 0)    { this->TRANSFER_LENGTH_IN = size; }
+	}
 	
-	memset(this->state, 0, TRANSFER_LENGTH_IN);
-	memset(this->last_state, 0, TRANSFER_LENGTH_IN);
+	this->pace_count    = 0;
+	this->pace_late_sum = 0.0;
+	this->pace_late_max = 0.0;
+	
+	this->input_buffer.assign(std::max(this->TRANSFER_LENGTH_IN, 1u), 0);
+	
+	/* Nothing can be pushed while the endpoint is being loaded */
+	epicsMutexLock(this->publish_state);
+		/* With reassembly, fields address whole frames rather than packets */
+		unsigned report_length = this->TRANSFER_LENGTH_IN;
+		
+		/* Settings from usbSetFrameReassembly only take effect here */
+		this->frames.resize(this->TRANSFER_LENGTH_IN);
+		
+		if (this->frames.enabled())    { report_length = this->frames.frameSize(this->TRANSFER_LENGTH_IN); }
+		
+		this->checkLayout(this->input_specification, report_length, "Input");
+		this->input_specification.limit(report_length);
+		
+		unsigned size = std::max(report_length, this->input_specification.length());
+		
+		/* The ring only ever holds single packets when they're reassembled */
+		unsigned slot_size = this->frames.enabled() ? this->TRANSFER_LENGTH_IN : size;
+		
+		for (unsigned index = 0; index < this->extra_inputs.size(); index += 1)
+		{
+			slot_size = std::max(slot_size, this->extra_inputs[index].packet_size);
+		}
+		
+		this->reports.resize(this->QUEUE_DEPTH, slot_size);
+		
+		this->state.assign(size, 0);
+		this->last_state.assign(size, 0);
+		
+		this->input_specification.reset();
+	epicsMutexUnlock(this->publish_state);
+}
+
+
+/*
+ * Fields past the end of the device's reports never change, which is 
+ * almost always a mistake in the spec file, so they're pointed out. Input
+ * layouts are then limited to the report, so those fields aren't decoded.
+ */
+void hidDriver::checkLayout(DataLayout& spec, unsigned report_length, const char* direction)
+{
+	for (unsigned index = 0; index < spec.size(); index += 1)
+	{
+		Allocation* layout = spec.get(index);
+		
+		if (layout->start + layout->length <= report_length)    { continue; }
+		
+		this->printDebug(0, "%s param %s [%u, %u] is past the end of the %u byte report, it will be ignored\n", 
+		                    direction, 
+		                    layout->name.c_str(), 
+		                    layout->start, 
+		                    layout->start + layout->length - 1, 
+		                    report_length);
+	}
 }
 
 
 
 void hidDriver::startUpdating()
 {
+	bool extra = false;
+	
+	for (unsigned index = 0; index < this->extra_inputs.size(); index += 1)
+	{
+		if (this->extra_inputs[index].packet_size > 0)    { extra = true; }
+	}
+	
+	/* Streaming is driven entirely by the shared event threads */
+	if (this->NUM_TRANSFERS > 0 or this->TYPE_IN == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS or extra)
+	{
+		this->startStream();
+		return;
+	}
+	
 	/* Spawn update thread */
 	
 	std::stringstream temp_stream;
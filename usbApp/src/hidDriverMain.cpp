@@ -1,3 +1,6 @@
+#include <cstring>
+#include <sstream>
+
 #include <asynDriver.h>
 #include "hidDriver.h"
 
@@ -10,19 +13,29 @@
 static const double DEFAULT_FREQUENCY = .008; //seconds
 
 /* 
- * If no device is found when attempting to connect, how long to wait 
- * before attempting to connect again.
+ * If no device is found when attempting to connect and the system doesn't
+ * support hotplug notifications, how long to wait before attempting to 
+ * connect again.
  */
 static const double DEFAULT_CHECK = 5.0; //seconds
 
+/*
+ * How many reports can be waiting to be published before new ones start 
+ * being dropped.
+ */
+static const unsigned DEFAULT_QUEUE_DEPTH = 64;
+
+
+static void publish_thread_callback(void* arg){ ((hidDriver*) arg)->publish_thread(); }
+
 
 
 hidDriver::hidDriver(const char* port_name, DataLayout& input, DataLayout& output)
 	:asynPortDriver( port_name, 
 	                 1,                                         //Max # of Addresses
-	                 input.size() + output.size(),              //Number of Params 
-	                 input.interface_mask() | output.interface_mask(),           //Interface Mask
-	                 input.interrupt_mask() | output.interrupt_mask(),           //Interrupt Mask
+	                 input.params() + output.params() + PortStatistics::NUM_PARAMS,  //Number of Params 
+	                 input.interface_mask() | output.interface_mask() | asynInt32Mask | asynFloat64Mask,  //Interface Mask
+	                 input.interrupt_mask() | output.interrupt_mask() | asynInt32Mask | asynFloat64Mask,  //Interrupt Mask
 	                 ASYN_MULTIDEVICE,                          //Interface Type
 	                 1,                                         //Autoconnect
 	                 0,                                         //Thread Priority
@@ -31,36 +44,148 @@ hidDriver::hidDriver(const char* port_name, DataLayout& input, DataLayout& outpu
 	connected(false),
 	INTERFACE(0),
 	TIMEOUT(0),
+	NUM_TRANSFERS(0),
+	PACKETS_PER_TRANSFER(1),
+	QUEUE_DEPTH(DEFAULT_QUEUE_DEPTH),
 	FREQUENCY(DEFAULT_FREQUENCY),
+	INPUT_INTERVAL(0.0),
+	OUTPUT_INTERVAL(0.0),
 	TIME_BETWEEN_CHECKS(DEFAULT_CHECK),
 	DEBUG_LEVEL(0)
 {	
 	this->device_state = epicsMutexCreate();
 	this->input_state  = epicsMutexCreate();
 	this->output_state = epicsMutexCreate();
+	this->stream_done  = epicsEventCreate(epicsEventEmpty);
+	this->poll_done    = epicsEventCreate(epicsEventEmpty);
+	this->output_ready = epicsEventCreate(epicsEventEmpty);
+	this->output_done  = epicsEventCreate(epicsEventEmpty);
+	this->output_finished = epicsEventCreate(epicsEventEmpty);
+	this->send_exited     = epicsEventCreate(epicsEventEmpty);
+	
+	this->report_ready  = epicsEventCreate(epicsEventEmpty);
+	this->publish_state = epicsMutexCreate();
+	
+	this->shutting_down  = false;
+	this->publish_exited = epicsEventCreate(epicsEventEmpty);
+	
+	/* Enough for the layouts until a device says how long its reports are */
+	this->state.assign(this->input_specification.length(), 0);
+	this->last_state.assign(this->input_specification.length(), 0);
+	this->reports.resize(this->QUEUE_DEPTH, this->input_specification.length());
 	
 	this->DEVICE       = NULL;
 	
+	this->TYPE_IN      = LIBUSB_TRANSFER_TYPE_INTERRUPT;
+	this->TYPE_OUT     = LIBUSB_TRANSFER_TYPE_INTERRUPT;
+	
+	this->in_flight    = 0;
+	this->streaming    = false;
+	this->stream_lost  = false;
+	
+	this->reload_pending = false;
+	
+	this->output_xfr     = NULL;
+	this->async_output   = false;
+	this->output_dirty   = false;
+	this->output_pending = false;
+	this->output_error   = 0;
+	
+	this->pace_count    = 0;
+	this->pace_late_sum = 0.0;
+	this->pace_late_max = 0.0;
+	
+	this->has_connected = false;
+	epicsTimeGetCurrent(&this->output_written);
+	
+	this->capture      = ReportCapture::instance();
+	this->capture_port = ReportCapture::portId(port_name);
+	
 	this->print_transfer = false;
 	
 	/* Asyn Initialization */
 	this->createParams(this->input_specification);
 	this->createParams(this->output_specification);	
+	
+	/* Fields on other endpoints get layouts of their own, now that they have indices */
+	std::vector<unsigned> endpoints = this->input_specification.endpoints();
+	
+	for (unsigned index = 0; index < endpoints.size(); index += 1)
+	{
+		this->extra_inputs.push_back(InputEndpoint(this->input_specification.section(endpoints[index])));
+		
+		InputEndpoint& extra = this->extra_inputs.back();
+		
+		extra.address = endpoints[index];
+		extra.layout.compile();
+		extra.state.assign(extra.layout.length(), 0);
+		extra.last_state.assign(extra.layout.length(), 0);
+	}
+	this->stats.createParams(this);
+	
+	/* Output reports start zeroed and are only ever updated in place */
+	this->output_report.assign(this->output_specification.length(), 0);
+	this->output_buffer.assign(this->output_specification.length(), 0);
+	
+	/* Lets a write find the output field it changed without searching */
+	for (unsigned index = 0; index < this->output_specification.size(); index += 1)
+	{
+		Allocation* layout = this->output_specification.get(index);
+		
+		if (layout->index < 0)    { continue; }
+		
+		if ((unsigned) layout->index >= this->output_fields.size())
+		{
+			this->output_fields.resize(layout->index + 1, NULL);
+		}
+		
+		this->output_fields[layout->index] = layout;
+	}
 		
 	this->setStatuses(asynError);
 	
-	/* Libusb Initialization */
-	libusb_init(&context);
+	/* Every driver shares the same libusb context and event threads */
+	this->context = usbService::instance()->context();
+	
+	/* Reports are decoded and posted to asyn away from the USB threads */
+	std::stringstream temp_stream;
+	std::string threadname;
+	
+	temp_stream << "hidPublish(" << port_name << ")";
+	temp_stream >> threadname;
+	
+	epicsThreadCreate(threadname.c_str(), 
+	                  epicsThreadPriorityMedium, 
+	                  epicsThreadGetStackSize(epicsThreadStackMedium), 
+	                  (EPICSTHREADFUNC)::publish_thread_callback, this);
 }
 
 
 hidDriver::~hidDriver()
 {
+	usbService::instance()->forget(this);
+	
 	this->disconnect();
 	
 	while (this->connected) {}
 	
-	libusb_exit(context);
+	/* The publisher and sender use the driver right up until they see this */
+	epicsMutexLock(this->publish_state);
+	epicsMutexLock(this->output_state);
+		this->shutting_down = true;
+		
+		bool sending = (this->output_xfr != NULL);
+	epicsMutexUnlock(this->output_state);
+	epicsMutexUnlock(this->publish_state);
+	
+	epicsEventSignal(this->report_ready);
+	epicsEventWait(this->publish_exited);
+	
+	if (sending)
+	{
+		epicsEventSignal(this->output_ready);
+		epicsEventWait(this->send_exited);
+	}
 	
 	this->printDebug(20, "Closing driver\n");
 }
@@ -84,6 +209,38 @@ void hidDriver::createParams(DataLayout& spec)
 		{
 			printf("Error creating %s param: %d\n", layout->name.c_str(), status);
 		}
+		
+		if (layout->option("samples", 0.0) >= 1.0)    { this->createSampleParams(layout); }
+	}
+	
+	/* Now that every param has an index, the decode plan can be built */
+	spec.compile();
+}
+
+/*
+ * Buffered fields get NAME_SAMPLES, holding each block of values, and 
+ * NAME_TIMES, holding the time each of them arrived.
+ */
+void hidDriver::createSampleParams(Allocation* layout)
+{
+	if (not SampleBuffer::supports(layout->type.kind))
+	{
+		printf("Error: %s can't be buffered, only single values can\n", layout->name.c_str());
+		return;
+	}
+	
+	asynParamType samples_type = SampleBuffer::arrayType(*layout);
+	
+	std::string samples_name = layout->name + "_SAMPLES";
+	std::string times_name = layout->name + "_TIMES";
+	
+	if (this->createParam(samples_name.c_str(), samples_type, &layout->samples_index) != asynSuccess or
+	    this->createParam(times_name.c_str(), asynParamFloat64Array, &layout->times_index) != asynSuccess)
+	{
+		printf("Error creating sample params for %s\n", layout->name.c_str());
+		
+		layout->samples_index = -1;
+		layout->times_index = -1;
 	}
 }
 
@@ -113,17 +270,30 @@ void hidDriver::setStatuses(asynStatus status)
 {
 	this->setStatuses(this->input_specification, status);
 	this->setStatuses(this->output_specification, status);
+	
+	for (unsigned index = 0; index < this->extra_inputs.size(); index += 1)
+	{
+		this->setStatuses(this->extra_inputs[index].layout, status);
+	}
 }
 
 
+/*
+ * Fields read from other endpoints are still in the input spec, but their
+ * statuses follow their own endpoint rather than the port's.
+ */
 void hidDriver::setStatuses(DataLayout& spec, asynStatus status)
 {	
 	for(unsigned index = 0; index < spec.size(); index += 1)
 	{	
 		Allocation* layout = spec.get(index);
 		
+		if (layout->endpoint != 0)    { continue; }
+		
 		this->setParamStatus(layout->index, status);
 	}
+	
+	if (&spec == &this->input_specification)    { this->input_status = status; }
 
 	this->callParamCallbacks();
 }
@@ -183,6 +353,79 @@ void hidDriver::setInterface(int interface_in)
 	epicsMutexUnlock(this->device_state);
 }
 
+void hidDriver::setStreaming(int num_transfers)
+{
+	epicsMutexLock(this->device_state);
+		this->printDebug(10, "Setting Streaming Transfers: %d -> %d\n", this->NUM_TRANSFERS, num_transfers);
+		
+		/* 
+		 * Takes effect the next time updating starts, a running stream keeps
+		 * the ring it was started with.
+		 */
+		this->NUM_TRANSFERS = num_transfers;
+	epicsMutexUnlock(this->device_state);
+}
+
+void hidDriver::setPacketsPerTransfer(int packets)
+{
+	epicsMutexLock(this->device_state);
+		this->printDebug(10, "Setting Packets Per Transfer: %d -> %d\n", this->PACKETS_PER_TRANSFER, packets);
+		
+		/* Only streaming transfers are sized by this, polls are one packet */
+		this->PACKETS_PER_TRANSFER = packets;
+	epicsMutexUnlock(this->device_state);
+}
+
+void hidDriver::setFrameReassembly(int segments, int header, int index_byte, int index_mask)
+{
+	epicsMutexLock(this->publish_state);
+		this->printDebug(10, "Setting Frame Reassembly: %d segments, %d byte header, index at byte %d /0x%02X\n", segments, header, index_byte, index_mask);
+		
+		/* Frames are sized from the endpoint, so this waits for the next connection */
+		this->frames.configure(segments, header, index_byte, index_mask);
+	epicsMutexUnlock(this->publish_state);
+}
+
+void hidDriver::setQueueDepth(int depth)
+{
+	epicsMutexLock(this->device_state);
+		this->printDebug(10, "Setting Report Queue Depth: %d -> %d\n", this->QUEUE_DEPTH, depth);
+		
+		/* The ring is only rebuilt while no transfers are running */
+		this->QUEUE_DEPTH = depth;
+	epicsMutexUnlock(this->device_state);
+}
+
+void hidDriver::report(FILE* fp, int details)
+{
+	fprintf(fp, "Report queue: %u slots, %u waiting, %u high water, %lu dropped\n", 
+	        this->reports.capacity(), 
+	        this->reports.count(), 
+	        this->reports.highWater(), 
+	        this->reports.drops());
+	
+	if (this->pace_count > 0)
+	{
+		fprintf(fp, "Poll pacing: %lu polls, %.3f ms mean late, %.3f ms max late\n", 
+		        this->pace_count, 
+		        1000.0 * this->pace_late_sum / this->pace_count, 
+		        1000.0 * this->pace_late_max);
+	}
+	
+	for (unsigned index = 0; index < this->extra_inputs.size(); index += 1)
+	{
+		InputEndpoint& extra = this->extra_inputs[index];
+		
+		if (extra.packet_size == 0)    { fprintf(fp, "Input endpoint 0x%02X: not connected\n", extra.address); }
+		else
+		{
+			fprintf(fp, "Input endpoint 0x%02X: interface %d, %u byte packets\n", extra.address, extra.interface, extra.packet_size);
+		}
+	}
+	
+	asynPortDriver::report(fp, details);
+}
+
 void hidDriver::setIOPrinting(int tf)
 {
 	this->printDebug(10, "Setting IO Printing: %d -> %d\n", this->print_transfer, tf);
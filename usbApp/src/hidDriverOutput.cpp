@@ -1,5 +1,19 @@
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+
 #include "hidDriver.h"
 
+void send_thread_callback(void* arg){ ((hidDriver*) arg)->send_thread(); }
+
+void send_data_callback(struct libusb_transfer* response)
+{
+	hidDriver* driver = (hidDriver*) response->user_data;
+	
+	driver->sentData(response);
+}
+
+
 void hidDriver::loadOutputData(const struct libusb_endpoint_descriptor endpoint)
 {
 	this->printDebug(10, "Ouput endpoint found at: 0x%02X\n", endpoint.bEndpointAddress);
@@ -8,14 +22,85 @@ void hidDriver::loadOutputData(const struct libusb_endpoint_descriptor endpoint)
 	epicsMutexLock(this->output_state);
 		this->ENDPOINT_ADDRESS_OUT = endpoint.bEndpointAddress;
 		this->TRANSFER_LENGTH_OUT  = endpoint.wMaxPacketSize;
+		this->TYPE_OUT             = endpoint.bmAttributes & LIBUSB_TRANSFER_TYPE_MASK;
+		this->OUTPUT_INTERVAL      = this->endpointInterval(endpoint);
+		
+		/* Only ever grows, so fields already written keep their place */
+		unsigned size = std::max(this->TRANSFER_LENGTH_OUT, this->output_specification.length());
+		
+		if (size > this->output_report.size())
+		{
+			this->output_report.resize(size, 0);
+			this->output_buffer.resize(size, 0);
+		}
+		
+		this->checkLayout(this->output_specification, this->TRANSFER_LENGTH_OUT, "Output");
 	epicsMutexUnlock(this->output_state);
 }
 
-asynStatus hidDriver::sendOutputReport()
+
+void hidDriver::setAsyncOutput(int tf)
+{
+	epicsMutexLock(this->output_state);
+		this->printDebug(10, "Setting Asynchronous Output: %d -> %d\n", this->async_output, tf);
+		
+		this->async_output = tf;
+		
+		/* The sender thread is only needed once someone asks for it */
+		if (this->async_output and this->output_xfr == NULL)
+		{
+			this->output_xfr = libusb_alloc_transfer(0);
+			
+			std::stringstream temp_stream;
+			std::string threadname;
+			
+			temp_stream << "hidSend(" << this->portName << ")";
+			temp_stream >> threadname;
+			
+			epicsThreadCreate(threadname.c_str(),
+			                  epicsThreadPriorityMedium,
+			                  epicsThreadGetStackSize(epicsThreadStackMedium),
+			                  (EPICSTHREADFUNC)::send_thread_callback, this);
+		}
+	epicsMutexUnlock(this->output_state);
+}
+
+
+/*
+ * Re-encodes just the one param into the cached output report, the write
+ * functions clear the param's own bits first so nothing else is touched.
+ * Needs to be called with output_state held.
+ */
+void hidDriver::encodeOutputField(int param)
+{
+	if (param < 0 or (unsigned) param >= this->output_fields.size())    { return; }
+	
+	Allocation* layout = this->output_fields[param];
+	
+	if (layout == NULL)    { return; }
+	
+	unsigned width = std::max(layout->length, layout->type.width);
+	
+	if (layout->start + width > this->output_report.size())
+	{
+		this->printDebug(1, "Output param %s doesn't fit in the report\n", layout->name.c_str());
+		return;
+	}
+	
+	layout->type.write(this, &this->output_report[layout->start], layout);
+}
+
+
+asynStatus hidDriver::sendOutputReport(int param)
 {	
 	int amt_transferred;
 	
+	epicsTimeStamp written;
+	epicsTimeGetCurrent(&written);
+	
 	epicsMutexLock(this->output_state);
+		this->encodeOutputField(param);
+		
 		if (TRANSFER_LENGTH_OUT == 0)
 		{
 			epicsMutexUnlock(this->output_state);
@@ -23,25 +108,58 @@ asynStatus hidDriver::sendOutputReport()
 			if (this->connected)    { return asynError; }
 			else                    { return asynDisconnected; }
 		}
-	
-		uint8_t data[this->TRANSFER_LENGTH_OUT];
 		
-		for(unsigned index = 0; index < this->output_specification.size(); index += 1)
+		/*
+		 * Asynchronous writes just mark the report as needing to be sent,
+		 * the sender thread will pick up every write made until it goes out.
+		 */
+		if (this->async_output)
 		{
-			Allocation* layout = this->output_specification.get(index);
+			if (not this->output_dirty)    { this->output_written = written; }
 			
-			layout->type.write(this, &data[layout->start], layout);
+			this->output_dirty = true;
+			epicsMutexUnlock(this->output_state);
+			
+			epicsEventSignal(this->output_ready);
+			return asynSuccess;
 		}
+		
+		this->capture->record(this->capture_port, CAPTURE_OUTPUT, &this->output_report[0], this->TRANSFER_LENGTH_OUT, asynSuccess);
 	
-		int err_no = libusb_interrupt_transfer( this->DEVICE, 
-		                                       this->ENDPOINT_ADDRESS_OUT, 
-		                                       data, 
-		                                       this->TRANSFER_LENGTH_OUT, 
-		                                       &amt_transferred, 
-		                                       this->TIMEOUT);
-	epicsMutexUnlock(this->output_state);
+		int err_no;
 		
+		if (this->TYPE_OUT == LIBUSB_TRANSFER_TYPE_BULK)
+		{
+			err_no = libusb_bulk_transfer( this->DEVICE, 
+			                               this->ENDPOINT_ADDRESS_OUT, 
+			                               &this->output_report[0], 
+			                               this->TRANSFER_LENGTH_OUT, 
+			                               &amt_transferred, 
+			                               this->TIMEOUT);
+		}
+		else
+		{
+			err_no = libusb_interrupt_transfer( this->DEVICE, 
+			                                    this->ENDPOINT_ADDRESS_OUT, 
+			                                    &this->output_report[0], 
+			                                    this->TRANSFER_LENGTH_OUT, 
+			                                    &amt_transferred, 
+			                                    this->TIMEOUT);
+		}
+	epicsMutexUnlock(this->output_state);
+	
+	if (err_no == 0)
+	{
+		this->stats.count(PortStatistics::OUTPUTS);
+		this->stats.time(PortStatistics::OUTPUT, written);
+	}
 	
+	return this->outputResult(err_no);
+}
+
+
+asynStatus hidDriver::outputResult(int err_no)
+{
 	if (err_no == LIBUSB_ERROR_TIMEOUT)
 	{
 		this->printDebug(1, "Connection timedout listening for output device report.\n");
@@ -88,20 +206,213 @@ asynStatus hidDriver::sendOutputReport()
 	}
 }
 
+
+/* Needs to be called with output_state held */
+void hidDriver::fillOutputTransfer(struct libusb_transfer* transfer, uint8_t* buffer)
+{
+	if (this->TYPE_OUT == LIBUSB_TRANSFER_TYPE_BULK)
+	{
+		libusb_fill_bulk_transfer( transfer,
+		                           this->DEVICE,
+		                           this->ENDPOINT_ADDRESS_OUT,
+		                           buffer,
+		                           this->TRANSFER_LENGTH_OUT,
+		                           send_data_callback,
+		                           this,
+		                           this->TIMEOUT);
+	}
+	else
+	{
+		libusb_fill_interrupt_transfer( transfer,
+		                                this->DEVICE,
+		                                this->ENDPOINT_ADDRESS_OUT,
+		                                buffer,
+		                                this->TRANSFER_LENGTH_OUT,
+		                                send_data_callback,
+		                                this,
+		                                this->TIMEOUT);
+	}
+}
+
+
+/*
+ * Sends the output report whenever it has been marked dirty. After the
+ * first write we wait out one endpoint interval before copying the report,
+ * so any other writes made in the meantime go out in the same transfer.
+ */
+void hidDriver::send_thread()
+{
+	this->printDebug(20, "Starting asynchronous output\n");
+	
+	while (true)
+	{
+		epicsEventWait(this->output_ready);
+		
+		epicsMutexLock(this->output_state);
+			double interval = this->OUTPUT_INTERVAL;
+			bool stopping = this->shutting_down;
+		epicsMutexUnlock(this->output_state);
+		
+		if (stopping)    { break; }
+		
+		if (interval > 0.0)    { epicsThreadSleep(interval); }
+		
+		/* Writes keep the report encoded, it just needs a stable copy */
+		epicsMutexLock(this->output_state);
+			bool dirty = this->output_dirty and this->TRANSFER_LENGTH_OUT != 0;
+			epicsTimeStamp written = this->output_written;
+			
+			if (dirty)    { memcpy(&this->output_buffer[0], &this->output_report[0], this->output_report.size()); }
+			
+			this->output_dirty = false;
+		epicsMutexUnlock(this->output_state);
+		
+		if (not dirty)    { continue; }
+		
+		int err_no = 0;
+		bool sent = false;
+		
+		epicsMutexLock(this->device_state);
+		if (this->connected)
+		{
+			epicsMutexLock(this->output_state);
+				this->fillOutputTransfer(this->output_xfr, &this->output_buffer[0]);
+				
+				err_no = libusb_submit_transfer(this->output_xfr);
+				
+				this->output_pending = (err_no == 0);
+				sent = true;
+				
+				if (err_no == 0)
+				{
+					this->capture->record(this->capture_port, CAPTURE_OUTPUT, &this->output_buffer[0], this->TRANSFER_LENGTH_OUT, asynSuccess);
+				}
+			epicsMutexUnlock(this->output_state);
+		}
+		epicsMutexUnlock(this->device_state);
+		
+		/* Reconnecting will bring us back through sendOutputReport */
+		if (not sent)    { continue; }
+		
+		/* The shared event threads complete the transfer */
+		if (err_no == 0)
+		{
+			epicsEventWait(this->output_done);
+			err_no = this->output_error;
+		}
+		
+		/* Measured from the first write that went into this report */
+		if (err_no == 0)
+		{
+			this->stats.count(PortStatistics::OUTPUTS);
+			this->stats.time(PortStatistics::OUTPUT, written);
+		}
+		
+		this->lock();
+			this->outputResult(err_no);
+		this->unlock();
+	}
+	
+	epicsEventSignal(this->send_exited);
+}
+
+
+/*
+ * Disconnecting waits on output_finished, which is always signalled before
+ * output_done so it can't be left over from an older transfer once the 
+ * sender has submitted another.
+ */
+void hidDriver::sentData(struct libusb_transfer* response)
+{
+	epicsMutexLock(this->output_state);
+		switch (response->status)
+		{
+			case LIBUSB_TRANSFER_COMPLETED:    this->output_error = 0;                        break;
+			case LIBUSB_TRANSFER_TIMED_OUT:    this->output_error = LIBUSB_ERROR_TIMEOUT;     break;
+			case LIBUSB_TRANSFER_STALL:        this->output_error = LIBUSB_ERROR_PIPE;        break;
+			case LIBUSB_TRANSFER_NO_DEVICE:    this->output_error = LIBUSB_ERROR_NO_DEVICE;   break;
+			case LIBUSB_TRANSFER_OVERFLOW:     this->output_error = LIBUSB_ERROR_OVERFLOW;    break;
+			case LIBUSB_TRANSFER_CANCELLED:    this->output_error = 0;                        break;
+			default:                           this->output_error = LIBUSB_ERROR_IO;          break;
+		}
+		
+		this->output_pending = false;
+	epicsMutexUnlock(this->output_state);
+	
+	epicsEventSignal(this->output_finished);
+	epicsEventSignal(this->output_done);
+}
+
+
 asynStatus hidDriver::writeInt32(asynUser* pasynuser, epicsInt32 value)
 {
 	asynPortDriver::writeInt32(pasynuser, value);	
-	return this->sendOutputReport();
+	return this->sendOutputReport(pasynuser->reason);
 }
 
 asynStatus hidDriver::writeFloat64(asynUser* pasynuser, epicsFloat64 value)
 {
 	asynPortDriver::writeFloat64(pasynuser, value);
-	return this->sendOutputReport();
+	return this->sendOutputReport(pasynuser->reason);
 }
 
 asynStatus hidDriver::writeOctet(asynUser* pasynuser, const char* value, size_t maxChars, size_t* nActual)
 {
 	asynPortDriver::writeOctet(pasynuser, value, maxChars, nActual);
-	return this->sendOutputReport();
+	return this->sendOutputReport(pasynuser->reason);
+}
+
+
+/*
+ * asyn doesn't store arrays as params, so the written values are left in
+ * the output field's scratch space for its write function to pick up. Short
+ * arrays leave the rest of the field zeroed.
+ */
+asynStatus hidDriver::writeArray(asynUser* pasynuser, asynParamType type, const void* value, size_t bytes)
+{
+	int param = pasynuser->reason;
+	
+	epicsMutexLock(this->output_state);
+		Allocation* layout = NULL;
+		
+		if (param >= 0 and (unsigned) param < this->output_fields.size())    { layout = this->output_fields[param]; }
+		
+		if (layout == NULL or layout->type.param != type or layout->scratch.empty())
+		{
+			epicsMutexUnlock(this->output_state);
+			return asynError;
+		}
+		
+		size_t size = layout->scratch.size() * sizeof(epicsFloat64);
+		
+		memset(&layout->scratch[0], 0, size);
+		memcpy(&layout->scratch[0], value, std::min(bytes, size));
+	epicsMutexUnlock(this->output_state);
+	
+	return this->sendOutputReport(param);
+}
+
+asynStatus hidDriver::writeInt8Array(asynUser* pasynuser, epicsInt8* value, size_t nElements)
+{
+	return this->writeArray(pasynuser, asynParamInt8Array, value, nElements * sizeof(epicsInt8));
+}
+
+asynStatus hidDriver::writeInt16Array(asynUser* pasynuser, epicsInt16* value, size_t nElements)
+{
+	return this->writeArray(pasynuser, asynParamInt16Array, value, nElements * sizeof(epicsInt16));
+}
+
+asynStatus hidDriver::writeInt32Array(asynUser* pasynuser, epicsInt32* value, size_t nElements)
+{
+	return this->writeArray(pasynuser, asynParamInt32Array, value, nElements * sizeof(epicsInt32));
+}
+
+asynStatus hidDriver::writeFloat32Array(asynUser* pasynuser, epicsFloat32* value, size_t nElements)
+{
+	return this->writeArray(pasynuser, asynParamFloat32Array, value, nElements * sizeof(epicsFloat32));
+}
+
+asynStatus hidDriver::writeFloat64Array(asynUser* pasynuser, epicsFloat64* value, size_t nElements)
+{
+	return this->writeArray(pasynuser, asynParamFloat64Array, value, nElements * sizeof(epicsFloat64));
 }
@@ -1,7 +1,14 @@
+#include <cstdlib>
+#include <algorithm>
+
+#include <epicsEndian.h>
+
 #include "Allocation.h"
 #include "StringUtils.h"
 
 bool type_from_string(std::string type_input, DataType* output);
+unsigned converted_type(DataType* type);
+bool packed_type(const DataType& type);
 
 Allocation::Allocation(std::string toparse)
 :name(""),
@@ -9,11 +16,37 @@ length(0),
 start(0),
 mask(0xFFFFFFFF),
 shift(0),
-index(0)
+clear(0xFFFFFFFF),
+index(0),
+report(-1),
+endpoint(0),
+samples_index(-1),
+times_index(-1)
 {
 	unsigned end = 0;
 	
-	/* NAME [START |, END|] |>> SHIFT| -> TYPE |/MASK| */
+	/* NAME [START |, END|] |>> SHIFT| -> TYPE |/MASK| |{KEY=VALUE, ...}| */
+	size_t brace = toparse.find("{");
+	
+	if (brace != std::string::npos)
+	{
+		std::string settings = toparse.substr(brace + 1);
+		toparse.erase(brace);
+		
+		settings = split_on(&settings, "}");
+		
+		while (not settings.empty())
+		{
+			std::string value = split_on(&settings, ",");
+			std::string key = split_on(&value, "=");
+			
+			trim(&key);
+			trim(&value);
+			
+			if (not key.empty())    { this->options[key] = value; }
+		}
+	}
+	
 	this->name = split_on(&toparse, "[");
 	
 	std::pair<std::string, std::string> index_range = split_optional(&toparse, ",", "]");
@@ -35,8 +68,101 @@ index(0)
 		bool success = type_from_string(type, &this->type);
 		hex_to_int(toparse, &this->mask);
 		
+	this->clear = this->mask << this->shift;
+		
 	if (! success)
 	{
 		printf("Unknown parameter type for param: %s\n", this->name.c_str());
 	}
+	
+	if (this->type.kind == DECODE_GENERIC)    { this->scratch.assign((this->length + 7) / 8, 0.0); }
+	
+	if (packed_type(this->type))    { this->pack(); }
+	
+	if (this->options.count("endian") or this->options.count("scale") or this->options.count("offset"))
+	{
+		this->convert();
+	}
+}
+
+
+/**
+ * Array fields with an endian, scale or offset are published as Float64
+ * waveforms instead, with one scratch double for each element.
+ */
+void Allocation::convert()
+{
+	std::string endian = this->options["endian"];
+	
+	if (endian == "big")            { this->scaling.swap = (EPICS_BYTE_ORDER != EPICS_ENDIAN_BIG); }
+	else if (endian == "little")    { this->scaling.swap = (EPICS_BYTE_ORDER != EPICS_ENDIAN_LITTLE); }
+	else if (not endian.empty())
+	{
+		printf("Unknown endian for param: %s\n", this->name.c_str());
+	}
+	
+	this->scaling.scale  = this->option("scale", 1.0);
+	this->scaling.offset = this->option("offset", 0.0);
+	
+	if (this->scaling.scale == 0.0)
+	{
+		printf("Scale of zero for param: %s, using 1\n", this->name.c_str());
+		this->scaling.scale = 1.0;
+	}
+	
+	unsigned element = converted_type(&this->type);
+	
+	if (element == 0)
+	{
+		printf("Only Int16Array, Int32Array, Float32Array and PackedArray can be converted, param: %s\n", this->name.c_str());
+		return;
+	}
+	
+	if (this->packing.bits == 0)    { this->scratch.assign(this->length / element, 0.0); }
+}
+
+
+/**
+ * Packed arrays take their sample width from the bits setting, and either
+ * the count given or as many samples as fit in the field.
+ */
+void Allocation::pack()
+{
+	this->packing.bits = (unsigned) this->option("bits", 0);
+	this->packing.sign = (this->options["signed"] == "true" or this->option("signed", 0) != 0);
+	
+	if (this->packing.bits == 0 or this->packing.bits > 32)
+	{
+		printf("PackedArray needs a bits setting from 1 to 32, param: %s\n", this->name.c_str());
+		
+		this->packing.bits = 1;
+		this->packing.count = 0;
+		return;
+	}
+	
+	unsigned available = (this->length * 8 - this->shift) / this->packing.bits;
+	unsigned count = (unsigned) this->option("count", available);
+	
+	if (count > available)
+	{
+		printf("Only %u samples fit in param: %s\n", available, this->name.c_str());
+		count = available;
+	}
+	
+	this->packing.count = count;
+	this->scratch.assign(std::max(count, 1u), 0.0);
+}
+
+
+/**
+ * Returns a numeric option from the end of the line, or the fallback if
+ * it wasn't given.
+ */
+double Allocation::option(std::string key, double fallback)
+{
+	std::map<std::string, std::string>::iterator found = this->options.find(key);
+	
+	if (found == this->options.end() or found->second.empty())    { return fallback; }
+	
+	return atof(found->second.c_str());
 }
@@ -1,7 +1,10 @@
 #ifndef INC_ALLOCATION_H
 #define INC_ALLOCATION_H
 
+#include <map>
 #include <string>
+#include <vector>
+#include "ArrayConvert.h"
 #include "DataType.h"
 
 /** Type representing a single asyn parameter */
@@ -24,9 +27,34 @@ class Allocation
 	/** Number of Bits to shift left or right */
 	unsigned shift;
 	
+	/** Bits of the report owned by the param, cleared before writing */
+	unsigned clear;
+	
 	/** Parameter Index */
 	int index;
 	
+	/** Report ID the param is found in, -1 for every report */
+	int report;
+	
+	/** Input endpoint the param is read from, 0 for the port's own */
+	unsigned endpoint;
+	
+	/** Params for the blocks of samples of a buffered field, -1 if not buffered */
+	int samples_index;
+	int times_index;
+	
+	/** Settings given as {key=value, ...} at the end of the line */
+	std::map<std::string, std::string> options;
+	
+	/** Aligned copy of an array field that isn't aligned in the report */
+	std::vector<epicsFloat64> scratch;
+	
+	/** Byte order and units of arrays converted to Float64 waveforms */
+	ArrayScaling scaling;
+	
+	/** Sample width and count of PackedArray fields */
+	PackedSamples packing;
+	
 	DataType type;
 	
 	Allocation(): name(""),
@@ -34,9 +62,22 @@ class Allocation
 	              start(0),
 	              mask(0xFFFFFFFF),
 	              shift(0),
-	              index(0){}
+	              clear(0xFFFFFFFF),
+	              index(0),
+	              report(-1),
+	              endpoint(0),
+	              samples_index(-1),
+	              times_index(-1){}
 				
 	Allocation(std::string toparse);
+	
+	double option(std::string key, double fallback);
+	
+	private:
+	
+	/** Sets up an array field to be published as a converted waveform */
+	void convert();
+	void pack();
 };
 
 #endif
@@ -0,0 +1,411 @@
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "ArrayConvert.h"
+
+
+static inline uint16_t swap16(uint16_t value)
+{
+	return (uint16_t) ((value << 8) | (value >> 8));
+}
+
+static inline uint32_t swap32(uint32_t value)
+{
+	return (value << 24) | ((value << 8) & 0x00FF0000) | ((value >> 8) & 0x0000FF00) | (value >> 24);
+}
+
+
+/* NaN ends up at the minimum, the same as the vector clamp below */
+static inline double clamp(double value, double minimum, double maximum)
+{
+	if (not (value >= minimum))    { return minimum; }
+	if (value > maximum)           { return maximum; }
+	
+	return value;
+}
+
+
+#ifdef __SSE2__
+static inline __m128i swap_bytes16(__m128i values)
+{
+	return _mm_or_si128(_mm_slli_epi16(values, 8), _mm_srli_epi16(values, 8));
+}
+
+
+/* SSE2 has no byte shuffle, so swap bytes in each half then the halves */
+static inline __m128i swap_bytes32(__m128i values)
+{
+	values = swap_bytes16(values);
+	
+	return _mm_shufflehi_epi16(_mm_shufflelo_epi16(values, 0xB1), 0xB1);
+}
+
+
+static inline void store_scaled(epicsFloat64* output, __m128d low, __m128d high, __m128d scale, __m128d offset)
+{
+	_mm_storeu_pd(output,     _mm_add_pd(_mm_mul_pd(low, scale), offset));
+	_mm_storeu_pd(output + 2, _mm_add_pd(_mm_mul_pd(high, scale), offset));
+}
+
+
+static inline void store_int32(epicsFloat64* output, __m128i values, __m128d scale, __m128d offset)
+{
+	__m128d low  = _mm_cvtepi32_pd(values);
+	__m128d high = _mm_cvtepi32_pd(_mm_shuffle_epi32(values, 0xEE));
+	
+	store_scaled(output, low, high, scale, offset);
+}
+
+
+/* Rounds four doubles to the nearest int32 after clamping them into range */
+static inline __m128i load_int32(const epicsFloat64* input, __m128d inverse, __m128d bias, __m128d minimum, __m128d maximum)
+{
+	__m128d low  = _mm_add_pd(_mm_mul_pd(_mm_loadu_pd(input), inverse), bias);
+	__m128d high = _mm_add_pd(_mm_mul_pd(_mm_loadu_pd(input + 2), inverse), bias);
+	
+	low  = _mm_min_pd(_mm_max_pd(low, minimum), maximum);
+	high = _mm_min_pd(_mm_max_pd(high, minimum), maximum);
+	
+	return _mm_unpacklo_epi64(_mm_cvtpd_epi32(low), _mm_cvtpd_epi32(high));
+}
+#endif
+
+
+void int16_to_float64(const uint8_t* input, epicsFloat64* output, unsigned count, const ArrayScaling& scaling)
+{
+	unsigned index = 0;
+
+#ifdef __SSE2__
+	__m128d scale  = _mm_set1_pd(scaling.scale);
+	__m128d offset = _mm_set1_pd(scaling.offset);
+	
+	for (; index + 8 <= count; index += 8)
+	{
+		__m128i raw = _mm_loadu_si128((const __m128i*) &input[index * 2]);
+		
+		if (scaling.swap)    { raw = swap_bytes16(raw); }
+		
+		/* Sign extends each value by shifting it down from the top of a 32 bit lane */
+		store_int32(&output[index],     _mm_srai_epi32(_mm_unpacklo_epi16(raw, raw), 16), scale, offset);
+		store_int32(&output[index + 4], _mm_srai_epi32(_mm_unpackhi_epi16(raw, raw), 16), scale, offset);
+	}
+#endif
+	
+	for (; index < count; index += 1)
+	{
+		uint16_t raw;
+		
+		memcpy(&raw, &input[index * 2], sizeof(raw));
+		
+		if (scaling.swap)    { raw = swap16(raw); }
+		
+		output[index] = (epicsInt16) raw * scaling.scale + scaling.offset;
+	}
+}
+
+
+void int32_to_float64(const uint8_t* input, epicsFloat64* output, unsigned count, const ArrayScaling& scaling)
+{
+	unsigned index = 0;
+
+#ifdef __SSE2__
+	__m128d scale  = _mm_set1_pd(scaling.scale);
+	__m128d offset = _mm_set1_pd(scaling.offset);
+	
+	for (; index + 4 <= count; index += 4)
+	{
+		__m128i raw = _mm_loadu_si128((const __m128i*) &input[index * 4]);
+		
+		if (scaling.swap)    { raw = swap_bytes32(raw); }
+		
+		store_int32(&output[index], raw, scale, offset);
+	}
+#endif
+	
+	for (; index < count; index += 1)
+	{
+		uint32_t raw;
+		
+		memcpy(&raw, &input[index * 4], sizeof(raw));
+		
+		if (scaling.swap)    { raw = swap32(raw); }
+		
+		output[index] = (epicsInt32) raw * scaling.scale + scaling.offset;
+	}
+}
+
+
+void float32_to_float64(const uint8_t* input, epicsFloat64* output, unsigned count, const ArrayScaling& scaling)
+{
+	unsigned index = 0;
+
+#ifdef __SSE2__
+	__m128d scale  = _mm_set1_pd(scaling.scale);
+	__m128d offset = _mm_set1_pd(scaling.offset);
+	
+	for (; index + 4 <= count; index += 4)
+	{
+		__m128i raw = _mm_loadu_si128((const __m128i*) &input[index * 4]);
+		
+		if (scaling.swap)    { raw = swap_bytes32(raw); }
+		
+		__m128 values = _mm_castsi128_ps(raw);
+		
+		store_scaled(&output[index], _mm_cvtps_pd(values), _mm_cvtps_pd(_mm_movehl_ps(values, values)), scale, offset);
+	}
+#endif
+	
+	for (; index < count; index += 1)
+	{
+		uint32_t raw;
+		epicsFloat32 value;
+		
+		memcpy(&raw, &input[index * 4], sizeof(raw));
+		
+		if (scaling.swap)    { raw = swap32(raw); }
+		
+		memcpy(&value, &raw, sizeof(value));
+		
+		output[index] = value * scaling.scale + scaling.offset;
+	}
+}
+
+
+void float64_to_int16(const epicsFloat64* input, uint8_t* output, unsigned count, const ArrayScaling& scaling)
+{
+	double inverse = 1.0 / scaling.scale;
+	double bias    = -scaling.offset / scaling.scale;
+	
+	unsigned index = 0;
+
+#ifdef __SSE2__
+	__m128d inverse_vector = _mm_set1_pd(inverse);
+	__m128d bias_vector    = _mm_set1_pd(bias);
+	__m128d minimum        = _mm_set1_pd(-32768.0);
+	__m128d maximum        = _mm_set1_pd(32767.0);
+	
+	for (; index + 8 <= count; index += 8)
+	{
+		__m128i low  = load_int32(&input[index],     inverse_vector, bias_vector, minimum, maximum);
+		__m128i high = load_int32(&input[index + 4], inverse_vector, bias_vector, minimum, maximum);
+		
+		__m128i raw = _mm_packs_epi32(low, high);
+		
+		if (scaling.swap)    { raw = swap_bytes16(raw); }
+		
+		_mm_storeu_si128((__m128i*) &output[index * 2], raw);
+	}
+#endif
+	
+	for (; index < count; index += 1)
+	{
+		double value = clamp(input[index] * inverse + bias, -32768.0, 32767.0);
+		
+		uint16_t raw = (uint16_t) (epicsInt16) lrint(value);
+		
+		if (scaling.swap)    { raw = swap16(raw); }
+		
+		memcpy(&output[index * 2], &raw, sizeof(raw));
+	}
+}
+
+
+void float64_to_int32(const epicsFloat64* input, uint8_t* output, unsigned count, const ArrayScaling& scaling)
+{
+	double inverse = 1.0 / scaling.scale;
+	double bias    = -scaling.offset / scaling.scale;
+	
+	unsigned index = 0;
+
+#ifdef __SSE2__
+	__m128d inverse_vector = _mm_set1_pd(inverse);
+	__m128d bias_vector    = _mm_set1_pd(bias);
+	__m128d minimum        = _mm_set1_pd(-2147483648.0);
+	__m128d maximum        = _mm_set1_pd(2147483647.0);
+	
+	for (; index + 4 <= count; index += 4)
+	{
+		__m128i raw = load_int32(&input[index], inverse_vector, bias_vector, minimum, maximum);
+		
+		if (scaling.swap)    { raw = swap_bytes32(raw); }
+		
+		_mm_storeu_si128((__m128i*) &output[index * 4], raw);
+	}
+#endif
+	
+	for (; index < count; index += 1)
+	{
+		double value = clamp(input[index] * inverse + bias, -2147483648.0, 2147483647.0);
+		
+		uint32_t raw = (uint32_t) (epicsInt32) lrint(value);
+		
+		if (scaling.swap)    { raw = swap32(raw); }
+		
+		memcpy(&output[index * 4], &raw, sizeof(raw));
+	}
+}
+
+
+void float64_to_float32(const epicsFloat64* input, uint8_t* output, unsigned count, const ArrayScaling& scaling)
+{
+	double inverse = 1.0 / scaling.scale;
+	double bias    = -scaling.offset / scaling.scale;
+	
+	unsigned index = 0;
+
+#ifdef __SSE2__
+	__m128d inverse_vector = _mm_set1_pd(inverse);
+	__m128d bias_vector    = _mm_set1_pd(bias);
+	
+	for (; index + 4 <= count; index += 4)
+	{
+		__m128d low  = _mm_add_pd(_mm_mul_pd(_mm_loadu_pd(&input[index]), inverse_vector), bias_vector);
+		__m128d high = _mm_add_pd(_mm_mul_pd(_mm_loadu_pd(&input[index + 2]), inverse_vector), bias_vector);
+		
+		__m128i raw = _mm_castps_si128(_mm_movelh_ps(_mm_cvtpd_ps(low), _mm_cvtpd_ps(high)));
+		
+		if (scaling.swap)    { raw = swap_bytes32(raw); }
+		
+		_mm_storeu_si128((__m128i*) &output[index * 4], raw);
+	}
+#endif
+	
+	for (; index < count; index += 1)
+	{
+		epicsFloat32 value = (epicsFloat32) (input[index] * inverse + bias);
+		uint32_t raw;
+		
+		memcpy(&raw, &value, sizeof(raw));
+		
+		if (scaling.swap)    { raw = swap32(raw); }
+		
+		memcpy(&output[index * 4], &raw, sizeof(raw));
+	}
+}
+
+
+/*
+ * Each sample is pulled out of the eight bytes starting at its first byte,
+ * which holds any sample of up to 32 bits whatever its shift. Samples with a
+ * full window left in the report load it in one go, the last few copy only
+ * what's there. SSE2 has no per-lane variable shift, so rather than vector
+ * code this keeps the loop free of branches for the compiler to unroll.
+ */
+static inline uint64_t window(const uint8_t* input, unsigned bytes, unsigned byte)
+{
+	uint64_t output = 0;
+	
+	memcpy(&output, &input[byte], std::min(8u, bytes - byte));
+	
+	return output;
+}
+
+
+static inline epicsInt32 extract(uint64_t data, unsigned shift, uint64_t mask, unsigned extend)
+{
+	uint32_t value = (uint32_t) ((data >> shift) & mask);
+	
+	return ((epicsInt32) (value << extend)) >> extend;
+}
+
+
+/* Writes a sample's bits back into the report, leaving its neighbors alone */
+static inline void insert(uint8_t* output, unsigned bytes, unsigned bit, uint64_t mask, uint64_t value)
+{
+	unsigned byte   = bit >> 3;
+	unsigned length = std::min(8u, bytes - byte);
+	
+	uint64_t data = 0;
+	
+	memcpy(&data, &output[byte], length);
+	
+	data = (data & ~(mask << (bit & 7))) | ((value & mask) << (bit & 7));
+	
+	memcpy(&output[byte], &data, length);
+}
+
+
+void unpack_int32(const uint8_t* input, unsigned bytes, unsigned first_bit, const PackedSamples& packing, epicsInt32* output)
+{
+	uint64_t mask   = ((uint64_t) 1 << packing.bits) - 1;
+	unsigned extend = packing.sign ? 32 - packing.bits : 0;
+	
+	unsigned bit   = first_bit;
+	unsigned index = 0;
+	
+	for (; index < packing.count and (bit >> 3) + 8 <= bytes; index += 1, bit += packing.bits)
+	{
+		uint64_t data;
+		
+		memcpy(&data, &input[bit >> 3], sizeof(data));
+		
+		output[index] = extract(data, bit & 7, mask, extend);
+	}
+	
+	for (; index < packing.count; index += 1, bit += packing.bits)
+	{
+		output[index] = extract(window(input, bytes, bit >> 3), bit & 7, mask, extend);
+	}
+}
+
+
+void unpack_float64(const uint8_t* input, unsigned bytes, unsigned first_bit, const PackedSamples& packing, epicsFloat64* output, const ArrayScaling& scaling)
+{
+	uint64_t mask   = ((uint64_t) 1 << packing.bits) - 1;
+	unsigned extend = packing.sign ? 32 - packing.bits : 0;
+	
+	unsigned bit   = first_bit;
+	unsigned index = 0;
+	
+	for (; index < packing.count and (bit >> 3) + 8 <= bytes; index += 1, bit += packing.bits)
+	{
+		uint64_t data;
+		
+		memcpy(&data, &input[bit >> 3], sizeof(data));
+		
+		output[index] = extract(data, bit & 7, mask, extend) * scaling.scale + scaling.offset;
+	}
+	
+	for (; index < packing.count; index += 1, bit += packing.bits)
+	{
+		output[index] = extract(window(input, bytes, bit >> 3), bit & 7, mask, extend) * scaling.scale + scaling.offset;
+	}
+}
+
+
+/* Integers are just masked to the sample width, like any other int field */
+void pack_int32(const epicsInt32* input, uint8_t* output, unsigned bytes, unsigned first_bit, const PackedSamples& packing)
+{
+	uint64_t mask = ((uint64_t) 1 << packing.bits) - 1;
+	unsigned bit  = first_bit;
+	
+	for (unsigned index = 0; index < packing.count; index += 1, bit += packing.bits)
+	{
+		insert(output, bytes, bit, mask, (uint32_t) input[index]);
+	}
+}
+
+
+void pack_float64(const epicsFloat64* input, uint8_t* output, unsigned bytes, unsigned first_bit, const PackedSamples& packing, const ArrayScaling& scaling)
+{
+	uint64_t mask = ((uint64_t) 1 << packing.bits) - 1;
+	unsigned bit  = first_bit;
+	
+	double inverse = 1.0 / scaling.scale;
+	double bias    = -scaling.offset / scaling.scale;
+	
+	double minimum = packing.sign ? -ldexp(1.0, packing.bits - 1) : 0.0;
+	double maximum = packing.sign ? ldexp(1.0, packing.bits - 1) - 1.0 : ldexp(1.0, packing.bits) - 1.0;
+	
+	for (unsigned index = 0; index < packing.count; index += 1, bit += packing.bits)
+	{
+		double value = clamp(input[index] * inverse + bias, minimum, maximum);
+		
+		insert(output, bytes, bit, mask, (uint64_t) (int64_t) llrint(value));
+	}
+}
@@ -0,0 +1,57 @@
+#ifndef INC_ARRAYCONVERT_H
+#define INC_ARRAYCONVERT_H
+
+#include <stdint.h>
+
+#include <epicsTypes.h>
+
+/** Byte order and engineering units of a converted array field */
+typedef struct ArrayScaling
+{
+	ArrayScaling(): swap(false), scale(1.0), offset(0.0) {}
+	
+	/** Elements are in the opposite byte order to the host */
+	bool    swap;
+	
+	/** Engineering value = raw * scale + offset */
+	double  scale;
+	double  offset;
+} ArrayScaling;
+
+/** Sample width and count of a bit-packed array field */
+typedef struct PackedSamples
+{
+	PackedSamples(): bits(0), count(0), sign(false) {}
+	
+	/** Bits in each sample, from 1 to 32 */
+	unsigned bits;
+	unsigned count;
+	
+	/** Samples are two's complement and get sign extended */
+	bool     sign;
+} PackedSamples;
+
+/*
+ * Kernels turning the raw elements of a report into Float64 waveforms and
+ * back. The report side doesn't need to be aligned, values written back are
+ * rounded to the nearest integer and saturated at the type's limits.
+ */
+void int16_to_float64(const uint8_t* input, epicsFloat64* output, unsigned count, const ArrayScaling& scaling);
+void int32_to_float64(const uint8_t* input, epicsFloat64* output, unsigned count, const ArrayScaling& scaling);
+void float32_to_float64(const uint8_t* input, epicsFloat64* output, unsigned count, const ArrayScaling& scaling);
+
+void float64_to_int16(const epicsFloat64* input, uint8_t* output, unsigned count, const ArrayScaling& scaling);
+void float64_to_int32(const epicsFloat64* input, uint8_t* output, unsigned count, const ArrayScaling& scaling);
+void float64_to_float32(const epicsFloat64* input, uint8_t* output, unsigned count, const ArrayScaling& scaling);
+
+/*
+ * Kernels for samples packed back to back starting from the least significant
+ * bit of the first byte, bytes limits how far into the report they can look.
+ */
+void unpack_int32(const uint8_t* input, unsigned bytes, unsigned first_bit, const PackedSamples& packing, epicsInt32* output);
+void unpack_float64(const uint8_t* input, unsigned bytes, unsigned first_bit, const PackedSamples& packing, epicsFloat64* output, const ArrayScaling& scaling);
+
+void pack_int32(const epicsInt32* input, uint8_t* output, unsigned bytes, unsigned first_bit, const PackedSamples& packing);
+void pack_float64(const epicsFloat64* input, uint8_t* output, unsigned bytes, unsigned first_bit, const PackedSamples& packing, const ArrayScaling& scaling);
+
+#endif
@@ -1,5 +1,7 @@
 #include "DataLayout.h"
 
+#include <cstring>
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 
@@ -7,10 +9,16 @@
 
 DataLayout::DataLayout(const char* specification_file)
 :   bytes(0), 
+    extra_params(0),
     face_mask(asynDrvUserMask),
-    rupt_mask(0)
+    rupt_mask(0),
+    select_byte(0),
+    select_mask(0xFF),
+    limit_bytes(0)
 {
 	std::ifstream spec_file;
+	
+	for (unsigned index = 0; index < 256; index += 1)    { this->dispatch[index] = -1; }
 
 	if (specification_file == NULL)                 { return; }
 	if (std::string(specification_file).empty())    { return; }
@@ -23,23 +31,54 @@ DataLayout::DataLayout(const char* specification_file)
 		return;
 	}
 	
+	this->load(spec_file);
+	
+	spec_file.close();
+}
+
+/* Specifications that aren't in a file, like ones made from a report descriptor */
+DataLayout::DataLayout(std::istream& specification)
+:   bytes(0), 
+    extra_params(0),
+    face_mask(asynDrvUserMask),
+    rupt_mask(0),
+    select_byte(0),
+    select_mask(0xFF),
+    limit_bytes(0)
+{
+	for (unsigned index = 0; index < 256; index += 1)    { this->dispatch[index] = -1; }
+	
+	this->load(specification);
+}
+
+void DataLayout::load(std::istream& specification)
+{
 	std::string line;
+	int current_report = -1;
+	unsigned current_endpoint = 0;
 	
-	while (getline(spec_file, line))
+	while (getline(specification, line))
 	{
 		trim(&line);
 		
-		if(! line.empty() && line[0] != '#')
+		if (! line.empty() && line[0] == '@')
+		{
+			this->directive(line, &current_report, &current_endpoint);
+		}
+		else if(! line.empty() && line[0] != '#')
 		{
 			Allocation toadd(line);
+			toadd.report = current_report;
+			toadd.endpoint = current_endpoint;
+			
 			this->add(toadd);
 		}
 	}
-	
-	spec_file.close();
 }
 
 unsigned const DataLayout::size()              { return storage.size(); }
+unsigned const DataLayout::length()            { return bytes; }
+unsigned const DataLayout::params()            { return storage.size() + extra_params; }
 int      const DataLayout::interface_mask()    { return face_mask; }
 int      const DataLayout::interrupt_mask()    { return rupt_mask; }
 
@@ -72,11 +111,243 @@ void DataLayout::add(Allocation& input)
 {
 	storage.push_back(input);
 
-	/* Keep a note of the last index referenced by a parameter */
+	/* Keep a note of the last index referenced by a parameter, other endpoints have their own reports */
 	unsigned endpoint = input.start + input.length;
-	this->bytes = (endpoint > bytes) ? endpoint : bytes;
+	
+	if (input.endpoint == 0)    { this->bytes = (endpoint > bytes) ? endpoint : bytes; }
 		
 	/* Build the masks used by asynPortDriver to properly set parameters */	
 	this->face_mask |= input.type.mask;;
 	this->rupt_mask |= input.type.mask;;	
+	
+	/* Buffered fields publish their samples and times as arrays */
+	if (input.option("samples", 0.0) >= 1.0)
+	{
+		this->extra_params += 2;
+		
+		this->face_mask |= asynInt32ArrayMask | asynFloat64ArrayMask;
+		this->rupt_mask |= asynInt32ArrayMask | asynFloat64ArrayMask;
+	}
+}
+
+/**
+ * @report ID       Fields after this are only in reports with the ID
+ * @report          Fields after this are in every report again
+ * @select [BYTE] /MASK    Where the ID is found, [0] /0xFF by default
+ * @endpoint ADDRESS       Fields after this are read from another input endpoint
+ * @endpoint               Fields after this are read from the port's own endpoint
+ */
+void DataLayout::directive(std::string line, int* current_report, unsigned* current_endpoint)
+{
+	std::string name = split_on(&line, " ");
+	
+	if (name == "@report")
+	{
+		unsigned report = 0;
+		
+		if (line.empty())
+		{
+			*current_report = -1;
+			return;
+		}
+		
+		hex_to_int(line, &report);
+		
+		if (report > 0xFF)
+		{
+			printf("Report IDs must fit in a byte: %s\n", line.c_str());
+			return;
+		}
+		
+		*current_report = report;
+	}
+	else if (name == "@select")
+	{
+		split_on(&line, "[");
+		
+		std::string byte = split_on(&line, "]");
+		split_on(&line, "/");
+		
+		to_int(byte, &this->select_byte);
+		hex_to_int(line, &this->select_mask);
+		
+		/* No field has to cover the ID, but every report buffer has to hold it */
+		this->bytes = std::max(this->bytes, this->select_byte + 1);
+	}
+	else if (name == "@endpoint")
+	{
+		unsigned endpoint = 0;
+		
+		/* Report IDs don't carry over from one endpoint to the next */
+		*current_report = -1;
+		
+		if (line.empty())
+		{
+			*current_endpoint = 0;
+			return;
+		}
+		
+		hex_to_int(line, &endpoint);
+		
+		if (endpoint > 0xFF or not (endpoint & 0x80))
+		{
+			printf("Not an input endpoint address: %s\n", line.c_str());
+			return;
+		}
+		
+		*current_endpoint = endpoint;
+	}
+	else
+	{
+		printf("Unknown directive: %s\n", name.c_str());
+	}
+}
+
+void DataLayout::compile()
+{
+	this->plan.compile(this->storage, -1, this->limit_bytes);
+	
+	this->report_plans.clear();
+	this->report_last.clear();
+	this->report_primed.clear();
+	
+	for (unsigned report = 0; report < 256; report += 1)
+	{
+		this->dispatch[report] = -1;
+		
+		for (unsigned index = 0; index < this->storage.size(); index += 1)
+		{
+			if (this->storage[index].report != (int) report)    { continue; }
+			if (this->storage[index].endpoint != 0)             { continue; }
+			
+			this->dispatch[report] = this->report_plans.size();
+			
+			this->report_plans.push_back(DecodePlan());
+			this->report_plans.back().compile(this->storage, report, this->limit_bytes);
+			
+			this->report_last.push_back(std::vector<uint8_t>(this->bytes, 0));
+			this->report_primed.push_back(false);
+			break;
+		}
+	}
+}
+
+/* 
+ * Leaves fields that don't fit in the device's reports out of the plans, 
+ * so they're never decoded from bytes the device didn't send.
+ */
+void DataLayout::limit(unsigned report_length)
+{
+	if (report_length == this->limit_bytes)    { return; }
+	
+	this->limit_bytes = report_length;
+	this->compile();
+}
+
+void DataLayout::reset()
+{
+	this->report_primed.assign(this->report_primed.size(), false);
+}
+
+/**
+ * Updates the parameters of every field whose bits differ between the
+ * current and previous reports, returns the number of fields updated.
+ * Fields that only belong to one report ID are left alone unless the 
+ * report has that ID, and are compared to the last report that did.
+ */
+unsigned DataLayout::decode(asynPortDriver* driver, uint8_t* data, const uint8_t* previous)
+{
+	unsigned output = this->plan.decode(driver, this->storage, data, previous);
+	
+	if (this->report_plans.empty())    { return output; }
+	
+	int found = this->dispatch[data[this->select_byte] & this->select_mask & 0xFF];
+	
+	if (found < 0)    { return output; }
+	
+	std::vector<uint8_t>& last = this->report_last[found];
+	
+	/* Nothing to compare the first report of an ID to, so post all of it */
+	if (not this->report_primed[found])
+	{
+		for (unsigned index = 0; index < last.size(); index += 1)    { last[index] = ~data[index]; }
+		
+		this->report_primed[found] = true;
+	}
+	
+	output += this->report_plans[found].decode(driver, this->storage, data, &last[0]);
+	
+	if (not last.empty())    { memcpy(&last[0], data, last.size()); }
+	
+	return output;
+}
+
+unsigned DataLayout::flush(asynPortDriver* driver)
+{
+	unsigned output = this->plan.flush(driver);
+	
+	for (unsigned index = 0; index < this->report_plans.size(); index += 1)
+	{
+		output += this->report_plans[index].flush(driver);
+	}
+	
+	return output;
+}
+
+double DataLayout::samplePeriod()
+{
+	double output = 0.0;
+	
+	for (unsigned index = 0; index < this->storage.size(); index += 1)
+	{
+		if (this->storage[index].option("samples", 0.0) < 1.0)    { continue; }
+		
+		double period = this->storage[index].option("period", 0.0) / 1000.0;
+		
+		if (period > 0.0 and (output == 0.0 or period < output))    { output = period; }
+	}
+	
+	return output;
+}
+
+std::vector<unsigned> DataLayout::endpoints()
+{
+	std::vector<unsigned> output;
+	
+	for (unsigned index = 0; index < this->storage.size(); index += 1)
+	{
+		unsigned endpoint = this->storage[index].endpoint;
+		
+		if (endpoint == 0)    { continue; }
+		
+		if (std::find(output.begin(), output.end(), endpoint) == output.end())    { output.push_back(endpoint); }
+	}
+	
+	return output;
+}
+
+/**
+ * Copies out the fields read from another endpoint as a layout of their
+ * own, keeping their param indices, so they can be decoded against that
+ * endpoint's reports. The copy still needs to be compiled.
+ */
+DataLayout DataLayout::section(unsigned endpoint)
+{
+	DataLayout output((const char*) NULL);
+	
+	output.select_byte = this->select_byte;
+	output.select_mask = this->select_mask;
+	output.bytes       = this->select_byte + 1;
+	
+	for (unsigned index = 0; index < this->storage.size(); index += 1)
+	{
+		if (this->storage[index].endpoint != endpoint)    { continue; }
+		
+		Allocation field = this->storage[index];
+		field.endpoint = 0;
+		
+		output.add(field);
+	}
+	
+	return output;
 }
@@ -3,28 +3,65 @@
 
 #include <vector>
 #include <string>
+#include <istream>
 
 #include "Allocation.h"
+#include "DecodePlan.h"
 
 
 class DataLayout
 {
 	public:
 		DataLayout(const char* specification_file);
+		DataLayout(std::istream& specification);
 		void               add(Allocation& input);
 			
-		unsigned    const  size();              //Number of Params
+		unsigned    const  size();              //Number of Fields
+		unsigned    const  params();            //Number of Params, buffered fields have three
+		unsigned    const  length();            //Bytes of report the fields cover
 		int         const  interface_mask();    //What types are supported
 		int         const  interrupt_mask();    //What interrupt types are supported
 		Allocation* const  get(const unsigned index);
 		Allocation* const  get(std::string param_name);
 		Allocation* const  withIndex(int find_index);
 		
+		void               compile();           //Build the DecodePlan, after params are created
+		void               limit(unsigned report_length);    //Rebuild without fields past the report, 0 for all
+		unsigned           decode(asynPortDriver* driver, uint8_t* data, const uint8_t* previous);
+		void               reset();             //Forget the last report of each ID
+		unsigned           flush(asynPortDriver* driver);    //Post buffered fields past their period
+		double             samplePeriod();      //Shortest period of any buffered field, 0 for none
+		
+		std::vector<unsigned> endpoints();      //Extra input endpoints used by fields
+		DataLayout            section(unsigned endpoint);
+		
 	private:
+		void load(std::istream& specification);
+		void directive(std::string line, int* current_report, unsigned* current_endpoint);
+		
 		unsigned bytes;
+		unsigned extra_params;
 		int face_mask;
 		int rupt_mask;
 		std::vector<Allocation> storage;
+		DecodePlan plan;
+		
+		/* Where the report ID is found, set with @select */
+		unsigned select_byte;
+		unsigned select_mask;
+		
+		/* Length of the device's reports once connected, 0 until then */
+		unsigned limit_bytes;
+		
+		/* 
+		 * Fields belonging to a single report ID get a plan of their own, 
+		 * found through the dispatch table, and are compared against the
+		 * last report that had the same ID.
+		 */
+		int                                dispatch[256];
+		std::vector<DecodePlan>            report_plans;
+		std::vector<std::vector<uint8_t> > report_last;
+		std::vector<bool>                  report_primed;
 };
 
 #endif
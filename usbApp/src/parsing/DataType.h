@@ -8,19 +8,40 @@
 typedef void (*READ_FUNCTION)(asynPortDriver*, uint8_t*, void*);
 typedef void (*WRITE_FUNCTION)(asynPortDriver*, uint8_t*, void*);
 
+/** 
+ * Selects the specialized kernel a compiled DecodePlan uses for a type, 
+ * anything GENERIC goes through the type's read function instead.
+ */
+enum DecodeKind
+{
+	DECODE_NONE,
+	DECODE_SIGNED,
+	DECODE_UNSIGNED,
+	DECODE_DIGITAL,
+	DECODE_BOOLEAN,
+	DECODE_FLOAT32,
+	DECODE_FLOAT64,
+	DECODE_EVENT,
+	DECODE_GENERIC
+};
+
 typedef struct DataType
 {
-	DataType(READ_FUNCTION read_in, WRITE_FUNCTION write_in, asynParamType param_in, epicsUInt32 mask_in):
+	DataType(READ_FUNCTION read_in, WRITE_FUNCTION write_in, asynParamType param_in, epicsUInt32 mask_in, DecodeKind kind_in, unsigned width_in):
 		read(read_in),
 		write(write_in),
 		param(param_in),
-		mask(mask_in) {}
+		mask(mask_in),
+		kind(kind_in),
+		width(width_in) {}
 
 	DataType():
 		read(NULL),
 		write(NULL),
 		param(asynParamInt32),
-		mask(asynInt32Mask) {}
+		mask(asynInt32Mask),
+		kind(DECODE_NONE),
+		width(0) {}
 		
 	/** Functions to read and write the given type of value */
 	READ_FUNCTION  read;
@@ -29,6 +50,10 @@ typedef struct DataType
 	/** Used for created the asynPortDriver **/
 	asynParamType param;
 	epicsUInt32   mask;
+	
+	/** Used when compiling a DecodePlan, width is the most bytes read **/
+	DecodeKind    kind;
+	unsigned      width;
 }DataType;
 
 #endif
@@ -0,0 +1,334 @@
+#include <cstring>
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "DecodePlan.h"
+
+
+static unsigned bit_length(epicsUInt32 mask)
+{
+	unsigned output = 0;
+	
+	while (mask)
+	{
+		output += 1;
+		mask >>= 1;
+	}
+	
+	return output;
+}
+
+
+static bool by_range(const DecodeStep& first, const DecodeStep& second)
+{
+	if (first.start != second.start)    { return first.start < second.start; }
+	
+	return first.bytes < second.bytes;
+}
+
+
+void DecodePlan::compile(std::vector<Allocation>& storage, int report, unsigned limit)
+{
+	this->steps.clear();
+	this->sampled.clear();
+	this->buffers.clear();
+	this->length = 0;
+	
+	for (unsigned index = 0; index < storage.size(); index += 1)
+	{
+		Allocation& layout = storage[index];
+		
+		if (layout.type.kind == DECODE_NONE)    { continue; }
+		if (layout.report != report)            { continue; }
+		if (layout.endpoint != 0)               { continue; }
+		
+		if (limit and layout.start + layout.length > limit)    { continue; }
+		
+		this->length = std::max(this->length, layout.start + layout.length);
+		
+		DecodeStep step;
+		
+		step.kind   = layout.type.kind;
+		step.start  = layout.start;
+		step.bytes  = layout.length;
+		step.shift  = layout.shift;
+		step.mask   = layout.mask;
+		step.extend = 0;
+		step.param  = layout.index;
+		step.alloc  = index;
+		
+		/* Scalars only ever load as many bytes as their type holds */
+		if (layout.type.width != 0)    { step.bytes = std::min(layout.length, layout.type.width); }
+		
+		/*
+		 * Signed values extend whichever is the most "leftward" bit, the top
+		 * of the mask or the top of the allocation after the shift.
+		 */
+		if (step.kind == DECODE_SIGNED)
+		{
+			int bitsize = std::min((int) bit_length(layout.mask), (int) (layout.length * 8) - (int) layout.shift);
+			
+			if (bitsize > 0 and bitsize < 32)    { step.extend = 32 - bitsize; }
+		}
+		
+		if (layout.samples_index >= 0)
+		{
+			this->sampled.push_back(step);
+			this->buffers.push_back(SampleBuffer(layout));
+			continue;
+		}
+		
+		this->steps.push_back(step);
+	}
+	
+	/* Keeps fields that read the same bytes next to each other */
+	std::stable_sort(this->steps.begin(), this->steps.end(), by_range);
+	
+	/* Padding lets the change checks load a full word at any field */
+	this->diff.assign(this->length + sizeof(epicsUInt32), 0);
+	this->dirty.assign((this->steps.size() + 63) / 64, 0);
+}
+
+
+static inline epicsUInt32 load(const uint8_t* data, unsigned bytes)
+{
+	epicsUInt32 output = 0;
+	
+	memcpy(&output, data, bytes);
+	
+	return output;
+}
+
+
+/**
+ * Fills diff with the XOR of the two reports, returns whether anything changed.
+ */
+bool DecodePlan::findChanges(const uint8_t* data, const uint8_t* previous)
+{
+	uint8_t* output = &this->diff[0];
+	unsigned index = 0;
+	
+#ifdef __SSE2__
+	__m128i any_vector = _mm_setzero_si128();
+	
+	for (; index + 16 <= this->length; index += 16)
+	{
+		__m128i current = _mm_loadu_si128((const __m128i*) &data[index]);
+		__m128i last    = _mm_loadu_si128((const __m128i*) &previous[index]);
+		__m128i changes = _mm_xor_si128(current, last);
+		
+		_mm_storeu_si128((__m128i*) &output[index], changes);
+		any_vector = _mm_or_si128(any_vector, changes);
+	}
+	
+	bool any = (_mm_movemask_epi8(_mm_cmpeq_epi8(any_vector, _mm_setzero_si128())) != 0xFFFF);
+#else
+	bool any = false;
+#endif
+	
+	for (; index + 8 <= this->length; index += 8)
+	{
+		uint64_t current, last;
+		
+		memcpy(&current, &data[index], 8);
+		memcpy(&last, &previous[index], 8);
+		
+		uint64_t changes = current ^ last;
+		
+		memcpy(&output[index], &changes, 8);
+		any = any or (changes != 0);
+	}
+	
+	for (; index < this->length; index += 1)
+	{
+		output[index] = data[index] ^ previous[index];
+		any = any or (output[index] != 0);
+	}
+	
+	return any;
+}
+
+
+static inline bool any_set(const uint8_t* data, unsigned bytes)
+{
+	for (unsigned index = 0; index < bytes; index += 1)
+	{
+		if (data[index])    { return true; }
+	}
+	
+	return false;
+}
+
+
+static inline bool is_integer(DecodeKind kind)
+{
+	return kind == DECODE_SIGNED or kind == DECODE_UNSIGNED or kind == DECODE_DIGITAL or kind == DECODE_BOOLEAN;
+}
+
+
+/*
+ * The one place the integer kinds are decoded, for the change checks, the
+ * posted params and the buffered samples alike. Signed values come back 
+ * sign extended, so are only meaningful cast back to epicsInt32.
+ */
+static inline epicsUInt32 decode_integer(const DecodeStep& step, const uint8_t* field)
+{
+	switch (step.kind)
+	{
+		/* Signed values shift arithmetically, so the diff has to as well */
+		case DECODE_SIGNED:
+		{
+			epicsInt32 value = (((epicsInt32) load(field, step.bytes)) >> step.shift) & step.mask;
+			
+			if (step.extend)    { value = ((epicsInt32) ((epicsUInt32) value << step.extend)) >> step.extend; }
+			
+			return (epicsUInt32) value;
+		}
+		
+		case DECODE_BOOLEAN:
+			return ((load(field, step.bytes) >> step.shift) & step.mask) ? 1 : 0;
+		
+		default:
+			return (load(field, step.bytes) >> step.shift) & step.mask;
+	}
+}
+
+
+static inline epicsFloat64 decode_float(const DecodeStep& step, const uint8_t* field)
+{
+	if (step.kind == DECODE_FLOAT32)
+	{
+		epicsFloat32 value = 0.0;
+		memcpy(&value, field, step.bytes);
+		return value;
+	}
+	
+	epicsFloat64 value = 0.0;
+	memcpy(&value, field, step.bytes);
+	return value;
+}
+
+
+/* Buffered values are kept as doubles, which hold any 32 bit integer exactly */
+static inline epicsFloat64 sample_value(const DecodeStep& step, const uint8_t* field)
+{
+	if (step.kind == DECODE_SIGNED)    { return (epicsInt32) decode_integer(step, field); }
+	if (is_integer(step.kind))         { return decode_integer(step, field); }
+	
+	return decode_float(step, field);
+}
+
+
+/**
+ * Decodes and posts every field whose own bits changed since the previous
+ * report, and adds a sample to every buffered field. Returns the number 
+ * of fields updated.
+ */
+unsigned DecodePlan::decode( asynPortDriver* driver, 
+                             std::vector<Allocation>& storage, 
+                             uint8_t* data, 
+                             const uint8_t* previous)
+{
+	unsigned amt_published = 0;
+	
+	for (unsigned index = 0; index < this->sampled.size(); index += 1)
+	{
+		const DecodeStep& step = this->sampled[index];
+		
+		if (this->buffers[index].add(driver, sample_value(step, &data[step.start])))    { amt_published += 1; }
+	}
+	
+	if (not this->findChanges(data, previous))    { return amt_published; }
+	
+	const uint8_t* changes = &this->diff[0];
+	unsigned amt_dirty = 0;
+	
+	/* Mark the fields whose masked bits differ */
+	for (unsigned index = 0; index < this->steps.size(); index += 1)
+	{
+		const DecodeStep& step = this->steps[index];
+		const uint8_t* field = &changes[step.start];
+		
+		bool changed;
+		
+		if (is_integer(step.kind))    { changed = decode_integer(step, field) != 0; }
+		else                          { changed = any_set(field, storage[step.alloc].length); }
+		
+		if (changed)
+		{
+			this->dirty[index >> 6] |= ((uint64_t) 1) << (index & 63);
+			amt_dirty += 1;
+		}
+	}
+	
+	/* Then decode only those */
+	for (unsigned word = 0; word < this->dirty.size(); word += 1)
+	{
+		uint64_t bits = this->dirty[word];
+		
+		this->dirty[word] = 0;
+		
+		while (bits)
+		{
+			unsigned index = (word << 6) + __builtin_ctzll(bits);
+			bits &= bits - 1;
+			
+			const DecodeStep* step = &this->steps[index];
+			uint8_t* field = &data[step->start];
+			
+			switch (step->kind)
+			{
+				case DECODE_SIGNED:
+				case DECODE_UNSIGNED:
+				case DECODE_BOOLEAN:
+					driver->setIntegerParam(step->param, (epicsInt32) decode_integer(*step, field));
+					break;
+				
+				case DECODE_DIGITAL:
+					driver->setUIntDigitalParam(step->param, decode_integer(*step, field), step->mask);
+					break;
+				
+				case DECODE_FLOAT32:
+				case DECODE_FLOAT64:
+					driver->setDoubleParam(step->param, decode_float(*step, field));
+					break;
+				
+				case DECODE_EVENT:
+				{
+					epicsUInt32 found = (memchr(field, (int) (step->mask & 0xFF), step->bytes) != NULL) ? 1 : 0;
+					
+					/* Masks wider than a byte can never match a single byte */
+					if (step->mask > 0xFF)    { found = 0; }
+					
+					driver->setIntegerParam(step->param, found);
+					break;
+				}
+				
+				default:
+				{
+					Allocation* layout = &storage[step->alloc];
+					layout->type.read(driver, field, layout);
+					break;
+				}
+			}
+		}
+	}
+	
+	return amt_dirty + amt_published;
+}
+
+
+unsigned DecodePlan::flush(asynPortDriver* driver)
+{
+	unsigned amt_published = 0;
+	
+	for (unsigned index = 0; index < this->buffers.size(); index += 1)
+	{
+		if (this->buffers[index].flush(driver))    { amt_published += 1; }
+	}
+	
+	return amt_published;
+}
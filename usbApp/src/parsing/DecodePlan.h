@@ -0,0 +1,78 @@
+#ifndef INC_DECODEPLAN_H
+#define INC_DECODEPLAN_H
+
+#include <stdint.h>
+#include <vector>
+
+#include <epicsTypes.h>
+#include <asynPortDriver.h>
+
+#include "Allocation.h"
+#include "SampleBuffer.h"
+
+/** A single parameter update with everything precomputed */
+typedef struct DecodeStep
+{
+	DecodeKind   kind;
+	
+	/** Byte offset into the report and number of bytes to load */
+	unsigned     start;
+	unsigned     bytes;
+	
+	unsigned     shift;
+	epicsUInt32  mask;
+	
+	/** Left/right shift pair used to sign extend, 0 for none */
+	unsigned     extend;
+	
+	/** Parameter index and the Allocation it came from */
+	int          param;
+	unsigned     alloc;
+} DecodeStep;
+
+/**
+ * Flat list of decode steps built from a DataLayout's Allocations once 
+ * parameters have been created, so updating from a report doesn't have to 
+ * look at the mask or type of each field again.
+ *
+ * Change detection XORs the whole report against the previous one and 
+ * marks a field dirty only if its own masked bits differ, so only those
+ * fields get decoded and posted.
+ */
+class DecodePlan
+{
+	public:
+		/** 
+		 * Only takes the fields of one report ID, -1 for the common fields,
+		 * that fit within limit bytes, 0 for no limit.
+		 */
+		void compile(std::vector<Allocation>& storage, int report, unsigned limit);
+		
+		unsigned decode( asynPortDriver* driver, 
+		                 std::vector<Allocation>& storage, 
+		                 uint8_t* data, 
+		                 const uint8_t* previous);
+		
+		/** Posts buffered fields whose period has passed, returns how many */
+		unsigned flush(asynPortDriver* driver);
+		
+	private:
+		bool findChanges(const uint8_t* data, const uint8_t* previous);
+		
+		std::vector<DecodeStep>  steps;
+		
+		/** Number of report bytes covered by the steps */
+		unsigned length;
+		
+		/** XOR of the current and previous report, padded for loads */
+		std::vector<uint8_t>     diff;
+		
+		/** One bit per step, set when the step needs decoding */
+		std::vector<uint64_t>    dirty;
+		
+		/** Buffered fields are decoded from every report, changed or not */
+		std::vector<DecodeStep>    sampled;
+		std::vector<SampleBuffer>  buffers;
+};
+
+#endif
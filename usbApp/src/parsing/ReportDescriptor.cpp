@@ -0,0 +1,439 @@
+#include "ReportDescriptor.h"
+
+#include <cstdio>
+#include <algorithm>
+
+/* Item types, from the prefix byte of each short item */
+static const unsigned ITEM_MAIN   = 0;
+static const unsigned ITEM_GLOBAL = 1;
+static const unsigned ITEM_LOCAL  = 2;
+
+/* Long items have a prefix of their own, no tags for them are defined */
+static const uint8_t  LONG_ITEM   = 0xFE;
+
+/* Data flags on Input and Output items */
+static const uint32_t FLAG_CONSTANT = 0x01;
+static const uint32_t FLAG_VARIABLE = 0x02;
+
+typedef struct UsageName
+{
+	uint16_t    usage;
+	const char* name;
+} UsageName;
+
+static const UsageName DESKTOP_NAMES[] =
+{
+	{0x30, "X"},        {0x31, "Y"},          {0x32, "Z"},
+	{0x33, "RX"},       {0x34, "RY"},         {0x35, "RZ"},
+	{0x36, "SLIDER"},   {0x37, "DIAL"},       {0x38, "WHEEL"},
+	{0x39, "HAT_SWITCH"},
+	{0x3D, "START"},    {0x3E, "SELECT"},
+	{0x40, "VX"},       {0x41, "VY"},         {0x42, "VZ"},
+	{0x43, "VBRX"},     {0x44, "VBRY"},       {0x45, "VBRZ"},
+	{0x90, "DPAD_UP"},  {0x91, "DPAD_DOWN"},  {0x92, "DPAD_RIGHT"},  {0x93, "DPAD_LEFT"},
+	{0, NULL}
+};
+
+static const UsageName SIMULATION_NAMES[] =
+{
+	{0xBA, "RUDDER"},   {0xBB, "THROTTLE"},   {0xC4, "ACCELERATOR"},
+	{0xC5, "BRAKE"},    {0xC8, "STEERING"},
+	{0, NULL}
+};
+
+static const UsageName KEYBOARD_NAMES[] =
+{
+	{0xE0, "LEFT_CTRL"},   {0xE1, "LEFT_SHIFT"},   {0xE2, "LEFT_ALT"},   {0xE3, "LEFT_GUI"},
+	{0xE4, "RIGHT_CTRL"},  {0xE5, "RIGHT_SHIFT"},  {0xE6, "RIGHT_ALT"},  {0xE7, "RIGHT_GUI"},
+	{0, NULL}
+};
+
+static const UsageName LED_NAMES[] =
+{
+	{0x01, "NUM_LOCK"}, {0x02, "CAPS_LOCK"},  {0x03, "SCROLL_LOCK"},
+	{0x04, "COMPOSE"},  {0x05, "KANA"},
+	{0, NULL}
+};
+
+static const UsageName CONSUMER_NAMES[] =
+{
+	{0xE2, "MUTE"},     {0xE9, "VOLUME_UP"},  {0xEA, "VOLUME_DOWN"},
+	{0, NULL}
+};
+
+
+static std::string number(unsigned value)
+{
+	std::ostringstream output;
+	
+	output << value;
+	
+	return output.str();
+}
+
+
+static std::string page_name(unsigned page)
+{
+	switch (page)
+	{
+		case 0x01:    return "DESKTOP";
+		case 0x02:    return "SIMULATION";
+		case 0x07:    return "KEY";
+		case 0x08:    return "LED";
+		case 0x09:    return "BUTTON";
+		case 0x0C:    return "CONSUMER";
+	}
+	
+	if (page >= 0xFF00)    { return "VENDOR"; }
+	
+	char buffer[16];
+	snprintf(buffer, sizeof(buffer), "PAGE_%02X", page);
+	
+	return std::string(buffer);
+}
+
+
+static const UsageName* page_table(unsigned page)
+{
+	switch (page)
+	{
+		case 0x01:    return DESKTOP_NAMES;
+		case 0x02:    return SIMULATION_NAMES;
+		case 0x07:    return KEYBOARD_NAMES;
+		case 0x08:    return LED_NAMES;
+		case 0x0C:    return CONSUMER_NAMES;
+	}
+	
+	return NULL;
+}
+
+
+/*
+ * Usages with a well known name get it, anything else is named after its
+ * page and number, like BUTTON_3 or KEY_41.
+ */
+static std::string usage_name(uint32_t usage)
+{
+	unsigned page = usage >> 16;
+	unsigned id   = usage & 0xFFFF;
+	
+	const UsageName* table = page_table(page);
+	
+	for (; table != NULL and table->name != NULL; table += 1)
+	{
+		if (table->usage == id)    { return table->name; }
+	}
+	
+	return page_name(page) + "_" + number(id);
+}
+
+
+
+ReportDescriptor::ReportDescriptor(const uint8_t* data, unsigned length)
+:	usage_min(0),
+	usage_max(0),
+	has_range(false),
+	uses_ids(false),
+	generic_count(0),
+	input_report(-1),
+	output_report(-1)
+{
+	unsigned index = 0;
+	
+	while (index < length)
+	{
+		uint8_t prefix = data[index];
+		
+		if (prefix == LONG_ITEM)
+		{
+			if (index + 1 >= length)    { break; }
+			
+			index += 3 + data[index + 1];
+			continue;
+		}
+		
+		/* A size of 3 actually means four bytes of data */
+		unsigned size = prefix & 0x03;
+		unsigned type = (prefix >> 2) & 0x03;
+		unsigned tag  = prefix >> 4;
+		
+		if (size == 3)    { size = 4; }
+		
+		if (index + 1 + size > length)    { break; }
+		
+		uint32_t value = 0;
+		
+		for (unsigned byte = 0; byte < size; byte += 1)
+		{
+			value |= ((uint32_t) data[index + 1 + byte]) << (8 * byte);
+		}
+		
+		int32_t signed_value = (int32_t) value;
+		
+		if      (size == 1)    { signed_value = (int8_t) value; }
+		else if (size == 2)    { signed_value = (int16_t) value; }
+		
+		switch (type)
+		{
+			case ITEM_MAIN:      this->main(tag, value);                   break;
+			case ITEM_GLOBAL:    this->global(tag, value, signed_value);   break;
+			case ITEM_LOCAL:     this->local(tag, value, size);            break;
+		}
+		
+		index += 1 + size;
+	}
+}
+
+
+void ReportDescriptor::global(unsigned tag, uint32_t value, int32_t signed_value)
+{
+	switch (tag)
+	{
+		case 0x0:    this->globals.page = value;                 break;
+		case 0x1:    this->globals.logical_min = signed_value;   break;
+		case 0x2:    this->globals.logical_max = signed_value;   break;
+		case 0x7:    this->globals.size = value;                 break;
+		case 0x9:    this->globals.count = value;                break;
+		
+		case 0x8:
+			this->globals.report = value & 0xFF;
+			this->uses_ids = true;
+			break;
+		
+		case 0xA:
+			this->stack.push_back(this->globals);
+			break;
+		
+		case 0xB:
+			if (not this->stack.empty())
+			{
+				this->globals = this->stack.back();
+				this->stack.pop_back();
+			}
+			break;
+	}
+}
+
+
+/*
+ * Usages given with four bytes carry their own page, shorter ones are in
+ * whichever page was last set.
+ */
+void ReportDescriptor::local(unsigned tag, uint32_t value, unsigned size)
+{
+	uint32_t usage = (size == 4) ? value : ((this->globals.page << 16) | (value & 0xFFFF));
+	
+	switch (tag)
+	{
+		case 0x0:
+			this->usages.push_back(usage);
+			break;
+		
+		case 0x1:
+			this->usage_min = usage;
+			this->has_range = true;
+			break;
+		
+		case 0x2:
+			this->usage_max = usage;
+			this->has_range = true;
+			break;
+	}
+}
+
+
+/*
+ * Feature reports go through control transfers rather than the interrupt
+ * endpoints, so only Input and Output items become fields.
+ */
+void ReportDescriptor::main(unsigned tag, uint32_t value)
+{
+	switch (tag)
+	{
+		case 0x8:    this->addFields(this->input, this->input_offsets, &this->input_report, value, "INPUT");   break;
+		case 0x9:    this->addFields(this->output, this->output_offsets, NULL, value, "OUTPUT");               break;
+	}
+	
+	this->usages.clear();
+	this->usage_min = 0;
+	this->usage_max = 0;
+	this->has_range = false;
+}
+
+
+/*
+ * Variable items are a field for each usage, while array items are a list
+ * of slots each holding the usage of something that's currently active,
+ * like the keys being held on a keyboard.
+ */
+void ReportDescriptor::addFields(std::ostringstream& spec, std::map<unsigned, unsigned>& offsets, int* last_report, uint32_t flags, const char* kind)
+{
+	unsigned report = this->globals.report;
+	
+	/* Reports with an ID have it as the first byte */
+	if (offsets.find(report) == offsets.end())    { offsets[report] = this->uses_ids ? 8 : 0; }
+	
+	unsigned offset = offsets[report];
+	
+	offsets[report] += this->globals.size * this->globals.count;
+	
+	if (flags & FLAG_CONSTANT)    { return; }
+	
+	/* Every output report starts at the same byte, so other IDs would overlap the first */
+	if (this->uses_ids and last_report == NULL)
+	{
+		if (this->output_report < 0)    { this->output_report = report; }
+		
+		if (this->output_report != (int) report)
+		{
+			if (this->skipped_outputs.insert(report).second)
+			{
+				printf("ReportDescriptor: output report 0x%02X left out, only report 0x%02X can be written\n", report, this->output_report);
+				
+				char buffer[64];
+				snprintf(buffer, sizeof(buffer), "# Output report 0x%02X left out\n", report);
+				
+				spec << buffer;
+			}
+			
+			return;
+		}
+	}
+	
+	if (this->uses_ids and last_report != NULL and *last_report != (int) report)
+	{
+		char buffer[32];
+		snprintf(buffer, sizeof(buffer), "\n@report 0x%02X\n", report);
+		
+		spec << buffer;
+		*last_report = report;
+	}
+	
+	if (flags & FLAG_VARIABLE)
+	{
+		for (unsigned index = 0; index < this->globals.count; index += 1)
+		{
+			uint32_t usage = this->usageAt(index);
+			
+			std::string name = (usage & 0xFFFF) ? usage_name(usage) : std::string(kind) + "_" + number(++this->generic_count);
+			
+			this->addField(spec, this->uniqueName(name), offset + index * this->globals.size);
+		}
+	}
+	else
+	{
+		std::string slot = page_name(this->usageAt(0) >> 16) + "_SLOT";
+		
+		for (unsigned index = 0; index < this->globals.count; index += 1)
+		{
+			this->addField(spec, this->uniqueName(slot + "_" + number(index + 1)), offset + index * this->globals.size);
+		}
+	}
+}
+
+
+/*
+ * Fields are read with a single load of up to four bytes, so anything
+ * that can't fit in one after being shifted is left out.
+ */
+void ReportDescriptor::addField(std::ostringstream& spec, std::string name, unsigned offset)
+{
+	unsigned size  = this->globals.size;
+	unsigned start = offset / 8;
+	unsigned shift = offset % 8;
+	
+	if (size == 0 or shift + size > 32)
+	{
+		spec << "# " << name << " skipped, " << size << " bits at bit " << offset << " don't fit in one read\n";
+		return;
+	}
+	
+	unsigned end = start + (shift + size - 1) / 8;
+	uint32_t mask = (size == 32) ? 0xFFFFFFFF : (((uint32_t) 1 << size) - 1);
+	
+	/* Devices often give an unsigned maximum without the extra sign byte */
+	bool is_signed = (this->globals.logical_min < 0);
+	
+	int32_t maximum = this->globals.logical_max;
+	
+	if (not is_signed and maximum < 0)    { maximum = (int32_t) (maximum & mask); }
+	
+	const char* type = (size == 1) ? "Bool" : (is_signed ? "Int32" : "UInt32");
+	
+	char buffer[160];
+	
+	snprintf(buffer, sizeof(buffer), "# %u bit%s, logical %d to %d\n", size, (size == 1) ? "" : "s", this->globals.logical_min, maximum);
+	spec << buffer;
+	
+	spec << name << " [" << start;
+	
+	if (end != start)    { spec << ", " << end; }
+	
+	spec << "]";
+	
+	if (shift != 0)    { spec << " >> " << shift; }
+	
+	snprintf(buffer, sizeof(buffer), " -> %s /0x%X\n", type, mask);
+	spec << buffer;
+}
+
+
+/*
+ * A list of usages is handed out in order with the last one repeating,
+ * a range counts up from its minimum.
+ */
+uint32_t ReportDescriptor::usageAt(unsigned index)
+{
+	if (not this->usages.empty())
+	{
+		return this->usages[std::min(index, (unsigned) this->usages.size() - 1)];
+	}
+	
+	if (this->has_range)    { return std::min(this->usage_min + index, this->usage_max); }
+	
+	return 0;
+}
+
+
+/* Input and output fields share a driver, so they share names too */
+std::string ReportDescriptor::uniqueName(std::string name)
+{
+	std::string output = name;
+	
+	for (unsigned count = 2; this->names.count(output); count += 1)
+	{
+		output = name + "_" + number(count);
+	}
+	
+	this->names.insert(output);
+	
+	return output;
+}
+
+
+std::string ReportDescriptor::inputSpec()
+{
+	return "# Generated from the device's HID report descriptor\n" + this->input.str();
+}
+
+
+/*
+ * Output reports with IDs all start at the second byte, so only the first
+ * ID's fields are in the spec. The ID to send is written like any other 
+ * field.
+ */
+std::string ReportDescriptor::outputSpec()
+{
+	std::string output = "# Generated from the device's HID report descriptor\n";
+	
+	if (this->uses_ids and not this->output.str().empty())
+	{
+		char buffer[64];
+		snprintf(buffer, sizeof(buffer), "# Set to 0x%02X before writing the other fields\n", this->output_report);
+		
+		output += buffer;
+		output += this->uniqueName("REPORT_ID") + " [0] -> UInt32 /0xFF\n";
+	}
+	
+	return output + this->output.str();
+}
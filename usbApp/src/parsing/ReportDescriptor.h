@@ -0,0 +1,82 @@
+#ifndef INC_REPORTDESCRIPTOR_H
+#define INC_REPORTDESCRIPTOR_H
+
+#include <stdint.h>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/** Global items, which Push and Pop save and restore as a whole */
+typedef struct ReportGlobals
+{
+	ReportGlobals(): page(0), logical_min(0), logical_max(0), size(0), count(0), report(0) {}
+	
+	uint32_t     page;
+	int32_t      logical_min;
+	int32_t      logical_max;
+	unsigned     size;
+	unsigned     count;
+	unsigned     report;
+} ReportGlobals;
+
+/**
+ * Turns a HID report descriptor into the text of an input and an output
+ * specification file, the same format that DataLayout reads.
+ *
+ * Every variable item becomes a field named after its usage, with the
+ * bit offset, size and signedness coming from the descriptor. Constant
+ * items are only padding and are left out. Reports with IDs are split
+ * up with @report directives, so each ID only decodes its own fields.
+ * Output layouts have no such split, so only the first output report ID
+ * gets fields.
+ */
+class ReportDescriptor
+{
+	public:
+		ReportDescriptor(const uint8_t* data, unsigned length);
+		
+		std::string inputSpec();
+		std::string outputSpec();
+	
+	private:
+		void global(unsigned tag, uint32_t value, int32_t signed_value);
+		void local(unsigned tag, uint32_t value, unsigned size);
+		void main(unsigned tag, uint32_t value);
+		
+		void addFields(std::ostringstream& spec, std::map<unsigned, unsigned>& offsets, int* last_report, uint32_t flags, const char* kind);
+		void addField(std::ostringstream& spec, std::string name, unsigned offset);
+		
+		uint32_t    usageAt(unsigned index);
+		std::string uniqueName(std::string name);
+		
+		ReportGlobals              globals;
+		std::vector<ReportGlobals> stack;
+		
+		/* Local items, cleared after every main item */
+		std::vector<uint32_t>      usages;
+		uint32_t                   usage_min;
+		uint32_t                   usage_max;
+		bool                       has_range;
+		
+		bool                       uses_ids;
+		unsigned                   generic_count;
+		
+		/* Next free bit of each report ID, for either direction */
+		std::map<unsigned, unsigned> input_offsets;
+		std::map<unsigned, unsigned> output_offsets;
+		
+		/* Last ID given an @report directive */
+		int                        input_report;
+		
+		/* The only output report ID given fields, and the ones left out */
+		int                        output_report;
+		std::set<unsigned>         skipped_outputs;
+		
+		std::set<std::string>      names;
+		std::ostringstream         input;
+		std::ostringstream         output;
+};
+
+#endif
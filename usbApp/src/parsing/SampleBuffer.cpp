@@ -0,0 +1,126 @@
+#include <algorithm>
+
+#include "SampleBuffer.h"
+
+SampleBuffer::SampleBuffer(Allocation& layout)
+:	count(0),
+	capacity((unsigned) std::max(1.0, layout.option("samples", 1.0))),
+	period(layout.option("period", 0.0) / 1000.0),
+	type(layout.type.param),
+	array_type(arrayType(layout)),
+	mask(layout.mask),
+	value_param(layout.index),
+	samples_param(layout.samples_index),
+	times_param(layout.times_index)
+{
+	this->first.secPastEpoch = 0;
+	this->first.nsec = 0;
+	
+	this->values.assign(this->capacity, 0.0);
+	this->times.assign(this->capacity, 0.0);
+	
+	if (this->array_type == asynParamInt32Array)    { this->ints.assign(this->capacity, 0); }
+}
+
+
+/* Only fields that decode to a single number can be buffered */
+bool SampleBuffer::supports(DecodeKind kind)
+{
+	switch (kind)
+	{
+		case DECODE_SIGNED:
+		case DECODE_UNSIGNED:
+		case DECODE_DIGITAL:
+		case DECODE_BOOLEAN:
+		case DECODE_FLOAT32:
+		case DECODE_FLOAT64:
+			return true;
+		
+		default:
+			return false;
+	}
+}
+
+
+/* Unsigned 32 bit values don't fit an Int32Array, but a double holds them exactly */
+asynParamType SampleBuffer::arrayType(Allocation& layout)
+{
+	if (layout.type.param == asynParamFloat64)                           { return asynParamFloat64Array; }
+	if (layout.type.kind == DECODE_DIGITAL)                              { return asynParamFloat64Array; }
+	if (layout.type.kind == DECODE_UNSIGNED and layout.type.width >= 4)  { return asynParamFloat64Array; }
+	
+	return asynParamInt32Array;
+}
+
+
+/*
+ * Samples are stamped with the driver's current time stamp, which is the
+ * time the report they came from arrived.
+ */
+bool SampleBuffer::add(asynPortDriver* driver, epicsFloat64 value)
+{
+	epicsTimeStamp now;
+	driver->getTimeStamp(&now);
+	
+	if (this->count == 0)    { this->first = now; }
+	
+	this->values[this->count] = value;
+	this->times[this->count]  = (now.secPastEpoch + POSIX_TIME_AT_EPICS_EPOCH) + now.nsec * 1e-9;
+	this->count += 1;
+	
+	bool full = (this->count >= this->capacity);
+	bool due  = (this->period > 0.0 and epicsTimeDiffInSeconds(&now, &this->first) >= this->period);
+	
+	if (not full and not due)    { return false; }
+	
+	this->publish(driver);
+	return true;
+}
+
+
+/*
+ * Called periodically, so a device that stops reporting doesn't hold its
+ * last samples back until the next one arrives.
+ */
+bool SampleBuffer::flush(asynPortDriver* driver)
+{
+	if (this->count == 0 or this->period <= 0.0)    { return false; }
+	
+	epicsTimeStamp now;
+	driver->getTimeStamp(&now);
+	
+	if (epicsTimeDiffInSeconds(&now, &this->first) < this->period)    { return false; }
+	
+	this->publish(driver);
+	return true;
+}
+
+
+void SampleBuffer::publish(asynPortDriver* driver)
+{
+	epicsFloat64 last = this->values[this->count - 1];
+	
+	if (this->array_type == asynParamFloat64Array)
+	{
+		driver->doCallbacksFloat64Array(&this->values[0], this->count, this->samples_param, 0);
+	}
+	else
+	{
+		for (unsigned index = 0; index < this->count; index += 1)
+		{
+			this->ints[index] = (epicsInt32) this->values[index];
+		}
+		
+		driver->doCallbacksInt32Array(&this->ints[0], this->count, this->samples_param, 0);
+	}
+	
+	/* Unsigned 32 bit values wrap in the Int32 param, as they do unbuffered */
+	if      (this->type == asynParamFloat64)                 { driver->setDoubleParam(this->value_param, last); }
+	else if (this->type == asynParamUInt32Digital)           { driver->setUIntDigitalParam(this->value_param, (epicsUInt32) last, this->mask); }
+	else if (this->array_type == asynParamFloat64Array)      { driver->setIntegerParam(this->value_param, (epicsInt32) (epicsUInt32) last); }
+	else                                                     { driver->setIntegerParam(this->value_param, (epicsInt32) last); }
+	
+	driver->doCallbacksFloat64Array(&this->times[0], this->count, this->times_param, 0);
+	
+	this->count = 0;
+}
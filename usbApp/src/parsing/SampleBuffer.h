@@ -0,0 +1,61 @@
+#ifndef INC_SAMPLEBUFFER_H
+#define INC_SAMPLEBUFFER_H
+
+#include <vector>
+
+#include <epicsTypes.h>
+#include <epicsTime.h>
+#include <asynPortDriver.h>
+
+#include "Allocation.h"
+
+/**
+ * Collects every decoded value of a scalar field, set up with the samples
+ * option in the spec file, and publishes them as a block instead of one
+ * callback per report.
+ *
+ * A block goes out once it holds the given number of samples, or once the
+ * given period has passed since its first sample, as an Int32Array (or a 
+ * Float64Array for floating point and unsigned 32 bit fields) along with a
+ * Float64Array of the time each sample arrived. The field's own param is set to the last value
+ * in the block at the same time.
+ */
+class SampleBuffer
+{
+	public:
+		SampleBuffer(Allocation& layout);
+		
+		/** Returns true if the sample completed a block */
+		bool add(asynPortDriver* driver, epicsFloat64 value);
+		
+		/** Posts a partial block once its period has passed, returns true if it did */
+		bool flush(asynPortDriver* driver);
+		
+		static bool supports(DecodeKind kind);
+		
+		/** The type of the array the samples are published as */
+		static asynParamType arrayType(Allocation& layout);
+		
+	private:
+		void publish(asynPortDriver* driver);
+		
+		unsigned       count;
+		unsigned       capacity;
+		double         period;
+		epicsTimeStamp first;
+		
+		asynParamType  type;
+		asynParamType  array_type;
+		epicsUInt32    mask;
+		int            value_param;
+		int            samples_param;
+		int            times_param;
+		
+		std::vector<epicsFloat64> values;
+		std::vector<epicsInt32>   ints;
+		
+		/* Seconds since the POSIX epoch */
+		std::vector<epicsFloat64> times;
+};
+
+#endif
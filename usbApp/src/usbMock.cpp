@@ -0,0 +1,1227 @@
+/*
+ * Simulated stand-in for libusb, built into the usb library in place of
+ * libusb-1.0 when USB_MOCK is set to YES in configure/CONFIG_SITE.
+ *
+ * Virtual devices are created from the iocsh with usbMockDevice and then
+ * look like any other device to the driver, showing up on the bus, being
+ * opened and claimed, and answering interrupt, bulk or isochronous 
+ * transfers at a fixed rate with reports replayed from a capture file or 
+ * made up by a generator.
+ * Binary captures from usbStartCapture can also be replayed with the same
+ * timing they were recorded with.
+ * Timeouts, overflows and the device dropping off the bus can be injected
+ * with usbMockFault, so every path through the driver can be exercised
+ * without any hardware attached.
+ *
+ * Only the parts of libusb used by this module are implemented.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <deque>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#include <libusb-1.0/libusb.h>
+
+#include <iocsh.h>
+#include <epicsTime.h>
+#include <epicsEvent.h>
+#include <epicsMutex.h>
+#include <epicsThread.h>
+#include <epicsExport.h>
+
+#include "ReportCapture.h"
+
+/* Largest high speed interrupt packet */
+static const unsigned MAX_PACKET_SIZE = 1024;
+
+/* Interfaces a simulated device can put its input endpoint on */
+static const int MAX_MOCK_INTERFACES = 4;
+
+#ifdef USB_MOCK
+
+/* Length of time a device unplugged by a fault stays off the bus */
+static const double REPLUG_DELAY = 1.0; //seconds
+
+/* How often an idle device checks its transfers for timeouts */
+static const double IDLE_TICK = 0.01; //seconds
+
+static const uint8_t ENDPOINT_IN  = 0x81;
+static const uint8_t ENDPOINT_OUT = 0x01;
+
+/* The hotplug arguments changed from enums to ints in libusb 1.0.24 */
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000108
+	typedef int mock_events;
+	typedef int mock_flags;
+#else
+	typedef libusb_hotplug_event mock_events;
+	typedef libusb_hotplug_flag  mock_flags;
+#endif
+
+
+typedef struct MockEndpoint
+{
+	uint8_t      address;
+	uint8_t      type;
+	int          interface;
+} MockEndpoint;
+
+typedef struct PendingTransfer
+{
+	struct libusb_transfer* xfr;
+	epicsTimeStamp          deadline;
+	bool                    expires;
+} PendingTransfer;
+
+
+struct libusb_device
+{
+	std::string  name;
+	uint16_t     vendor;
+	uint16_t     product;
+	std::string  serial;
+	unsigned     packet_size;
+	double       rate;
+	
+	/* Every device gets its own root port, and a new address each time it's plugged in */
+	uint8_t      port;
+	uint8_t      address;
+	
+	/* Every input endpoint is sent the same reports */
+	std::vector<MockEndpoint> endpoints;
+	
+	/* Replayed in order when loaded from a capture file */
+	std::vector<std::vector<uint8_t> > capture;
+	std::vector<double> capture_gaps;
+	std::string  generator;
+	unsigned     position;
+	uint8_t      report[MAX_PACKET_SIZE];
+	
+	unsigned long sent;
+	unsigned      timeout_every;
+	unsigned      overflow_every;
+	unsigned      nodevice_every;
+	
+	bool           present;
+	bool           faulted;
+	epicsTimeStamp unplugged;
+	
+	std::deque<PendingTransfer> pending;
+};
+
+struct libusb_device_handle
+{
+	libusb_device* dev;
+};
+
+
+typedef struct MockEvent
+{
+	struct libusb_transfer* xfr;
+	libusb_device*          dev;
+	libusb_hotplug_event    hotplug;
+} MockEvent;
+
+typedef struct MockCallback
+{
+	libusb_hotplug_callback_fn function;
+	void*                      user_data;
+} MockCallback;
+
+struct libusb_context
+{
+	epicsEventId              ready;
+	std::deque<MockEvent>     events;
+	std::vector<MockCallback> callbacks;
+};
+
+
+/* One lock covers every device and the context */
+static epicsMutexId mock_lock = epicsMutexCreate();
+
+static libusb_context* mock_ctx = NULL;
+static std::vector<libusb_device*> devices;
+static uint8_t next_address = 1;
+
+
+/* Both need mock_lock held */
+static void queue_transfer(struct libusb_transfer* xfr, enum libusb_transfer_status status, int length)
+{
+	xfr->status = status;
+	xfr->actual_length = length;
+	
+	if (mock_ctx == NULL)    { return; }
+	
+	MockEvent event = { xfr, NULL, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED };
+	
+	mock_ctx->events.push_back(event);
+	epicsEventSignal(mock_ctx->ready);
+}
+
+static void queue_hotplug(libusb_device* dev, libusb_hotplug_event hotplug)
+{
+	if (mock_ctx == NULL)    { return; }
+	
+	MockEvent event = { NULL, dev, hotplug };
+	
+	mock_ctx->events.push_back(event);
+	epicsEventSignal(mock_ctx->ready);
+}
+
+
+/* Needs mock_lock held */
+static void set_present(libusb_device* dev, bool present)
+{
+	if (dev->present == present)    { return; }
+	
+	dev->present = present;
+	
+	if (present)
+	{
+		dev->address = next_address;
+		next_address = (next_address == 127) ? 1 : next_address + 1;
+	}
+	
+	if (not present)
+	{
+		while (not dev->pending.empty())
+		{
+			queue_transfer(dev->pending.front().xfr, LIBUSB_TRANSFER_NO_DEVICE, 0);
+			dev->pending.pop_front();
+		}
+		
+		epicsTimeGetCurrent(&dev->unplugged);
+	}
+	
+	queue_hotplug(dev, present ? LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED : LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT);
+}
+
+
+static void next_report(libusb_device* dev)
+{
+	if (not dev->capture.empty())
+	{
+		std::vector<uint8_t>& line = dev->capture[dev->position % dev->capture.size()];
+		
+		memset(dev->report, 0, sizeof(dev->report));
+		memcpy(dev->report, &line[0], std::min((unsigned) line.size(), dev->packet_size));
+		
+		dev->position += 1;
+	}
+	
+	/* Counts up through the whole report, every byte changes eventually */
+	else if (dev->generator == "counter")
+	{
+		for (unsigned index = 0; index < dev->packet_size; index += 1)
+		{
+			dev->report[index] += 1;
+			
+			if (dev->report[index] != 0)    { break; }
+		}
+	}
+	
+	/* Flips a few bits at a time, like a joystick being moved around */
+	else
+	{
+		unsigned flips = 1 + rand() % 3;
+		
+		for (unsigned flip = 0; flip < flips; flip += 1)
+		{
+			dev->report[rand() % dev->packet_size] ^= (uint8_t) (1 << (rand() % 8));
+		}
+	}
+}
+
+
+/* Needs mock_lock held, returns NULL if the host isn't asking on the endpoint */
+static struct libusb_transfer* take_pending(libusb_device* dev, uint8_t endpoint)
+{
+	for (std::deque<PendingTransfer>::iterator it = dev->pending.begin(); it != dev->pending.end(); ++it)
+	{
+		if (it->xfr->endpoint != endpoint)    { continue; }
+		
+		struct libusb_transfer* output = it->xfr;
+		dev->pending.erase(it);
+		
+		return output;
+	}
+	
+	return NULL;
+}
+
+
+/*
+ * Each packet of an isochronous transfer is a report of its own, with its
+ * own length and status, all of them sent in the same frame.
+ */
+static void fill_iso_transfer(libusb_device* dev, struct libusb_transfer* xfr)
+{
+	int total = 0;
+	unsigned offset = 0;
+	
+	for (int index = 0; index < xfr->num_iso_packets; index += 1)
+	{
+		struct libusb_iso_packet_descriptor* packet = &xfr->iso_packet_desc[index];
+		
+		unsigned length = std::min(packet->length, dev->packet_size);
+		
+		if (index > 0)    { next_report(dev); }
+		
+		memcpy(xfr->buffer + offset, dev->report, length);
+		
+		packet->actual_length = length;
+		packet->status = LIBUSB_TRANSFER_COMPLETED;
+		
+		offset += packet->length;
+		total += length;
+	}
+	
+	queue_transfer(xfr, LIBUSB_TRANSFER_COMPLETED, total);
+}
+
+
+/* Needs mock_lock held */
+static void complete_input(libusb_device* dev, struct libusb_transfer* xfr)
+{
+	dev->sent += 1;
+	
+	if (dev->timeout_every and dev->sent % dev->timeout_every == 0)
+	{
+		queue_transfer(xfr, LIBUSB_TRANSFER_TIMED_OUT, 0);
+	}
+	else if (dev->overflow_every and dev->sent % dev->overflow_every == 0)
+	{
+		queue_transfer(xfr, LIBUSB_TRANSFER_OVERFLOW, 0);
+	}
+	else if (xfr->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
+	{
+		fill_iso_transfer(dev, xfr);
+	}
+	else
+	{
+		int length = std::min(xfr->length, (int) dev->packet_size);
+		
+		memcpy(xfr->buffer, dev->report, length);
+		queue_transfer(xfr, LIBUSB_TRANSFER_COMPLETED, length);
+	}
+	
+	if (dev->nodevice_every and dev->sent % dev->nodevice_every == 0)
+	{
+		dev->faulted = true;
+		set_present(dev, false);
+	}
+}
+
+
+/* Needs mock_lock held */
+static void send_report(libusb_device* dev)
+{
+	next_report(dev);
+	
+	/* Like a real device, nothing is sent unless the host is asking */
+	for (unsigned index = 0; index < dev->endpoints.size() and dev->present; index += 1)
+	{
+		if (not (dev->endpoints[index].address & LIBUSB_ENDPOINT_IN))    { continue; }
+		
+		struct libusb_transfer* xfr = take_pending(dev, dev->endpoints[index].address);
+		
+		if (xfr != NULL)    { complete_input(dev, xfr); }
+	}
+}
+
+
+/* Needs mock_lock held */
+static void expire_transfers(libusb_device* dev, const epicsTimeStamp& now)
+{
+	std::deque<PendingTransfer>::iterator it = dev->pending.begin();
+	
+	while (it != dev->pending.end())
+	{
+		if (it->expires and epicsTimeDiffInSeconds(&now, &it->deadline) >= 0.0)
+		{
+			queue_transfer(it->xfr, LIBUSB_TRANSFER_TIMED_OUT, 0);
+			it = dev->pending.erase(it);
+		}
+		else
+		{
+			++it;
+		}
+	}
+}
+
+
+/*
+ * Each device gets a thread that sends its reports on fixed deadlines, so
+ * the rate holds steady no matter how long the driver takes with them.
+ */
+static void device_thread(void* arg)
+{
+	libusb_device* dev = (libusb_device*) arg;
+	
+	epicsTimeStamp deadline;
+	epicsTimeStamp now;
+	
+	epicsTimeGetCurrent(&deadline);
+	
+	while (true)
+	{
+		epicsMutexLock(mock_lock);
+			double period = (dev->rate > 0.0) ? 1.0 / dev->rate : IDLE_TICK;
+			
+			/* Without a rate, a binary capture goes out as it was recorded */
+			bool recorded = (dev->rate == 0.0 and not dev->capture_gaps.empty());
+			
+			epicsTimeGetCurrent(&now);
+			
+			if (dev->present)
+			{
+				expire_transfers(dev, now);
+				
+				if (dev->rate > 0.0 or recorded)    { send_report(dev); }
+				
+				if (recorded)    { period = dev->capture_gaps[(dev->position - 1) % dev->capture_gaps.size()]; }
+			}
+			else if (dev->faulted and epicsTimeDiffInSeconds(&now, &dev->unplugged) >= REPLUG_DELAY)
+			{
+				dev->faulted = false;
+				set_present(dev, true);
+			}
+		epicsMutexUnlock(mock_lock);
+		
+		epicsTimeAddSeconds(&deadline, period);
+		epicsTimeGetCurrent(&now);
+		
+		double early = epicsTimeDiffInSeconds(&deadline, &now);
+		
+		if (early > 0.0)              { epicsThreadSleep(early); }
+		else if (-early > period)     { deadline = now; }
+	}
+}
+
+
+/*
+ * Only the input reports are used. If the device has the same name as one
+ * of the captured ports just that port's reports are replayed, otherwise
+ * every port's.
+ */
+static void load_binary_capture(const char* filename, libusb_device* dev)
+{
+	CaptureReader reader;
+	CaptureRecord record;
+	
+	if (not reader.open(filename))    { return; }
+	
+	std::vector<CaptureRecord> inputs;
+	std::vector<std::vector<uint8_t> > reports;
+	
+	bool named = false;
+	
+	while (reader.next(&record))
+	{
+		if (record.kind != CAPTURE_INPUT or record.length == 0)    { continue; }
+		
+		inputs.push_back(record);
+		reports.push_back(std::vector<uint8_t>(record.data, record.data + record.length));
+		
+		if (reader.portName(record.port) == dev->name)    { named = true; }
+	}
+	
+	uint64_t last_time = 0;
+	
+	for (unsigned index = 0; index < inputs.size(); index += 1)
+	{
+		if (named and reader.portName(inputs[index].port) != dev->name)    { continue; }
+		
+		if (not dev->capture.empty())    { dev->capture_gaps.push_back((inputs[index].time - last_time) * 1e-6); }
+		
+		dev->capture.push_back(reports[index]);
+		last_time = inputs[index].time;
+	}
+	
+	/* Before starting over, wait as long as the last gap */
+	if (not dev->capture_gaps.empty())    { dev->capture_gaps.push_back(dev->capture_gaps.back()); }
+}
+
+
+static void load_capture(const char* filename, libusb_device* dev)
+{
+	std::ifstream input(filename);
+	std::string line;
+	
+	char magic[8] = {0};
+	
+	if (input.read(magic, sizeof(magic)) and memcmp(magic, "USBCAP01", sizeof(magic)) == 0)
+	{
+		load_binary_capture(filename, dev);
+		return;
+	}
+	
+	input.clear();
+	input.seekg(0);
+	
+	if (not input.is_open())
+	{
+		printf("Error: couldn't open file (%s).\n", filename);
+		return;
+	}
+	
+	/* Accepts "01 02 03" as well as usbShowIO's "PORT: 01 02 03" */
+	while (getline(input, line))
+	{
+		size_t colon = line.find(':');
+		
+		if (colon != std::string::npos)    { line = line.substr(colon + 1); }
+		
+		std::stringstream bytes(line);
+		std::vector<uint8_t> report;
+		
+		unsigned value;
+		
+		while (bytes >> std::hex >> value)    { report.push_back((uint8_t) value); }
+		
+		if (not report.empty())    { dev->capture.push_back(report); }
+	}
+}
+
+
+static libusb_device* find_mock(const char* name)
+{
+	for (unsigned index = 0; index < devices.size(); index += 1)
+	{
+		if (devices[index]->name == name)    { return devices[index]; }
+	}
+	
+	return NULL;
+}
+
+
+/*
+ * libusb API
+ */
+
+int libusb_init(libusb_context** ctx)
+{
+	epicsMutexLock(mock_lock);
+		if (mock_ctx == NULL)
+		{
+			mock_ctx = new libusb_context;
+			mock_ctx->ready = epicsEventCreate(epicsEventEmpty);
+		}
+		
+		if (ctx != NULL)    { *ctx = mock_ctx; }
+	epicsMutexUnlock(mock_lock);
+	
+	return LIBUSB_SUCCESS;
+}
+
+void libusb_exit(libusb_context* ctx) {}
+
+int libusb_has_capability(uint32_t capability)
+{
+	return (capability == LIBUSB_CAP_HAS_CAPABILITY or capability == LIBUSB_CAP_HAS_HOTPLUG);
+}
+
+int libusb_hotplug_register_callback( libusb_context* ctx,
+                                      mock_events events,
+                                      mock_flags flags,
+                                      int vendor_id,
+                                      int product_id,
+                                      int dev_class,
+                                      libusb_hotplug_callback_fn cb_fn,
+                                      void* user_data,
+                                      libusb_hotplug_callback_handle* callback_handle)
+{
+	MockCallback callback = { cb_fn, user_data };
+	
+	epicsMutexLock(mock_lock);
+		mock_ctx->callbacks.push_back(callback);
+		
+		if (callback_handle != NULL)    { *callback_handle = mock_ctx->callbacks.size(); }
+	epicsMutexUnlock(mock_lock);
+	
+	return LIBUSB_SUCCESS;
+}
+
+
+int libusb_handle_events_timeout_completed(libusb_context* ctx, struct timeval* tv, int* completed)
+{
+	double timeout = (tv == NULL) ? 60.0 : tv->tv_sec + tv->tv_usec * 1e-6;
+	
+	libusb_init(NULL);
+	
+	epicsEventWaitWithTimeout(mock_ctx->ready, timeout);
+	
+	while (true)
+	{
+		epicsMutexLock(mock_lock);
+			if (mock_ctx->events.empty())
+			{
+				epicsMutexUnlock(mock_lock);
+				break;
+			}
+			
+			MockEvent event = mock_ctx->events.front();
+			mock_ctx->events.pop_front();
+			
+			std::vector<MockCallback> callbacks = mock_ctx->callbacks;
+		epicsMutexUnlock(mock_lock);
+		
+		/* Callbacks are free to submit, cancel, or free transfers */
+		if (event.xfr != NULL)
+		{
+			bool free_transfer = (event.xfr->flags & LIBUSB_TRANSFER_FREE_TRANSFER);
+			
+			event.xfr->callback(event.xfr);
+			
+			if (free_transfer)    { libusb_free_transfer(event.xfr); }
+		}
+		else
+		{
+			for (unsigned index = 0; index < callbacks.size(); index += 1)
+			{
+				callbacks[index].function(mock_ctx, event.dev, event.hotplug, callbacks[index].user_data);
+			}
+		}
+	}
+	
+	return LIBUSB_SUCCESS;
+}
+
+
+ssize_t libusb_get_device_list(libusb_context* ctx, libusb_device*** list)
+{
+	epicsMutexLock(mock_lock);
+		libusb_device** output = (libusb_device**) calloc(devices.size() + 1, sizeof(libusb_device*));
+		ssize_t count = 0;
+		
+		for (unsigned index = 0; index < devices.size(); index += 1)
+		{
+			if (devices[index]->present)    { output[count++] = devices[index]; }
+		}
+	epicsMutexUnlock(mock_lock);
+	
+	*list = output;
+	return count;
+}
+
+void libusb_free_device_list(libusb_device** list, int unref_devices)    { free(list); }
+
+/* Devices are never deleted, so there's nothing to count */
+libusb_device* libusb_ref_device(libusb_device* dev)    { return dev; }
+void libusb_unref_device(libusb_device* dev)            {}
+
+
+/* Everything sits on a single bus, plugged straight into the root hub */
+uint8_t libusb_get_bus_number(libusb_device* dev)    { return 1; }
+uint8_t libusb_get_device_address(libusb_device* dev)
+{
+	epicsMutexLock(mock_lock);
+		uint8_t output = dev->address;
+	epicsMutexUnlock(mock_lock);
+	
+	return output;
+}
+
+int libusb_get_port_numbers(libusb_device* dev, uint8_t* port_numbers, int port_numbers_len)
+{
+	if (port_numbers_len < 1)    { return LIBUSB_ERROR_OVERFLOW; }
+	
+	port_numbers[0] = dev->port;
+	return 1;
+}
+
+
+int libusb_get_device_descriptor(libusb_device* dev, struct libusb_device_descriptor* desc)
+{
+	memset(desc, 0, sizeof(struct libusb_device_descriptor));
+	
+	desc->bLength            = sizeof(struct libusb_device_descriptor);
+	desc->bDescriptorType    = LIBUSB_DT_DEVICE;
+	desc->bcdUSB             = 0x0200;
+	desc->bMaxPacketSize0    = 64;
+	desc->idVendor           = dev->vendor;
+	desc->idProduct          = dev->product;
+	desc->iSerialNumber      = dev->serial.empty() ? 0 : 3;
+	desc->bNumConfigurations = 1;
+	
+	return LIBUSB_SUCCESS;
+}
+
+
+/* Everything a config descriptor points at, freed along with it */
+typedef struct MockConfig
+{
+	struct libusb_config_descriptor    config;
+	struct libusb_interface            interfaces[MAX_MOCK_INTERFACES];
+	struct libusb_interface_descriptor altsettings[MAX_MOCK_INTERFACES];
+	struct libusb_endpoint_descriptor  endpoints[MAX_MOCK_INTERFACES][3];
+} MockConfig;
+
+int libusb_get_active_config_descriptor(libusb_device* dev, struct libusb_config_descriptor** config)
+{
+	MockConfig* output = (MockConfig*) calloc(1, sizeof(MockConfig));
+	
+	/* The polling interval is as close as the frame timing allows to the rate */
+	double interval = (dev->rate > 0.0) ? 1000.0 / dev->rate : 10.0;
+	
+	if (dev->rate == 0.0 and not dev->capture_gaps.empty())
+	{
+		interval = 1000.0 * *std::min_element(dev->capture_gaps.begin(), dev->capture_gaps.end());
+	}
+	
+	uint8_t frames = (uint8_t) std::max(1.0, std::min(255.0, interval));
+	
+	/* High speed intervals are 2^(bInterval - 1) microframes instead */
+	if (dev->packet_size > 64)
+	{
+		frames = 1;
+		
+		while (frames < 16 and (1 << frames) <= interval * 8)    { frames += 1; }
+	}
+	
+	int num_interfaces = 1;
+	
+	for (int index = 0; index < MAX_MOCK_INTERFACES; index += 1)
+	{
+		output->altsettings[index].bInterfaceNumber = index;
+		output->altsettings[index].bInterfaceClass  = 3;
+		output->altsettings[index].endpoint         = output->endpoints[index];
+		
+		output->interfaces[index].altsetting     = &output->altsettings[index];
+		output->interfaces[index].num_altsetting = 1;
+	}
+	
+	for (unsigned index = 0; index < dev->endpoints.size(); index += 1)
+	{
+		const MockEndpoint& endpoint = dev->endpoints[index];
+		
+		struct libusb_interface_descriptor& altsetting = output->altsettings[endpoint.interface];
+		struct libusb_endpoint_descriptor& descriptor = output->endpoints[endpoint.interface][altsetting.bNumEndpoints];
+		
+		descriptor.bLength          = 7;
+		descriptor.bDescriptorType  = 5;
+		descriptor.bEndpointAddress = endpoint.address;
+		descriptor.bmAttributes     = endpoint.type;
+		descriptor.wMaxPacketSize   = dev->packet_size;
+		
+		/* Isochronous endpoints are serviced every frame */
+		descriptor.bInterval = (endpoint.type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) ? 1 : frames;
+		
+		altsetting.bNumEndpoints += 1;
+		
+		num_interfaces = std::max(num_interfaces, endpoint.interface + 1);
+	}
+	
+	output->config.bLength             = 9;
+	output->config.bDescriptorType     = LIBUSB_DT_CONFIG;
+	output->config.bNumInterfaces      = num_interfaces;
+	output->config.bConfigurationValue = 1;
+	output->config.interface           = output->interfaces;
+	
+	*config = &output->config;
+	return LIBUSB_SUCCESS;
+}
+
+void libusb_free_config_descriptor(struct libusb_config_descriptor* config)    { free(config); }
+
+/* Full speed endpoints top out at 64 byte packets */
+int libusb_get_device_speed(libusb_device* dev)    { return (dev->packet_size > 64) ? LIBUSB_SPEED_HIGH : LIBUSB_SPEED_FULL; }
+
+
+int libusb_open(libusb_device* dev, libusb_device_handle** handle)
+{
+	epicsMutexLock(mock_lock);
+		bool present = dev->present;
+	epicsMutexUnlock(mock_lock);
+	
+	if (not present)    { return LIBUSB_ERROR_NO_DEVICE; }
+	
+	*handle = new libusb_device_handle;
+	(*handle)->dev = dev;
+	
+	return LIBUSB_SUCCESS;
+}
+
+void libusb_close(libusb_device_handle* handle)                { delete handle; }
+libusb_device* libusb_get_device(libusb_device_handle* handle) { return handle->dev; }
+
+int libusb_claim_interface(libusb_device_handle* handle, int num)          { return LIBUSB_SUCCESS; }
+int libusb_release_interface(libusb_device_handle* handle, int num)        { return LIBUSB_SUCCESS; }
+int libusb_detach_kernel_driver(libusb_device_handle* handle, int num)     { return LIBUSB_SUCCESS; }
+int libusb_attach_kernel_driver(libusb_device_handle* handle, int num)     { return LIBUSB_SUCCESS; }
+int libusb_kernel_driver_active(libusb_device_handle* handle, int num)     { return 0; }
+
+/* Simulated devices don't have a report descriptor, auto drivers use the layout cache */
+int libusb_control_transfer( libusb_device_handle* handle,
+                             uint8_t request_type,
+                             uint8_t request,
+                             uint16_t value,
+                             uint16_t index,
+                             unsigned char* data,
+                             uint16_t length,
+                             unsigned int timeout)
+{
+	return LIBUSB_ERROR_PIPE;
+}
+
+int libusb_get_string_descriptor_ascii(libusb_device_handle* handle, uint8_t index, unsigned char* data, int length)
+{
+	if (length <= 0)    { return LIBUSB_ERROR_INVALID_PARAM; }
+	
+	int amt = std::min((int) handle->dev->serial.size(), length - 1);
+	
+	memcpy(data, handle->dev->serial.c_str(), amt);
+	data[amt] = '\0';
+	
+	return amt;
+}
+
+
+struct libusb_transfer* libusb_alloc_transfer(int iso_packets)
+{
+	size_t size = sizeof(struct libusb_transfer) + iso_packets * sizeof(struct libusb_iso_packet_descriptor);
+	
+	struct libusb_transfer* output = (struct libusb_transfer*) calloc(1, size);
+	
+	output->num_iso_packets = iso_packets;
+	return output;
+}
+
+void libusb_free_transfer(struct libusb_transfer* xfr)
+{
+	if (xfr == NULL)    { return; }
+	
+	if (xfr->flags & LIBUSB_TRANSFER_FREE_BUFFER)    { free(xfr->buffer); }
+	
+	free(xfr);
+}
+
+
+int libusb_submit_transfer(struct libusb_transfer* xfr)
+{
+	libusb_device* dev = xfr->dev_handle->dev;
+	
+	epicsMutexLock(mock_lock);
+		if (not dev->present)
+		{
+			epicsMutexUnlock(mock_lock);
+			return LIBUSB_ERROR_NO_DEVICE;
+		}
+		
+		/* Output reports are accepted as soon as they're sent */
+		if (not (xfr->endpoint & LIBUSB_ENDPOINT_IN))
+		{
+			queue_transfer(xfr, LIBUSB_TRANSFER_COMPLETED, xfr->length);
+		}
+		else
+		{
+			PendingTransfer pending;
+			
+			pending.xfr = xfr;
+			pending.expires = (xfr->timeout != 0);
+			
+			epicsTimeGetCurrent(&pending.deadline);
+			epicsTimeAddSeconds(&pending.deadline, xfr->timeout / 1000.0);
+			
+			dev->pending.push_back(pending);
+		}
+	epicsMutexUnlock(mock_lock);
+	
+	return LIBUSB_SUCCESS;
+}
+
+
+int libusb_cancel_transfer(struct libusb_transfer* xfr)
+{
+	libusb_device* dev = xfr->dev_handle->dev;
+	
+	epicsMutexLock(mock_lock);
+		for (std::deque<PendingTransfer>::iterator it = dev->pending.begin(); it != dev->pending.end(); ++it)
+		{
+			if (it->xfr == xfr)
+			{
+				dev->pending.erase(it);
+				queue_transfer(xfr, LIBUSB_TRANSFER_CANCELLED, 0);
+				
+				epicsMutexUnlock(mock_lock);
+				return LIBUSB_SUCCESS;
+			}
+		}
+	epicsMutexUnlock(mock_lock);
+	
+	return LIBUSB_ERROR_NOT_FOUND;
+}
+
+
+int libusb_get_max_iso_packet_size(libusb_device* dev, unsigned char endpoint)
+{
+	return dev->packet_size;
+}
+
+
+/* 
+ * Only output is ever done synchronously, and is accepted straight away, so
+ * the transfer type only has to match the endpoint's.
+ */
+static int sync_output( libusb_device_handle* handle,
+                        unsigned char endpoint,
+                        uint8_t type,
+                        int length,
+                        int* transferred)
+{
+	if (endpoint & LIBUSB_ENDPOINT_IN)    { return LIBUSB_ERROR_NOT_SUPPORTED; }
+	
+	libusb_device* dev = handle->dev;
+	
+	epicsMutexLock(mock_lock);
+		bool present = dev->present;
+		bool found = false;
+		
+		for (unsigned index = 0; index < dev->endpoints.size(); index += 1)
+		{
+			if (dev->endpoints[index].address == endpoint and dev->endpoints[index].type == type)    { found = true; }
+		}
+	epicsMutexUnlock(mock_lock);
+	
+	if (not present)    { return LIBUSB_ERROR_NO_DEVICE; }
+	if (not found)      { return LIBUSB_ERROR_PIPE; }
+	
+	if (transferred != NULL)    { *transferred = length; }
+	
+	return LIBUSB_SUCCESS;
+}
+
+
+int libusb_bulk_transfer( libusb_device_handle* handle,
+                          unsigned char endpoint,
+                          unsigned char* data,
+                          int length,
+                          int* transferred,
+                          unsigned int timeout)
+{
+	return sync_output(handle, endpoint, LIBUSB_TRANSFER_TYPE_BULK, length, transferred);
+}
+
+
+int libusb_interrupt_transfer( libusb_device_handle* handle,
+                               unsigned char endpoint,
+                               unsigned char* data,
+                               int length,
+                               int* transferred,
+                               unsigned int timeout)
+{
+	return sync_output(handle, endpoint, LIBUSB_TRANSFER_TYPE_INTERRUPT, length, transferred);
+}
+
+#endif
+
+
+/*
+ * iocsh commands
+ */
+
+static bool mock_available()
+{
+#ifdef USB_MOCK
+	return true;
+#else
+	printf("Error: built against libusb, set USB_MOCK=YES in CONFIG_SITE to use simulated devices.\n");
+	return false;
+#endif
+}
+
+
+bool checkMockDeviceArgs(const iocshArgBuf* args)
+{
+	if (not mock_available())    { return false; }
+	
+	if (args[0].sval == NULL)
+	{
+		printf("Error: no name given.\n");
+		return false;
+	}
+	else if (args[1].ival < 0 or args[1].ival > 0xFFFF or args[2].ival < 0 or args[2].ival > 0xFFFF)
+	{
+		printf("Error: vendor and product ids must fit in 16 bits.\n");
+		return false;
+	}
+	else if (args[4].ival < 1 or args[4].ival > (int) MAX_PACKET_SIZE)
+	{
+		printf("Error: packet size must be between 1 and %u bytes.\n", MAX_PACKET_SIZE);
+		return false;
+	}
+	else if (args[5].dval < 0.0)
+	{
+		printf("Error: rate cannot be negative.\n");
+		return false;
+	}
+	else if (args[7].ival != 0 and (args[7].ival > 0xFF or not (args[7].ival & LIBUSB_ENDPOINT_IN) or args[7].ival == 0x80))
+	{
+		printf("Error: endpoint must be an input endpoint address, like 0x81.\n");
+		return false;
+	}
+	else if (args[9].ival < 0 or args[9].ival >= MAX_MOCK_INTERFACES)
+	{
+		printf("Error: interface must be between 0 and %d.\n", MAX_MOCK_INTERFACES - 1);
+		return false;
+	}
+	
+	std::string type = (args[8].sval == NULL) ? "" : args[8].sval;
+	
+	if (type != "" and type != "interrupt" and type != "bulk" and type != "iso")
+	{
+		printf("Error: transfer type must be one of interrupt, bulk, or iso.\n");
+		return false;
+	}
+	
+	return true;
+}
+
+bool checkMockFaultArgs(const iocshArgBuf* args)
+{
+	if (not mock_available())    { return false; }
+	
+	if (args[0].sval == NULL or args[1].sval == NULL)
+	{
+		printf("Error: no input given.\n");
+		return false;
+	}
+	
+	std::string fault(args[1].sval);
+	
+	if (fault != "timeout" and fault != "overflow" and fault != "nodevice" and fault != "none")
+	{
+		printf("Error: fault must be one of timeout, overflow, nodevice, or none.\n");
+		return false;
+	}
+	else if (args[2].ival < 0)
+	{
+		printf("Error: input cannot be negative.\n");
+		return false;
+	}
+	
+	return true;
+}
+
+bool checkMockPlugArgs(const iocshArgBuf* args)
+{
+	if (not mock_available())    { return false; }
+	
+	if (args[0].sval == NULL)
+	{
+		printf("Error: no name given.\n");
+		return false;
+	}
+	
+	return true;
+}
+
+
+/*
+ * The device always has an interrupt OUT endpoint and an input endpoint at
+ * 0x81. Giving 0x81 changes its type and interface, with the OUT endpoint
+ * following it. Any other address is an extra input endpoint alongside it.
+ */
+void usbMockDevice( const char* name, int vendor, int product, const char* serial, int packet_size, double rate, const char* source,
+                    int endpoint, const char* transfer_type, int interface_num)
+{
+#ifdef USB_MOCK
+	epicsMutexLock(mock_lock);
+		if (find_mock(name) != NULL)
+		{
+			epicsMutexUnlock(mock_lock);
+			printf("Error: mock device %s already exists.\n", name);
+			return;
+		}
+	epicsMutexUnlock(mock_lock);
+	
+	libusb_device* dev = new libusb_device;
+	
+	dev->name           = name;
+	dev->vendor         = vendor;
+	dev->product        = product;
+	dev->serial         = (serial == NULL) ? "" : serial;
+	dev->packet_size    = packet_size;
+	dev->rate           = rate;
+	dev->generator      = "random";
+	dev->position       = 0;
+	dev->sent           = 0;
+	dev->timeout_every  = 0;
+	dev->overflow_every = 0;
+	dev->nodevice_every = 0;
+	dev->present        = false;
+	dev->faulted        = false;
+	dev->address        = 0;
+	
+	memset(dev->report, 0, sizeof(dev->report));
+	
+	std::string kind = (transfer_type == NULL) ? "" : transfer_type;
+	
+	uint8_t type = LIBUSB_TRANSFER_TYPE_INTERRUPT;
+	
+	if      (kind == "bulk")    { type = LIBUSB_TRANSFER_TYPE_BULK; }
+	else if (kind == "iso")     { type = LIBUSB_TRANSFER_TYPE_ISOCHRONOUS; }
+	
+	MockEndpoint input  = { ENDPOINT_IN, LIBUSB_TRANSFER_TYPE_INTERRUPT, 0 };
+	MockEndpoint output = { ENDPOINT_OUT, LIBUSB_TRANSFER_TYPE_INTERRUPT, 0 };
+	
+	if (endpoint == 0 or endpoint == ENDPOINT_IN)
+	{
+		input.type = type;
+		input.interface = interface_num;
+		output.interface = interface_num;
+	}
+	
+	dev->endpoints.push_back(input);
+	dev->endpoints.push_back(output);
+	
+	if (endpoint != 0 and endpoint != ENDPOINT_IN)
+	{
+		MockEndpoint extra = { (uint8_t) endpoint, type, interface_num };
+		
+		dev->endpoints.push_back(extra);
+	}
+	
+	if (source != NULL and std::string(source) == "counter")    { dev->generator = "counter"; }
+	else if (source != NULL and std::string(source) != "random" and source[0] != '\0')
+	{
+		load_capture(source, dev);
+	}
+	
+	std::string threadname = std::string("usbMock(") + name + ")";
+	
+	epicsMutexLock(mock_lock);
+		dev->port = devices.size() + 1;
+		
+		devices.push_back(dev);
+		set_present(dev, true);
+	epicsMutexUnlock(mock_lock);
+	
+	epicsThreadCreate(threadname.c_str(),
+	                  epicsThreadPriorityHigh,
+	                  epicsThreadGetStackSize(epicsThreadStackSmall),
+	                  (EPICSTHREADFUNC)::device_thread, dev);
+#endif
+}
+
+void usbMockFault(const char* name, const char* fault, int every)
+{
+#ifdef USB_MOCK
+	epicsMutexLock(mock_lock);
+		libusb_device* dev = find_mock(name);
+		
+		if (dev == NULL)
+		{
+			epicsMutexUnlock(mock_lock);
+			printf("Error: couldn't find mock device %s.\n", name);
+			return;
+		}
+		
+		std::string kind(fault);
+		
+		if      (kind == "timeout")     { dev->timeout_every  = every; }
+		else if (kind == "overflow")    { dev->overflow_every = every; }
+		else if (kind == "nodevice")    { dev->nodevice_every = every; }
+		else
+		{
+			dev->timeout_every  = 0;
+			dev->overflow_every = 0;
+			dev->nodevice_every = 0;
+		}
+	epicsMutexUnlock(mock_lock);
+#endif
+}
+
+void usbMockPlug(const char* name, int tf)
+{
+#ifdef USB_MOCK
+	epicsMutexLock(mock_lock);
+		libusb_device* dev = find_mock(name);
+		
+		if (dev == NULL)
+		{
+			epicsMutexUnlock(mock_lock);
+			printf("Error: couldn't find mock device %s.\n", name);
+			return;
+		}
+		
+		dev->faulted = false;
+		set_present(dev, tf);
+	epicsMutexUnlock(mock_lock);
+#endif
+}
+
+
+extern "C"
+{
+	static const iocshArg mdev_arg0   = {"name",           iocshArgString};
+	static const iocshArg mdev_arg1   = {"vendorID",       iocshArgInt};
+	static const iocshArg mdev_arg2   = {"productID",      iocshArgInt};
+	static const iocshArg mdev_arg3   = {"serialNumber",   iocshArgString};
+	static const iocshArg mdev_arg4   = {"packetSize",     iocshArgInt};
+	static const iocshArg mdev_arg5   = {"rate",           iocshArgDouble};
+	static const iocshArg mdev_arg6   = {"source",         iocshArgString};
+	static const iocshArg mdev_arg7   = {"endpoint",       iocshArgInt};
+	static const iocshArg mdev_arg8   = {"transferType",   iocshArgString};
+	static const iocshArg mdev_arg9   = {"interface",      iocshArgInt};
+	
+	static const iocshArg mflt_arg0   = {"name",           iocshArgString};
+	static const iocshArg mflt_arg1   = {"fault",          iocshArgString};
+	static const iocshArg mflt_arg2   = {"every",          iocshArgInt};
+	
+	static const iocshArg mplg_arg0   = {"name",           iocshArgString};
+	static const iocshArg mplg_arg1   = {"plugged_in",     iocshArgInt};
+	
+	
+	static const iocshArg* mdev_args[]   = {&mdev_arg0, &mdev_arg1, &mdev_arg2, &mdev_arg3, &mdev_arg4, &mdev_arg5, &mdev_arg6, 
+	                                        &mdev_arg7, &mdev_arg8, &mdev_arg9};
+	static const iocshArg* mflt_args[]   = {&mflt_arg0, &mflt_arg1, &mflt_arg2};
+	static const iocshArg* mplg_args[]   = {&mplg_arg0, &mplg_arg1};
+	
+	
+	static const iocshFuncDef mdev_func   = {"usbMockDevice", 10, mdev_args};
+	static const iocshFuncDef mflt_func   = {"usbMockFault", 3, mflt_args};
+	static const iocshFuncDef mplg_func   = {"usbMockPlug", 2, mplg_args};
+	
+	
+	static void call_mdev_func(const iocshArgBuf* args)
+	{
+		if (checkMockDeviceArgs(args))
+		{
+			usbMockDevice( args[0].sval, args[1].ival, args[2].ival, args[3].sval,
+			               args[4].ival, args[5].dval, args[6].sval,
+			               args[7].ival, args[8].sval, args[9].ival);
+		}
+	}
+	
+	static void call_mflt_func(const iocshArgBuf* args)
+	{
+		if (checkMockFaultArgs(args))
+		{
+			usbMockFault(args[0].sval, args[1].sval, args[2].ival);
+		}
+	}
+	
+	static void call_mplg_func(const iocshArgBuf* args)
+	{
+		if (checkMockPlugArgs(args))
+		{
+			usbMockPlug(args[0].sval, args[1].ival);
+		}
+	}
+	
+	
+	static void usbMockDeviceRegistrar(void)    { iocshRegister(&mdev_func, call_mdev_func); }
+	static void usbMockFaultRegistrar(void)     { iocshRegister(&mflt_func, call_mflt_func); }
+	static void usbMockPlugRegistrar(void)      { iocshRegister(&mplg_func, call_mplg_func); }
+	
+	
+	epicsExportRegistrar(usbMockDeviceRegistrar);
+	epicsExportRegistrar(usbMockFaultRegistrar);
+	epicsExportRegistrar(usbMockPlugRegistrar);
+}
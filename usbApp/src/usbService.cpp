@@ -0,0 +1,655 @@
+#include <sstream>
+#include <fstream>
+#include <algorithm>
+
+#include <epicsThread.h>
+
+#include "usbService.h"
+#include "hidDriver.h"
+#include "ReportDescriptor.h"
+
+/* 
+ * How long an event thread blocks waiting for USB activity before looking 
+ * around again.
+ */
+static const int EVENT_TIMEOUT_USEC = 100000;
+
+/*
+ * Even with hotplug support, we'll occasionally look over the bus for any 
+ * waiting drivers in case a device was missed while it was being claimed 
+ * by someone else.
+ */
+static const double HOTPLUG_RESCAN = 60.0; //seconds
+
+/* Class descriptors found in a HID interface's extra bytes */
+static const uint8_t  HID_DESCRIPTOR    = 0x21;
+static const uint8_t  REPORT_DESCRIPTOR = 0x22;
+
+/* 
+ * 126 is the maximum amount of characters we'll have to deal with according 
+ * to the USB spec which mandates maximum sizes for the device_descriptor struct
+ * and character encodings.
+ */
+static const int MAX_SERIAL = 126;
+
+/* USB 3.0 allows hubs to be chained seven deep */
+static const int MAX_PORT_DEPTH = 7;
+
+/* Used if the HID descriptor doesn't say how long the report descriptor is */
+static const unsigned MAX_DESCRIPTOR     = 4096;
+static const unsigned DESCRIPTOR_TIMEOUT = 1000; //ms
+
+static epicsMutexId service_lock = epicsMutexCreate();
+static usbService*  service = NULL;
+
+
+static void event_thread_callback(void* arg)  { ((usbService*) arg)->event_thread(); }
+static void connect_thread_callback(void* arg){ ((usbService*) arg)->connect_thread(); }
+
+static int hotplug_callback(libusb_context* ctx, libusb_device* dev, libusb_hotplug_event event, void* arg)
+{
+	((usbService*) arg)->hotplug(dev, event);
+	
+	/* Returning anything else would deregister the callback */
+	return 0;
+}
+
+
+usbService* usbService::instance()
+{
+	epicsMutexLock(service_lock);
+		if (service == NULL)
+		{
+			service = new usbService();
+			service->setThreads(1);
+			
+			epicsThreadCreate("usbConnect", 
+			                  epicsThreadPriorityLow, 
+			                  epicsThreadGetStackSize(epicsThreadStackMedium), 
+			                  (EPICSTHREADFUNC)::connect_thread_callback, service);
+		}
+	epicsMutexUnlock(service_lock);
+	
+	return service;
+}
+
+
+usbService::usbService()
+:	ctx(NULL),
+	threads(0),
+	has_hotplug(false)
+{
+	this->lock     = epicsMutexCreate();
+	this->offering = epicsMutexCreate();
+	this->changed  = epicsEventCreate(epicsEventEmpty);
+	
+	libusb_init(&ctx);
+	
+	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+	{
+		libusb_hotplug_callback_handle handle;
+		
+		int status = libusb_hotplug_register_callback( this->ctx,
+		                                               (libusb_hotplug_event) (LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | 
+		                                                                       LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT),
+		                                               LIBUSB_HOTPLUG_NO_FLAGS,
+		                                               LIBUSB_HOTPLUG_MATCH_ANY,
+		                                               LIBUSB_HOTPLUG_MATCH_ANY,
+		                                               LIBUSB_HOTPLUG_MATCH_ANY,
+		                                               hotplug_callback,
+		                                               this,
+		                                               &handle);
+		
+		this->has_hotplug = (status == LIBUSB_SUCCESS);
+	}
+	
+	if (not this->has_hotplug)
+	{
+		printf("usbService: hotplug unavailable, falling back to polling the bus for devices\n");
+	}
+}
+
+
+libusb_context* usbService::context()
+{
+	return this->ctx;
+}
+
+
+/*
+ * The pool only grows, threads already waiting on events are left alone
+ * if a smaller number is requested.
+ */
+void usbService::setThreads(unsigned amt)
+{
+	epicsMutexLock(this->lock);
+		while (this->threads < amt)
+		{
+			std::stringstream temp_stream;
+			std::string threadname;
+			
+			temp_stream << "usbEvents" << this->threads;
+			temp_stream >> threadname;
+			
+			epicsThreadCreate(threadname.c_str(), 
+			                  epicsThreadPriorityMedium, 
+			                  epicsThreadGetStackSize(epicsThreadStackMedium), 
+			                  (EPICSTHREADFUNC)::event_thread_callback, this);
+			
+			this->threads += 1;
+		}
+	epicsMutexUnlock(this->lock);
+}
+
+
+void usbService::event_thread()
+{
+	while (true)
+	{
+		struct timeval timeout = {0, EVENT_TIMEOUT_USEC};
+		
+		libusb_handle_events_timeout_completed(this->ctx, &timeout, NULL);
+	}
+}
+
+
+/*
+ * Queues a driver to be disconnected and matched against the devices on 
+ * the bus. Safe to call from libusb callbacks, the actual work happens on
+ * the connection thread.
+ */
+void usbService::waitFor(hidDriver* driver)
+{
+	epicsMutexLock(this->lock);
+		if (std::find(this->drivers.begin(), this->drivers.end(), driver) == this->drivers.end())
+		{
+			this->drivers.push_back(driver);
+		}
+		
+		if (std::find(this->requests.begin(), this->requests.end(), driver) == this->requests.end())
+		{
+			this->requests.push_back(driver);
+		}
+	epicsMutexUnlock(this->lock);
+	
+	epicsEventSignal(this->changed);
+}
+
+
+/*
+ * The connection thread works from its own copies of the lists, so this
+ * also waits out any pass that's in progress. After it returns the driver
+ * won't be touched again and can be deleted.
+ */
+void usbService::forget(hidDriver* driver)
+{
+	epicsMutexLock(this->offering);
+		epicsMutexLock(this->lock);
+			this->drivers.remove(driver);
+			this->requests.remove(driver);
+			this->waiting.remove(driver);
+		epicsMutexUnlock(this->lock);
+	epicsMutexUnlock(this->offering);
+}
+
+
+/*
+ * Called from the event threads, so this only records what happened. The
+ * devices are referenced so they stay valid until the connection thread 
+ * gets to them.
+ */
+void usbService::hotplug(libusb_device* dev, libusb_hotplug_event event)
+{
+	epicsMutexLock(this->lock);
+		if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+		{
+			this->arrived.push_back(libusb_ref_device(dev));
+		}
+		else if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT)
+		{
+			this->departed.push_back(libusb_ref_device(dev));
+		}
+	epicsMutexUnlock(this->lock);
+	
+	epicsEventSignal(this->changed);
+}
+
+
+/*
+ * Without hotplug, waiting drivers get the bus checked at the shortest 
+ * connection delay any of them asked for.
+ */
+double usbService::scanDelay()
+{
+	if (this->has_hotplug)    { return HOTPLUG_RESCAN; }
+	
+	double output = HOTPLUG_RESCAN;
+	
+	epicsMutexLock(this->lock);
+		std::list<hidDriver*>::iterator it;
+		
+		for (it = this->waiting.begin(); it != this->waiting.end(); it++)
+		{
+			output = std::min(output, (*it)->connectDelay());
+		}
+	epicsMutexUnlock(this->lock);
+	
+	return output;
+}
+
+
+/*
+ * Enumerates the bus a single time and offers every device to each of the
+ * given drivers. Drivers that connect are removed from the list.
+ */
+void usbService::scanBus(std::list<hidDriver*>& to_match)
+{
+	if (to_match.empty())    { return; }
+	
+	libusb_device** connected_devices;
+	ssize_t amt_connected = libusb_get_device_list(this->ctx, &connected_devices);
+	
+	for (ssize_t index = 0; index < amt_connected; index += 1)
+	{
+		std::list<hidDriver*>::iterator it = to_match.begin();
+		
+		while (it != to_match.end())
+		{
+			if ((*it)->tryDevice(connected_devices[index]))    { it = to_match.erase(it); }
+			else                                               { it++; }
+		}
+	}
+	
+	if (amt_connected >= 0)    { libusb_free_device_list(connected_devices, 1); }
+}
+
+
+void usbService::connect_thread()
+{
+	std::list<hidDriver*>::iterator it;
+	
+	while (true)
+	{
+		bool timed_out = (epicsEventWaitWithTimeout(this->changed, this->scanDelay()) != epicsEventWaitOK);
+		
+		/* Drivers are called outside of lock, forget waits for this instead */
+		epicsMutexLock(this->offering);
+		
+		std::list<hidDriver*> new_requests;
+		std::list<hidDriver*> to_match;
+		std::list<libusb_device*> new_arrivals;
+		std::list<libusb_device*> new_departures;
+		
+		epicsMutexLock(this->lock);
+			new_requests.swap(this->requests);
+			new_arrivals.swap(this->arrived);
+			new_departures.swap(this->departed);
+			
+			std::list<hidDriver*> all_drivers = this->drivers;
+		epicsMutexUnlock(this->lock);
+		
+		/* Drivers using a device that left go back to waiting */
+		while (not new_departures.empty())
+		{
+			libusb_device* dev = new_departures.front();
+			
+			for (it = all_drivers.begin(); it != all_drivers.end(); it++)
+			{
+				if ((*it)->usesDevice(dev))
+				{
+					(*it)->printDebug(1, "Device removed, waiting for it to return.\n");
+					new_requests.push_back(*it);
+				}
+			}
+			
+			this->forgetIdentity(dev);
+			
+			libusb_unref_device(dev);
+			new_departures.pop_front();
+		}
+		
+		/* New requests get a single look over the whole bus */
+		for (it = new_requests.begin(); it != new_requests.end(); it++)
+		{
+			(*it)->beginSearch();
+		}
+		
+		to_match = new_requests;
+		this->scanBus(to_match);
+		
+		for (it = to_match.begin(); it != to_match.end(); it++)
+		{
+			(*it)->notFound(true);
+		}
+		
+		epicsMutexLock(this->lock);
+			for (it = to_match.begin(); it != to_match.end(); it++)
+			{
+				if (std::find(this->drivers.begin(), this->drivers.end(), *it) == this->drivers.end())    { continue; }
+				
+				this->waiting.remove(*it);
+				this->waiting.push_back(*it);
+			}
+			
+			to_match = this->waiting;
+		epicsMutexUnlock(this->lock);
+		
+		/* Arrivals only need to be checked against themselves */
+		while (not new_arrivals.empty())
+		{
+			libusb_device* dev = new_arrivals.front();
+			
+			it = to_match.begin();
+			
+			while (it != to_match.end())
+			{
+				if ((*it)->tryDevice(dev))    { it = to_match.erase(it); }
+				else                          { it++; }
+			}
+			
+			libusb_unref_device(dev);
+			new_arrivals.pop_front();
+		}
+		
+		if (timed_out)
+		{
+			this->scanBus(to_match);
+			
+			for (it = to_match.begin(); it != to_match.end(); it++)
+			{
+				(*it)->notFound(false);
+			}
+		}
+		
+		/* Whatever is left is still waiting */
+		epicsMutexLock(this->lock);
+			it = this->waiting.begin();
+			
+			while (it != this->waiting.end())
+			{
+				if (std::find(to_match.begin(), to_match.end(), *it) == to_match.end())    { it = this->waiting.erase(it); }
+				else                                                                       { it++; }
+			}
+		epicsMutexUnlock(this->lock);
+		
+		epicsMutexUnlock(this->offering);
+	}
+}
+
+
+/*
+ * The HID descriptor follows the interface descriptor and lists the class
+ * descriptors the interface has, along with their lengths.
+ */
+static unsigned descriptor_length(libusb_device* dev, int interface_num)
+{
+	struct libusb_config_descriptor* config;
+	unsigned output = MAX_DESCRIPTOR;
+	
+	if (libusb_get_active_config_descriptor(dev, &config) != LIBUSB_SUCCESS)    { return output; }
+	
+	if (interface_num < config->bNumInterfaces)
+	{
+		const struct libusb_interface_descriptor& interface = config->interface[interface_num].altsetting[0];
+		
+		const unsigned char* extra = interface.extra;
+		int position = 0;
+		
+		while (extra != NULL and position + 6 <= interface.extra_length and extra[position] != 0)
+		{
+			const unsigned char* hid = &extra[position];
+			
+			if (hid[1] == HID_DESCRIPTOR)
+			{
+				for (int index = 0; index < hid[5] and 9 + 3 * index <= hid[0]; index += 1)
+				{
+					const unsigned char* entry = &hid[6 + 3 * index];
+					
+					if (entry[0] == REPORT_DESCRIPTOR)    { output = entry[1] | (entry[2] << 8); }
+				}
+			}
+			
+			position += extra[position];
+		}
+	}
+	
+	libusb_free_config_descriptor(config);
+	return output;
+}
+
+
+/*
+ * Reads the report descriptor from the first matching device that can be
+ * claimed. Every device of a model has the same one, so the serial number
+ * doesn't matter.
+ */
+bool usbService::readReportDescriptor(uint16_t vendor_id, uint16_t product_id, int interface_num, std::vector<uint8_t>* output)
+{
+	libusb_device** connected_devices;
+	ssize_t amt_connected = libusb_get_device_list(this->ctx, &connected_devices);
+	
+	bool found = false;
+	
+	for (ssize_t index = 0; index < amt_connected and not found; index += 1)
+	{
+		libusb_device* dev = connected_devices[index];
+		libusb_device_handle* handle;
+		struct libusb_device_descriptor info;
+		
+		libusb_get_device_descriptor(dev, &info);
+		
+		if (info.idVendor != vendor_id or info.idProduct != product_id)    { continue; }
+		
+		unsigned length = descriptor_length(dev, interface_num);
+		
+		if (libusb_open(dev, &handle) != LIBUSB_SUCCESS)    { continue; }
+		
+		/* The kernel's HID driver has to let go of the interface first, same as connecting */
+		bool attached = (libusb_kernel_driver_active(handle, interface_num) == 1);
+		
+		if (attached)    { libusb_detach_kernel_driver(handle, interface_num); }
+		
+		if (libusb_claim_interface(handle, interface_num) == LIBUSB_SUCCESS)
+		{
+			output->resize(length);
+			
+			int status = libusb_control_transfer( handle, 
+			                                      LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_STANDARD | LIBUSB_RECIPIENT_INTERFACE,
+			                                      LIBUSB_REQUEST_GET_DESCRIPTOR,
+			                                      REPORT_DESCRIPTOR << 8,
+			                                      interface_num,
+			                                      &(*output)[0],
+			                                      length,
+			                                      DESCRIPTOR_TIMEOUT);
+			
+			if (status > 0)
+			{
+				output->resize(status);
+				found = true;
+			}
+			
+			libusb_release_interface(handle, interface_num);
+		}
+		
+		if (attached)    { libusb_attach_kernel_driver(handle, interface_num); }
+		
+		libusb_close(handle);
+	}
+	
+	if (amt_connected >= 0)    { libusb_free_device_list(connected_devices, 1); }
+	
+	return found;
+}
+
+
+static bool read_file(std::string filename, std::string* output)
+{
+	std::ifstream file(filename.c_str());
+	
+	if (not file.is_open())    { return false; }
+	
+	std::ostringstream contents;
+	contents << file.rdbuf();
+	
+	*output = contents.str();
+	return true;
+}
+
+
+/*
+ * Gives the input and output specs made from a device's report descriptor.
+ * Each model is only read and parsed once, and if a cache directory is set
+ * the specs are saved there so they can still be found when the device
+ * isn't plugged in.
+ */
+bool usbService::reportLayouts(uint16_t vendor_id, uint16_t product_id, int interface_num, std::string* input, std::string* output)
+{
+	char key[32];
+	snprintf(key, sizeof(key), "%04x_%04x_%d", vendor_id, product_id, interface_num);
+	
+	epicsMutexLock(this->lock);
+		std::map<std::string, std::pair<std::string, std::string> >::iterator found = this->layouts.find(key);
+		
+		bool cached = (found != this->layouts.end());
+		
+		if (cached)
+		{
+			*input = found->second.first;
+			*output = found->second.second;
+		}
+		
+		std::string path = this->layout_dir.empty() ? "" : this->layout_dir + "/" + key;
+	epicsMutexUnlock(this->lock);
+	
+	if (cached)    { return true; }
+	
+	std::vector<uint8_t> descriptor;
+	
+	if (this->readReportDescriptor(vendor_id, product_id, interface_num, &descriptor))
+	{
+		ReportDescriptor parsed(&descriptor[0], descriptor.size());
+		
+		*input = parsed.inputSpec();
+		*output = parsed.outputSpec();
+		
+		if (not path.empty())
+		{
+			std::ofstream input_file((path + ".in").c_str());
+			std::ofstream output_file((path + ".out").c_str());
+			
+			input_file << *input;
+			output_file << *output;
+		}
+	}
+	else if (path.empty() or not read_file(path + ".in", input) or not read_file(path + ".out", output))
+	{
+		return false;
+	}
+	
+	epicsMutexLock(this->lock);
+		this->layouts[key] = std::make_pair(*input, *output);
+	epicsMutexUnlock(this->lock);
+	
+	return true;
+}
+
+
+void usbService::setLayoutCache(std::string directory)
+{
+	epicsMutexLock(this->lock);
+		this->layout_dir = directory;
+	epicsMutexUnlock(this->lock);
+}
+
+
+/*
+ * Names the port a device is plugged into the same way Linux does, the
+ * bus followed by the port on each hub leading to it, like 1-4.2.
+ */
+std::string usbService::portPath(libusb_device* dev)
+{
+	uint8_t ports[MAX_PORT_DEPTH];
+	
+	int depth = libusb_get_port_numbers(dev, ports, MAX_PORT_DEPTH);
+	
+	std::stringstream output;
+	
+	output << (unsigned) libusb_get_bus_number(dev);
+	
+	for (int index = 0; index < depth; index += 1)
+	{
+		output << ((index == 0) ? "-" : ".") << (unsigned) ports[index];
+	}
+	
+	return output.str();
+}
+
+
+/*
+ * Gives a device's serial number, only opening the device the first time
+ * it's asked about. Devices that can't be opened aren't remembered, so 
+ * they're tried again the next time.
+ */
+bool usbService::serialNumber(libusb_device* dev, std::string* output)
+{
+	struct libusb_device_descriptor info;
+	libusb_get_device_descriptor(dev, &info);
+	
+	std::string path = usbService::portPath(dev);
+	uint8_t address = libusb_get_device_address(dev);
+	
+	epicsMutexLock(this->lock);
+		std::map<std::string, DeviceIdentity>::iterator found = this->identities.find(path);
+		
+		bool cached = (found != this->identities.end() and 
+		               found->second.address == address and
+		               found->second.vendor == info.idVendor and 
+		               found->second.product == info.idProduct);
+		
+		if (cached)    { *output = found->second.serial; }
+	epicsMutexUnlock(this->lock);
+	
+	if (cached)    { return true; }
+	
+	DeviceIdentity identity;
+	
+	identity.address = address;
+	identity.vendor = info.idVendor;
+	identity.product = info.idProduct;
+	
+	/* Devices without a serial number have none to read */
+	if (info.iSerialNumber != 0)
+	{
+		libusb_device_handle* handle;
+		
+		if (libusb_open(dev, &handle) != LIBUSB_SUCCESS)    { return false; }
+		
+		unsigned char buffer[MAX_SERIAL];
+		
+		int status = libusb_get_string_descriptor_ascii(handle, info.iSerialNumber, buffer, MAX_SERIAL);
+		
+		libusb_close(handle);
+		
+		if (status < 0)    { return false; }
+		
+		identity.serial = std::string((char*) buffer, status);
+	}
+	
+	epicsMutexLock(this->lock);
+		this->identities[path] = identity;
+	epicsMutexUnlock(this->lock);
+	
+	*output = identity.serial;
+	return true;
+}
+
+
+/* Whatever gets plugged in to the same port next has to be read again */
+void usbService::forgetIdentity(libusb_device* dev)
+{
+	std::string path = usbService::portPath(dev);
+	
+	epicsMutexLock(this->lock);
+		this->identities.erase(path);
+	epicsMutexUnlock(this->lock);
+}
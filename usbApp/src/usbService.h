@@ -0,0 +1,98 @@
+#ifndef INC_USBSERVICE_H
+#define INC_USBSERVICE_H
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <libusb-1.0/libusb.h>
+
+#include <epicsMutex.h>
+#include <epicsEvent.h>
+
+class hidDriver;
+
+/** What's been read from a device, remembered until it leaves */
+typedef struct DeviceIdentity
+{
+	/* Addresses change on every enumeration, so a stale entry won't match */
+	uint8_t      address;
+	uint16_t     vendor;
+	uint16_t     product;
+	std::string  serial;
+} DeviceIdentity;
+
+/**
+ * Process-wide libusb context shared by every hidDriver.
+ *
+ * All ports submit asynchronous transfers against the same context and a
+ * small pool of event threads services the completions, so the number of
+ * threads doesn't grow with the number of devices.
+ *
+ * The service also acts as the connection manager. Drivers waiting for a
+ * device are queued here and offered devices as libusb reports them 
+ * arriving, while drivers using a device that leaves are queued back up
+ * to wait for it to return.
+ *
+ * Serial numbers are read from each device once and remembered by the
+ * bus and port the device is plugged into, so matching many identical
+ * devices against many ports doesn't open every device for every port.
+ */
+class usbService
+{
+	public:
+		static usbService* instance();
+		
+		libusb_context* context();
+		
+		void setThreads(unsigned amt);
+		void event_thread();
+		
+		void waitFor(hidDriver* driver);
+		void forget(hidDriver* driver);
+		
+		void connect_thread();
+		void hotplug(libusb_device* dev, libusb_hotplug_event event);
+		
+		bool reportLayouts(uint16_t vendor_id, uint16_t product_id, int interface_num, std::string* input, std::string* output);
+		void setLayoutCache(std::string directory);
+		
+		bool serialNumber(libusb_device* dev, std::string* output);
+		static std::string portPath(libusb_device* dev);
+		
+	private:
+		usbService();
+		
+		void scanBus(std::list<hidDriver*>& drivers);
+		double scanDelay();
+		
+		bool readReportDescriptor(uint16_t vendor_id, uint16_t product_id, int interface_num, std::vector<uint8_t>* output);
+		
+		void forgetIdentity(libusb_device* dev);
+		
+		libusb_context* ctx;
+		unsigned        threads;
+		bool            has_hotplug;
+		epicsMutexId    lock;
+		
+		/* Held for each pass of the connection thread */
+		epicsMutexId    offering;
+		
+		/* Connection manager state, protected by lock */
+		epicsEventId             changed;
+		std::list<hidDriver*>    drivers;
+		std::list<hidDriver*>    requests;
+		std::list<hidDriver*>    waiting;
+		std::list<libusb_device*> arrived;
+		std::list<libusb_device*> departed;
+		
+		/* Serial numbers already read, by port path */
+		std::map<std::string, DeviceIdentity> identities;
+		
+		/* Specs made from report descriptors, by vendor, product and interface */
+		std::map<std::string, std::pair<std::string, std::string> > layouts;
+		std::string              layout_dir;
+};
+
+#endif